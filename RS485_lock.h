@@ -10,12 +10,14 @@
 #ifndef __RS485_LOCK_H__
 #define __RS485_LOCK_H__
 
+#include "rs485bus.h"
+
 #ifdef __cplusplus
 #define extern "C" {		/* respect c++ callers */
 #endif
 
-extern char *devLCKfile;
-extern char *devLCKfileNew;
+extern __thread char *devLCKfile;
+extern __thread rs485_bus *serBus;
 
 extern void LockSer(const char *szttyDevice, const long unsigned int PID, int debug_flag);
 extern int  ClrSerLock(long unsigned int LckPID);
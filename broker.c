@@ -0,0 +1,237 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   broker.c                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Local bus broker over a Unix SOCK_SEQPACKET socket                      */
+/*                                                                            */
+/*   Each client sends one broker_request per meter and waits its reply.     */
+/*   Requests are served oldest first; every request queued for the same     */
+/*   meter at that time is merged into the same read, so a burst of clients */
+/*   asking for overlapping values costs one planned transaction. The reply  */
+/*   carries the raw registers, clients decode and print as they always did. */
+/*                                                                            */
+/* ========================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "broker.h"
+
+struct client {
+    int  fd;
+    int  pending;
+    unsigned long seq;             /* Arrival order of the pending request */
+    struct broker_request req;
+};
+
+/*--------------------------------------------------------------------------
+    sockAddr
+----------------------------------------------------------------------------*/
+static int sockAddr(const char *path, struct sockaddr_un *sa)
+{
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sa->sun_path, path);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    broker_listen
+    Listening socket at path. A socket file left by a dead broker is
+    replaced, a live broker gives EADDRINUSE.
+----------------------------------------------------------------------------*/
+int broker_listen(const char *path)
+{
+    struct sockaddr_un sa;
+    int fd, probe;
+
+    if (sockAddr(path, &sa) == -1) return -1;
+
+    if ((probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) return -1;
+    if (connect(probe, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+        close(probe);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    close(probe);
+    unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1) return -1;
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+        chmod(path, 0666) == -1 ||
+        listen(fd, BROKER_MAXCLIENTS) == -1) {
+        int errno_save = errno;
+        close(fd);
+        errno = errno_save;
+        return -1;
+    }
+    return fd;
+}
+
+/*--------------------------------------------------------------------------
+    mergeable
+    Request for the same meter, the holding register as well if any.
+----------------------------------------------------------------------------*/
+static int mergeable(const struct broker_request *a, const struct broker_request *b)
+{
+    return a->address == b->address && (b->holding == 0 || a->holding == 0 || a->holding == b->holding);
+}
+
+/*--------------------------------------------------------------------------
+    broker_serve
+    Serve clients on lfd until *stop, reading the bus with readfn. idle
+    is called once the bus had no request for BROKER_LINGER_MS.
+    Returns -1 on a poll error.
+----------------------------------------------------------------------------*/
+int broker_serve(int lfd, broker_read_fn readfn, broker_idle_fn idle,
+                 volatile sig_atomic_t *stop, struct broker_stats *stats)
+{
+    static struct client clients[BROKER_MAXCLIENTS];
+    struct pollfd fds[BROKER_MAXCLIENTS + 1];
+    struct broker_request merged;
+    struct broker_reply reply;
+    unsigned long seq = 0;
+    int nclients = 0, npending = 0, busy = 1;     // Called with the bus locked
+    int n, i, k, oldest, fd;
+    ssize_t rc;
+
+    while (!*stop) {
+        fds[0].fd = nclients < BROKER_MAXCLIENTS ? lfd : -1;
+        fds[0].events = POLLIN;
+        for (i=0; i < nclients; i++) {
+            fds[i+1].fd = clients[i].fd;
+            fds[i+1].events = clients[i].pending ? 0 : POLLIN;
+        }
+
+        n = poll(fds, nclients + 1, npending ? 0 : busy ? BROKER_LINGER_MS : -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0 && npending == 0) {
+            if (idle != NULL) idle();
+            busy = 0;
+            continue;
+        }
+
+        // Requests, or hangups of clients
+        for (i=nclients-1; i >= 0; i--) {
+            struct client *cl = &clients[i];
+
+            if (!(fds[i+1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            if (!cl->pending) {
+                rc = recv(cl->fd, &cl->req, sizeof(cl->req), MSG_DONTWAIT);
+                if (rc == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+                if (rc == sizeof(cl->req) && cl->req.version == BROKER_VERSION &&
+                    cl->req.address >= 1 && cl->req.address <= 247) {
+                    cl->pending = 1;
+                    cl->seq = ++seq;
+                    npending++;
+                    stats->requests++;
+                    continue;
+                }
+            } else {
+                npending--;
+            }
+            // Gone, or not speaking our protocol
+            close(cl->fd);
+            clients[i] = clients[--nclients];
+        }
+
+        // New clients, after the requests loop: fds[] no longer matches
+        if (fds[0].revents & POLLIN) {
+            while (nclients < BROKER_MAXCLIENTS &&
+                   (fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+                memset(&clients[nclients], 0, sizeof(clients[0]));
+                clients[nclients++].fd = fd;
+            }
+        }
+
+        if (npending == 0) continue;
+
+        // Oldest request, with every request for that meter queued so far
+        for (oldest=-1, i=0; i < nclients; i++)
+            if (clients[i].pending && (oldest == -1 || clients[i].seq < clients[oldest].seq)) oldest = i;
+        merged = clients[oldest].req;
+        for (i=0; i < nclients; i++) {
+            if (i == oldest || !clients[i].pending || !mergeable(&merged, &clients[i].req)) continue;
+            for (k=0; k < PLAN_MAXREG/2; k++) merged.slots[k] |= clients[i].req.slots[k];
+            if (merged.holding == 0) merged.holding = clients[i].req.holding;
+        }
+
+        memset(&reply, 0, sizeof(reply));
+        reply.version = BROKER_VERSION;
+        reply.status = readfn(&merged, &reply);
+        stats->transactions++;
+        if (reply.status != 0) stats->failed++;
+        busy = 1;
+
+        for (reply.merged=0, i=0; i < nclients; i++)
+            if (clients[i].pending && mergeable(&merged, &clients[i].req)) reply.merged++;
+        for (i=nclients-1; i >= 0; i--) {
+            if (!clients[i].pending || !mergeable(&merged, &clients[i].req)) continue;
+            clients[i].pending = 0;
+            npending--;
+            if (send(clients[i].fd, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(reply)) {
+                close(clients[i].fd);
+                clients[i] = clients[--nclients];
+            }
+        }
+    }
+
+    for (i=0; i < nclients; i++) close(clients[i].fd);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    broker_query
+    One read through the broker at path. -1 with errno if there is no
+    broker (ENOENT, ECONNREFUSED), no reply in timeout_ms (ETIMEDOUT) or
+    a reply of another version (EPROTO). The meter status is in reply.
+----------------------------------------------------------------------------*/
+int broker_query(const char *path, const struct broker_request *req,
+                 struct broker_reply *reply, int timeout_ms)
+{
+    struct sockaddr_un sa;
+    struct pollfd pfd;
+    int fd, rc = -1, errno_save;
+
+    if (sockAddr(path, &sa) == -1) return -1;
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) return -1;
+
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0 &&
+        send(fd, req, sizeof(*req), MSG_NOSIGNAL) == sizeof(*req)) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        while ((rc = poll(&pfd, 1, timeout_ms)) == -1 && errno == EINTR);
+        if (rc == 0) {
+            errno = ETIMEDOUT;
+            rc = -1;
+        } else if (rc == 1) {
+            if (recv(fd, reply, sizeof(*reply), 0) == sizeof(*reply) && reply->version == BROKER_VERSION) {
+                rc = 0;
+            } else {
+                errno = EPROTO;
+                rc = -1;
+            }
+        }
+    }
+    errno_save = errno;
+    close(fd);
+    errno = errno_save;
+    return rc;
+}
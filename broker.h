@@ -0,0 +1,65 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   broker.h                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Local bus broker: one process owns the serial port and serves register  */
+/*   reads to sdm120c --via-broker clients over a Unix socket                */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __BROKER_H__
+#define __BROKER_H__
+
+#include <stdint.h>
+#include <signal.h>
+
+#include "readplan.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define BROKER_VERSION    1
+#define BROKER_MAXCLIENTS 64
+#define BROKER_LINGER_MS  20       /* Bus kept after the last request, then released */
+
+/* One read of one meter, float registers by slot as RTU_ReadRegistersRequests */
+struct broker_request {
+    uint32_t version;
+    uint16_t address;              /* Meter */
+    uint16_t holding;              /* Holding register also read, 0 = none */
+    uint8_t  slots[PLAN_MAXREG/2];
+};
+
+struct broker_reply {
+    uint32_t version;
+    int32_t  status;               /* 0, -1 = meter didn't answer */
+    uint16_t merged;               /* Requests served by this transaction */
+    uint16_t holding_value;
+    uint8_t  available[PLAN_MAXREG/2];  /* Slots read, a superset of the request's */
+    uint16_t regs[PLAN_MAXREG];
+};
+
+/* Bus side, called with the union of the requests for one meter */
+typedef int  (*broker_read_fn)(const struct broker_request *req, struct broker_reply *reply);
+typedef void (*broker_idle_fn)(void);
+
+struct broker_stats {
+    unsigned long requests;
+    unsigned long transactions;
+    unsigned long failed;
+};
+
+extern int  broker_listen(const char *path);
+extern int  broker_serve(int lfd, broker_read_fn readfn, broker_idle_fn idle,
+                         volatile sig_atomic_t *stop, struct broker_stats *stats);
+extern int  broker_query(const char *path, const struct broker_request *req,
+                         struct broker_reply *reply, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __BROKER_H__ */
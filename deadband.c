@@ -0,0 +1,93 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   deadband.c                                                               */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Change only reporting: per value deadbands and a heartbeat             */
+/*                                                                            */
+/*   A value is reported when it moved from the one last reported by more  */
+/*   than its deadband, the larger of the absolute and the relative one,    */
+/*   or when it was not reported for the heartbeat. Values are compared to */
+/*   the last reported, not the last read, so a slow drift is reported     */
+/*   once it adds up to the deadband. Without a deadband a value is        */
+/*   reported when it prints differently.                                   */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "deadband.h"
+#include "output.h"
+
+/*--------------------------------------------------------------------------
+    deadband_parse
+    options=threshold, threshold[%] relative, i.e. p=5 or vc=1%.
+----------------------------------------------------------------------------*/
+int deadband_parse(struct deadband *db, const char *spec)
+{
+    const char *p;
+    char *end;
+    uint32_t opts = 0;
+    float t;
+    int i;
+
+    for (p=spec; *p && *p != '='; p++) {
+        for (i=0; i < SNAP_VALUES && out_fields[i].opt != *p; i++);
+        if (i == SNAP_VALUES) return -1;
+        opts |= 1U << i;
+    }
+    if (*p != '=' || p == spec) return -1;
+    t = strtof(p+1, &end);
+    if (end == p+1 || t < 0 || !isfinite(t)) return -1;
+    if (*end == '%') end++, t /= 100;
+    if (*end != '\0') return -1;
+
+    for (i=0; i < SNAP_VALUES; i++) {
+        if (!(opts & (1U << i))) continue;
+        if (end[-1] == '%') db->rel[i] = t;
+        else db->abs[i] = t;
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    cents
+    Value as printed with 2 decimals, without libm.
+----------------------------------------------------------------------------*/
+static long long cents(float v)
+{
+    return (long long)(v * 100 + (v < 0 ? -0.5f : 0.5f));
+}
+
+/*--------------------------------------------------------------------------
+    deadband_filter
+    The values in fields to report at time_us, remembered as reported.
+    Bits of fields past the values are kept.
+----------------------------------------------------------------------------*/
+uint32_t deadband_filter(const struct deadband *db, struct deadband_meter *m, int64_t time_us,
+                         const float value[], uint32_t fields)
+{
+    uint32_t report = fields & ~((1U << SNAP_VALUES) - 1);
+    float band;
+    int i, moved, due;
+
+    for (i=0; i < SNAP_VALUES; i++) {
+        if (!(fields & (1U << i))) continue;
+        band = db->rel[i] * fabsf(m->last[i]);
+        if (db->abs[i] > band) band = db->abs[i];
+        if (band > 0) moved = fabsf(value[i] - m->last[i]) > band;
+        else if (db->integer & (1U << i)) moved = (int)value[i] != (int)m->last[i];
+        else moved = cents(value[i]) != cents(m->last[i]);
+        due = db->heartbeat_s > 0 && (time_us < m->time_us[i] ||
+                                      time_us - m->time_us[i] >= db->heartbeat_s * 1000000LL);
+        if ((m->sent & (1U << i)) && !moved && !due) continue;
+        m->sent |= 1U << i;
+        m->last[i] = value[i];
+        m->time_us[i] = time_us;
+        report |= 1U << i;
+    }
+    return report;
+}
@@ -0,0 +1,45 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   deadband.h                                                               */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Change only reporting: per value deadbands and a heartbeat             */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __DEADBAND_H__
+#define __DEADBAND_H__
+
+#include <stdint.h>
+
+#include "shmsnap.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+/* Thresholds, in the unit printed (W, V, Wh...) */
+struct deadband {
+    float abs[SNAP_VALUES];        /* Move reported past this, 0 = any change */
+    float rel[SNAP_VALUES];        /* or past this fraction of the value reported */
+    long  heartbeat_s;             /* Reported again after this silence, 0 = never */
+    uint32_t integer;              /* Values printed as integers, else with 2 decimals */
+};
+
+/* Last values reported of a meter */
+struct deadband_meter {
+    uint32_t sent;                 /* Values reported once, SNAP_x bits */
+    float    last[SNAP_VALUES];
+    int64_t  time_us[SNAP_VALUES];
+};
+
+extern int      deadband_parse(struct deadband *db, const char *spec);
+extern uint32_t deadband_filter(const struct deadband *db, struct deadband_meter *m, int64_t time_us,
+                                const float value[], uint32_t fields);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __DEADBAND_H__ */
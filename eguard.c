@@ -0,0 +1,136 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   eguard.c                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Energy counter rollback guard, offsets kept across restarts            */
+/*                                                                            */
+/*   What metern's poolen485_2.php did per sample: an energy counter       */
+/*   reading below the last one (blackout, meter swapped or reset) raises  */
+/*   the counter offset by the difference, so the corrected counter never  */
+/*   goes back. Last readings and offsets of every meter are in a small     */
+/*   state file, written (fsync, rename) by the caller at once after a     */
+/*   correction and otherwise every EGUARD_SAVEPERIOD.                      */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eguard.h"
+
+#define EGUARD_MAGIC      "SDEG"
+#define EGUARD_VERSION    1
+
+struct eguard_header {
+    char     magic[4];
+    uint32_t version;
+    uint32_t meters;
+    uint32_t reserved;
+};
+
+/*--------------------------------------------------------------------------
+    eguard_load
+    -1 and an empty state if file is missing or not a state file.
+----------------------------------------------------------------------------*/
+int eguard_load(struct eguard *g, const char *file)
+{
+    struct eguard_header hdr;
+    FILE *fd;
+    int rc = -1;
+
+    memset(g, 0, sizeof(*g));
+    if ((fd = fopen(file, "r")) == NULL) return -1;
+    if (fread(&hdr, sizeof(hdr), 1, fd) == 1 &&
+        memcmp(hdr.magic, EGUARD_MAGIC, 4) == 0 &&
+        hdr.version == EGUARD_VERSION && hdr.meters == SNAP_METERS &&
+        fread(g->meter, sizeof(g->meter), 1, fd) == 1) {
+        rc = 0;
+    } else {
+        memset(g, 0, sizeof(*g));
+    }
+    fclose(fd);
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    eguard_save
+    Only if changed. Synced before it replaces the old file.
+----------------------------------------------------------------------------*/
+int eguard_save(struct eguard *g, const char *file)
+{
+    struct eguard_header hdr;
+    char tmpfile[strlen(file)+5];
+    FILE *fd;
+    int rc;
+
+    if (!g->dirty) return 0;
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, EGUARD_MAGIC, 4);
+    hdr.version = EGUARD_VERSION;
+    hdr.meters  = SNAP_METERS;
+
+    if ((fd = fopen(tmpfile, "w")) == NULL) return -1;
+    rc = (fwrite(&hdr, sizeof(hdr), 1, fd) == 1 && fwrite(g->meter, sizeof(g->meter), 1, fd) == 1 &&
+          fflush(fd) == 0 && fsync(fileno(fd)) == 0) ? 0 : -1;
+    if (fclose(fd) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmpfile, file);
+    if (rc != 0) remove(tmpfile);
+    else g->dirty = 0;
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    eguard_apply
+    Correct the guarded counters in raw (kWh, as read) of a reading at
+    time_us. A reading not newer than the last one (an older cached value)
+    gets the offsets only. Returns the counters that went back.
+----------------------------------------------------------------------------*/
+uint32_t eguard_apply(struct eguard *g, int address, int64_t time_us, float raw[], uint32_t fields)
+{
+    struct eguard_meter *m;
+    uint32_t corrected = 0;
+    double v;
+    int i, c;
+
+    if (address <= 0 || address >= SNAP_METERS || !(fields & EGUARD_FIELDS)) return 0;
+    m = &g->meter[address];
+    if (time_us <= m->time_us) {
+        eguard_offset(g, address, raw, fields);
+        return 0;
+    }
+
+    for (i=SNAP_IAENERGY, c=0; c < EGUARD_COUNTERS; i++, c++) {
+        if (!(fields & (1U << i))) continue;
+        v = raw[i] + m->offset[c];
+        if ((m->fields & (1U << i)) && v < m->last[c]) {
+            m->offset[c] += m->last[c] - v;
+            v = m->last[c];
+            corrected |= 1U << i;
+        }
+        m->last[c] = v;
+        raw[i] = v;
+    }
+    m->fields |= fields & EGUARD_FIELDS;
+    m->time_us = time_us;
+    if (corrected) m->corrections++;
+    g->dirty = 1;
+    return corrected;
+}
+
+/*--------------------------------------------------------------------------
+    eguard_offset
+    Add the offsets to the guarded counters in raw, state unchanged.
+----------------------------------------------------------------------------*/
+void eguard_offset(const struct eguard *g, int address, float raw[], uint32_t fields)
+{
+    int i, c;
+
+    if (address <= 0 || address >= SNAP_METERS) return;
+    for (i=SNAP_IAENERGY, c=0; c < EGUARD_COUNTERS; i++, c++)
+        if (fields & (1U << i)) raw[i] += g->meter[address].offset[c];
+}
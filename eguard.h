@@ -0,0 +1,50 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   eguard.h                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Energy counter rollback guard, offsets kept across restarts            */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __EGUARD_H__
+#define __EGUARD_H__
+
+#include <stdint.h>
+
+#include "shmsnap.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define EGUARD_SAVEPERIOD 60       /* s between state saves of a daemon */
+
+/* Counters guarded: import, export and total active energy */
+#define EGUARD_FIELDS     ((1U << SNAP_IAENERGY) | (1U << SNAP_EAENERGY) | (1U << SNAP_TAENERGY))
+#define EGUARD_COUNTERS   3
+
+struct eguard_meter {
+    int64_t  time_us;              /* Last reading accounted */
+    uint32_t fields;               /* Counters seen, SNAP_x bits */
+    uint32_t corrections;
+    double   last[EGUARD_COUNTERS]; /* kWh, corrected */
+    double   offset[EGUARD_COUNTERS]; /* kWh added to the meter reading */
+};
+
+struct eguard {
+    int dirty;                     /* Changed since eguard_save */
+    struct eguard_meter meter[SNAP_METERS];
+};
+
+extern int      eguard_load(struct eguard *g, const char *file);
+extern int      eguard_save(struct eguard *g, const char *file);
+extern uint32_t eguard_apply(struct eguard *g, int address, int64_t time_us, float raw[], uint32_t fields);
+extern void     eguard_offset(const struct eguard *g, int address, float raw[], uint32_t fields);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __EGUARD_H__ */
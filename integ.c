@@ -0,0 +1,154 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   integ.c                                                                  */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Fine energy counters: power integrated between energy register ticks  */
+/*                                                                            */
+/*   The meter counts energy in 10 Wh steps, further rounded by float32 on  */
+/*   large counters. Between two register changes (ticks) the power read   */
+/*   at every poll is integrated (trapezoids on the monotonic clock, import */
+/*   and export apart), the counter being the last register plus that      */
+/*   energy. A tick resets the integral to the register: a counter behind  */
+/*   jumps to it, one ahead holds until the integral catches up, so drift  */
+/*   never builds up and the counter never goes back.                       */
+/*                                                                            */
+/*   The counters are published in mWh, float32 would round them back to  */
+/*   1 Wh and worse on large counters. They are saved after every change so */
+/*   a restart goes on from the last counter instead of the register.      */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "integ.h"
+
+#define INTEG_MAGIC       "SDIN"
+#define INTEG_VERSION     1
+
+struct integ_header {
+    char     magic[4];
+    uint32_t version;
+    uint32_t meters;
+    uint32_t record_size;
+};
+
+/*--------------------------------------------------------------------------
+    integ_load
+    -1 and an empty state if file is missing or not a state file. Power
+    is not integrated across the restart.
+----------------------------------------------------------------------------*/
+int integ_load(struct integs *g, const char *file)
+{
+    struct integ_header hdr;
+    FILE *fd;
+    int rc = -1, i;
+
+    memset(g, 0, sizeof(*g));
+    if ((fd = fopen(file, "r")) == NULL) return -1;
+    if (fread(&hdr, sizeof(hdr), 1, fd) == 1 &&
+        memcmp(hdr.magic, INTEG_MAGIC, 4) == 0 && hdr.version == INTEG_VERSION &&
+        hdr.meters == SNAP_METERS && hdr.record_size == sizeof(struct integ) &&
+        fread(g->meter, sizeof(g->meter), 1, fd) == 1) {
+        for (i=0; i < SNAP_METERS; i++) g->meter[i].mono_us = 0;
+        rc = 0;
+    } else {
+        memset(g, 0, sizeof(*g));
+    }
+    fclose(fd);
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    integ_save
+----------------------------------------------------------------------------*/
+int integ_save(struct integs *g, const char *file)
+{
+    struct integ_header hdr;
+    char tmpfile[strlen(file)+5];
+    FILE *fd;
+    int rc;
+
+    if (!g->dirty) return 0;
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file);
+    memcpy(hdr.magic, INTEG_MAGIC, 4);
+    hdr.version     = INTEG_VERSION;
+    hdr.meters      = SNAP_METERS;
+    hdr.record_size = sizeof(struct integ);
+
+    if ((fd = fopen(tmpfile, "w")) == NULL) return -1;
+    rc = (fwrite(&hdr, sizeof(hdr), 1, fd) == 1 && fwrite(g->meter, sizeof(g->meter), 1, fd) == 1) ? 0 : -1;
+    if (fclose(fd) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmpfile, file);
+    if (rc != 0) remove(tmpfile);
+    else g->dirty = 0;
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    positiveWh
+    Energy of the positive part of a power going linearly from p0 to p1
+    in dt_s.
+----------------------------------------------------------------------------*/
+static double positiveWh(double p0, double p1, double dt_s)
+{
+    if (p0 >= 0 && p1 >= 0) return (p0 + p1) / 2 * dt_s / 3600;
+    if (p0 <= 0 && p1 <= 0) return 0;
+    // Crossing zero: the triangle on the positive side
+    if (p0 > 0) return p0 / 2 * (dt_s * p0 / (p0 - p1)) / 3600;
+    return p1 / 2 * (dt_s * p1 / (p1 - p0)) / 3600;
+}
+
+/*--------------------------------------------------------------------------
+    integ_sample
+    Account a poll of scaled values (W, Wh) of a meter read at mono_us.
+    The fine counters go to fine_mwh[] (import, export) and, float32
+    rounded, replace the energies in value[], added even if not read this
+    time. Returns fields with the counters published.
+----------------------------------------------------------------------------*/
+uint32_t integ_sample(struct integs *gs, int address, int64_t mono_us, float value[], uint32_t fields,
+                      int64_t fine_mwh[2])
+{
+    struct integ *g;
+    struct integ_counter *c;
+    double dt_s, wh[2];
+    int k, i;
+
+    if (address <= 0 || address >= SNAP_METERS) return fields;
+    g = &gs->meter[address];
+    if (fields & ((1U << SNAP_POWER) | INTEG_FIELDS)) gs->dirty = 1;
+
+    if (fields & (1U << SNAP_POWER)) {
+        dt_s = (mono_us - g->mono_us) / 1e6;
+        if (g->mono_us != 0 && dt_s > 0 && dt_s <= INTEG_MAXGAP) {
+            wh[0] = positiveWh(g->power, value[SNAP_POWER], dt_s);
+            wh[1] = positiveWh(-g->power, -value[SNAP_POWER], dt_s);
+            for (k=0; k < 2; k++) g->c[k].acc += wh[k];
+        }
+        g->mono_us = mono_us;
+        g->power = value[SNAP_POWER];
+    }
+
+    for (k=0, i=SNAP_IAENERGY; k < 2; k++, i++) {
+        c = &g->c[k];
+        if (fields & (1U << i)) {
+            if (!c->have) {
+                c->have = 1;
+                c->reg = c->fine = value[i];
+                c->acc = 0;
+            } else if (value[i] != c->reg) {
+                // Tick: back to the register
+                c->reg = value[i];
+                c->acc = 0;
+            }
+        }
+        if (!c->have) continue;
+        if (c->reg + c->acc > c->fine) c->fine = c->reg + c->acc;
+        fine_mwh[k] = (int64_t)(c->fine * 1000 + 0.5);
+        value[i] = c->fine;
+        fields |= 1U << i;
+    }
+    return fields;
+}
@@ -0,0 +1,54 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   integ.h                                                                  */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Fine energy counters: power integrated between energy register ticks  */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __INTEG_H__
+#define __INTEG_H__
+
+#include <stdint.h>
+
+#include "shmsnap.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define INTEG_MAXGAP      300      /* s, power samples further apart are not integrated */
+
+/* Counters refined: import and export active energy */
+#define INTEG_FIELDS      ((1U << SNAP_IAENERGY) | (1U << SNAP_EAENERGY))
+
+struct integ_counter {
+    int    have;                   /* Register read once */
+    double reg;                    /* Wh, register at the last tick */
+    double acc;                    /* Wh, power integrated since */
+    double fine;                   /* Wh, counter published, never decreasing */
+};
+
+struct integ {
+    int64_t mono_us;               /* Last power sample, 0 = none */
+    float   power;                 /* W, + import, - export */
+    struct integ_counter c[2];     /* Import, export */
+};
+
+struct integs {
+    int dirty;                     /* Changed since integ_save */
+    struct integ meter[SNAP_METERS];
+};
+
+extern int      integ_load(struct integs *g, const char *file);
+extern int      integ_save(struct integs *g, const char *file);
+extern uint32_t integ_sample(struct integs *g, int address, int64_t mono_us, float value[], uint32_t fields,
+                             int64_t fine_mwh[2]);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __INTEG_H__ */
@@ -0,0 +1,274 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   lockbench.c                                                              */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Serial port lock contention and fairness stress                         */
+/*                                                                            */
+/*   N contender processes loop on rs485_lock()/rs485_unlock() against a    */
+/*   lock file in a temp directory, holding the bus for a random time, the  */
+/*   first -H of them in the high priority class, the others normal.        */
+/*   Holders are killed at random and replaced, so stale lock clearing is   */
+/*   exercised too. Contenders report to the parent on one pipe:            */
+/*   "releasing" is sent before rs485_unlock() and "acquired" after          */
+/*   rs485_lock(), so two holders at once show up in order as an overlap.   */
+/*   At the end the lock file must be empty and no ticket file left.        */
+/*                                                                            */
+/*   Usage: lockbench [-n contenders] [-t seconds] [-h hold_ms] [-k kill_%]  */
+/*                    [-w lock_wait_s] [-H high_contenders]                  */
+/*                                                                            */
+/* ========================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include "rs485bus.h"
+#include "sched.h"
+
+#define MAXCONTENDERS   64
+#define BENCHDEVICE     "/dev/ttyBENCH"
+#define STARVE_SLACK_US 20000       /* Handoff allowance per contender ahead */
+
+enum { MSG_ACQUIRED, MSG_RELEASING };
+
+struct msg {
+    int  type;
+    int  prio;
+    pid_t pid;
+    long long t_req;
+    long long t_acq;
+};
+
+static volatile int *stop;
+static int hold_ms = 5;
+static int lock_wait = 10;
+
+/*--------------------------------------------------------------------------
+    contender
+----------------------------------------------------------------------------*/
+static void contender(int fd, int prio)
+{
+    rs485_bus *bus;
+    struct msg m;
+
+    m.pid = getpid();
+    m.prio = prio;
+    srand(m.pid);
+    if ((bus = rs485_open(BENCHDEVICE, prio)) == NULL) _exit(1);
+    while (!*stop) {
+        m.t_req = sched_now_us();
+        if (rs485_lock(bus, lock_wait) == -1) _exit(errno == ETIMEDOUT ? 2 : 1);
+        m.t_acq = sched_now_us();
+        m.type = MSG_ACQUIRED;
+        if (write(fd, &m, sizeof(m)) != sizeof(m)) _exit(1);
+
+        usleep(rand() % (hold_ms * 1000 + 1));
+
+        m.type = MSG_RELEASING;
+        if (write(fd, &m, sizeof(m)) != sizeof(m)) _exit(1);
+        rs485_unlock(bus);
+
+        usleep(rand() % (hold_ms * 1000 + 1));
+    }
+    rs485_close(bus);
+    _exit(0);
+}
+
+/*--------------------------------------------------------------------------
+    spawn
+----------------------------------------------------------------------------*/
+static pid_t spawn(int fd, int prio)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) contender(fd, prio);
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+/*--------------------------------------------------------------------------
+    report
+----------------------------------------------------------------------------*/
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*--------------------------------------------------------------------------
+    leftovers
+    Lines in the lock file and ticket files once every contender is gone.
+----------------------------------------------------------------------------*/
+static void leftovers(const char *dir, int *lines, int *tickets)
+{
+    char path[256];
+    struct dirent *de;
+    FILE *fd;
+    DIR *d;
+    int c;
+
+    *lines = 0; *tickets = 0;
+    snprintf(path, sizeof(path), "%s/LCK..ttyBENCH", dir);
+    if ((fd = fopen(path, "r")) != NULL) {
+        while ((c = fgetc(fd)) != EOF) if (c == '\n') (*lines)++;
+        fclose(fd);
+    }
+    if ((d = opendir(dir)) == NULL) return;
+    while ((de = readdir(d)) != NULL)
+        if (strstr(de->d_name, ".q") != NULL) (*tickets)++;
+    closedir(d);
+}
+
+/*--------------------------------------------------------------------------
+    main
+----------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    static const int classes[2] = { RS485_PRIO_HIGH, RS485_PRIO_NORMAL };
+    char dir[] = "/tmp/lockbenchXXXXXX";
+    char lckloc[sizeof(dir) + 8];
+    pid_t pids[MAXCONTENDERS], holder = 0, pid;
+    long long *wait_us[2] = { NULL, NULL }, t_start, t_end, t_killed = 0, reclaim, reclaim_max = 0, reclaim_sum = 0;
+    long long bound;
+    int ncontenders = 8, seconds = 5, kill_pct = 5, nhigh = 0;
+    int nwait[2] = { 0, 0 }, starved[2] = { 0, 0 };
+    int overlaps = 0, kills = 0, reclaims = 0, timeouts = 0;
+    int lines, tickets, status, pfd[2], c, i, k;
+    struct msg m;
+    char cmd[300];
+
+    while ((c = getopt(argc, argv, "n:t:h:k:w:H:")) != -1) {
+        switch (c) {
+            case 'n': ncontenders = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'h': hold_ms = atoi(optarg); break;
+            case 'k': kill_pct = atoi(optarg); break;
+            case 'w': lock_wait = atoi(optarg); break;
+            case 'H': nhigh = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n contenders] [-t seconds] [-h hold_ms] [-k kill_%%] [-w lock_wait_s] [-H high_contenders]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (ncontenders < 1 || ncontenders > MAXCONTENDERS || seconds < 1 || hold_ms < 0 ||
+        kill_pct < 0 || kill_pct > 100 || lock_wait < 1 || nhigh < 0 || nhigh > ncontenders) {
+        fprintf(stderr, "%s: bad arguments\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(lckloc, sizeof(lckloc), "%s/LCK..", dir);
+    rs485_set_lockdir(lckloc);
+
+    stop = mmap(NULL, sizeof(*stop), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stop == MAP_FAILED || pipe(pfd) == -1) {
+        perror("mmap/pipe");
+        exit(EXIT_FAILURE);
+    }
+    *stop = 0;
+    srand(getpid());
+
+    t_start = sched_now_us();
+    for (i=0; i < ncontenders; i++) pids[i] = spawn(pfd[1], classes[i >= nhigh]);
+
+    while (sched_now_us() - t_start < seconds * 1000000LL) {
+        if (read(pfd[0], &m, sizeof(m)) != sizeof(m)) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (m.type == MSG_RELEASING) {
+            if (m.pid == holder) holder = 0;
+            continue;
+        }
+
+        if (holder != 0) overlaps++;
+        holder = m.pid;
+        k = m.prio != RS485_PRIO_HIGH;
+        if ((nwait[k] % 1024) == 0) wait_us[k] = realloc(wait_us[k], (nwait[k] + 1024) * sizeof(*wait_us[k]));
+        wait_us[k][nwait[k]++] = m.t_acq - m.t_req;
+        if (t_killed) {
+            reclaim = m.t_acq - t_killed;
+            reclaim_sum += reclaim;
+            if (reclaim > reclaim_max) reclaim_max = reclaim;
+            reclaims++;
+            t_killed = 0;
+        }
+
+        // Kill the new holder now and then, its waiter must clear the stale line
+        if (rand() % 100 < kill_pct) {
+            kill(holder, SIGKILL);
+            waitpid(holder, NULL, 0);
+            t_killed = sched_now_us();
+            for (i=0; i < ncontenders; i++) if (pids[i] == holder) pids[i] = spawn(pfd[1], classes[i >= nhigh]);
+            holder = 0;
+            kills++;
+        }
+
+        // Contenders that gave up (-w) are replaced
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 2) timeouts++;
+            for (i=0; i < ncontenders; i++) if (pids[i] == pid) pids[i] = spawn(pfd[1], classes[i >= nhigh]);
+        }
+    }
+    t_end = sched_now_us();
+
+    // Let everyone finish the current round, then the queue must be empty
+    *stop = 1;
+    close(pfd[1]);
+    while (read(pfd[0], &m, sizeof(m)) == sizeof(m)) {
+        if (m.type == MSG_RELEASING) {
+            if (m.pid == holder) holder = 0;
+        } else {
+            if (holder != 0) overlaps++;
+            holder = m.pid;
+        }
+    }
+    for (i=0; i < ncontenders; i++) waitpid(pids[i], NULL, 0);
+    leftovers(dir, &lines, &tickets);
+
+    if (nwait[0] + nwait[1] == 0) {
+        printf("No lock acquired\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Lock       %d contenders (%d high), hold 0-%dms, kill %d%%, %ds\n", ncontenders, nhigh, hold_ms, kill_pct, seconds);
+    for (k=0; k < 2; k++) {
+        if (nwait[k] == 0) continue;
+        qsort(wait_us[k], nwait[k], sizeof(*wait_us[k]), cmp_ll);
+        // Starved: waited longer than every contender that may go first
+        // holding for the max time. A normal one waits for any high one.
+        bound = (k == 0 ? nhigh : nhigh > 0 ? -1 : ncontenders - 1) * (hold_ms * 1000LL + STARVE_SLACK_US);
+        for (i=0; bound >= 0 && i < nwait[k]; i++)
+            if (wait_us[k][i] > bound) starved[k]++;
+        printf("Acquire    %-6s p50 %6lldus  p90 %6lldus  p99 %6lldus  max %6lldms\n", rs485_class_name(classes[k]),
+               wait_us[k][nwait[k]/2], wait_us[k][nwait[k]*9/10], wait_us[k][nwait[k]*99/100], wait_us[k][nwait[k]-1] / 1000);
+    }
+    printf("Handoffs   %d, %.1f/s\n", nwait[0] + nwait[1], (nwait[0] + nwait[1]) * 1000000.0 / (t_end - t_start));
+    printf("Fairness   %d high, %d normal starved, %d timed out (-w %d)\n", starved[0], starved[1], timeouts, lock_wait);
+    printf("Stale      %d holders killed, %d reclaimed, mean %lldus max %lldus\n",
+           kills, reclaims, reclaims ? reclaim_sum / reclaims : 0, reclaim_max);
+    printf("Check      %d overlapping holders, %d lines and %d tickets left: %s\n",
+           overlaps, lines, tickets, overlaps == 0 && lines == 0 && tickets == 0 ? "OK" : "FAIL");
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) fprintf(stderr, "Can't remove %s\n", dir);
+    free(wait_us[0]); free(wait_us[1]);
+
+    return (overlaps == 0 && lines == 0 && tickets == 0) ? 0 : 1;
+}
@@ -25,12 +25,13 @@ char* getCurTime()
 {
     time_t curTimeValue;
     struct tm *ltime;
-    static struct timeval _t;
-    static struct timezone tz;
-    static char CurTime[100];
+    struct tm tmbuf;
+    static __thread struct timeval _t;
+    static __thread struct timezone tz;
+    static __thread char CurTime[100];
 
     time(&curTimeValue);
-    ltime = (struct tm *) localtime(&curTimeValue);
+    ltime = localtime_r(&curTimeValue, &tmbuf);
     gettimeofday(&_t, &tz);
 
     strftime(CurTime,100,"%Y%m%d-%H:%M:%S",ltime);
@@ -55,9 +56,8 @@ void log_message(const int log, const char* format, ...) {
     }
     
     if (log & debug_mask & DEBUG_STDERR) {
-       fprintf(stderr, "%s: %s(%lu) ", getCurTime(), programName, PID);
-       fprintf(stderr, buffer);
-       fprintf(stderr, "\n");
+       // One call, lines of several bus threads don't mix
+       fprintf(stderr, "%s: %s(%lu) %s\n", getCurTime(), programName, PID, buffer);
     }
     
     if (log & debug_mask & DEBUG_SYSLOG) {
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# Same output as pooler485.sh, but sdm120c runs once in daemon mode (-I)
+# keeping the serial port open, awk splits its compact output per meter.
+
+ADDRESSES="$1"
+BAUD_RATE="$2"
+DEVICE="$3"
+INTERVAL="${4:-5}"
+
+ADDR_OPT=""
+for ADDRESS in $(echo $ADDRESSES | tr "," "\n")
+do
+    ADDR_OPT="$ADDR_OPT -a $ADDRESS"
+done
+
+sdm120c $ADDR_OPT -I ${INTERVAL} -b ${BAUD_RATE} -z 10 -i -p -v -c -f -g -P E -q ${DEVICE} | \
+awk -v addrs="$ADDRESSES" '
+BEGIN { n = split(addrs, addr, ",") }
+{
+    ID = addr[(NR - 1) % n + 1]
+    # VOLTAGE CURRENT POWER FACTOR FREQUENCY ENERGY OK
+    if ($NF == "OK" && $6 != "0" && $6 != "" && $3 != "0" && $3 != "") {
+        FILE = "/run/shm/metern" ID ".txt"
+        printf("%s(%s*W)\n%s(%s*Wh)\n%s_1(%s*V)\n%s_2(%s*A)\n%s_3(%s*Hz)\n%s_4(%s*F)\n",
+               ID, $3, ID, $6, ID, $1, ID, $2, ID, $5, ID, $4) > FILE
+        close(FILE)
+    }
+}'
@@ -0,0 +1,209 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   meterstat.c                                                              */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Per meter latency, adaptive response timeout and inter-frame gap        */
+/*                                                                            */
+/*   Every successful transaction gives the meter turnaround: elapsed time   */
+/*   less the request and response bytes on the wire. The response timeout   */
+/*   of the next transaction is the wire time plus the high percentile of   */
+/*   the last turnarounds (x1.5) plus a margin, doubled at every retry and   */
+/*   never above -j. A dead meter then costs a few ms per retry.             */
+/*                                                                            */
+/*   The gap before a request is the RTU t3.5 silent interval from the      */
+/*   baud rate, or the per meter gap found by calibration (--calibrate).    */
+/*                                                                            */
+/*   State is kept in a small file next to the LCK.. file so one shot runs   */
+/*   learn too. It belongs to the calling thread, one per bus with -I.      */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "readplan.h"
+#include "meterstat.h"
+
+#define MSTAT_MAGIC    "SDMS"
+#define MSTAT_VERSION  2
+#define MSTAT_METERS   248
+
+struct mstat_header {
+    char     magic[4];
+    uint32_t version;
+    uint32_t baud;
+    uint32_t meters;
+};
+
+// Per bus thread, meter N of two buses are two meters
+static __thread struct meter_stat stats[MSTAT_METERS];
+static __thread struct bus_timing timing;
+
+/*--------------------------------------------------------------------------
+    mstat_wire_us
+    Bytes on the wire for a read of nregs registers.
+----------------------------------------------------------------------------*/
+static long mstat_wire_us(int nregs)
+{
+    return (8 + 5 + 2L * nregs) * plan_char_us(&timing);
+}
+
+/*--------------------------------------------------------------------------
+    mstat_init
+----------------------------------------------------------------------------*/
+void mstat_init(const struct bus_timing *bt)
+{
+    timing = *bt;
+    memset(stats, 0, sizeof(stats));
+}
+
+/*--------------------------------------------------------------------------
+    mstat_load
+    Samples taken at another baud rate are dropped.
+----------------------------------------------------------------------------*/
+int mstat_load(const char *file)
+{
+    struct mstat_header hdr;
+    FILE *fd;
+    int rc = -1;
+
+    if ((fd = fopen(file, "r")) == NULL) return -1;
+    if (fread(&hdr, sizeof(hdr), 1, fd) == 1 &&
+        memcmp(hdr.magic, MSTAT_MAGIC, 4) == 0 &&
+        hdr.version == MSTAT_VERSION && hdr.meters == MSTAT_METERS &&
+        hdr.baud == (uint32_t)timing.baud &&
+        fread(stats, sizeof(stats), 1, fd) == 1) {
+        rc = 0;
+    } else {
+        memset(stats, 0, sizeof(stats));
+    }
+    fclose(fd);
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    mstat_save
+----------------------------------------------------------------------------*/
+int mstat_save(const char *file)
+{
+    struct mstat_header hdr;
+    char tmpfile[strlen(file)+5];
+    FILE *fd;
+    int rc;
+
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file);
+    memcpy(hdr.magic, MSTAT_MAGIC, 4);
+    hdr.version = MSTAT_VERSION;
+    hdr.baud    = timing.baud;
+    hdr.meters  = MSTAT_METERS;
+
+    if ((fd = fopen(tmpfile, "w")) == NULL) return -1;
+    rc = (fwrite(&hdr, sizeof(hdr), 1, fd) == 1 && fwrite(stats, sizeof(stats), 1, fd) == 1) ? 0 : -1;
+    if (fclose(fd) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmpfile, file);
+    if (rc != 0) remove(tmpfile);
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    mstat_sample
+----------------------------------------------------------------------------*/
+void mstat_sample(int address, int nregs, long elapsed_us)
+{
+    struct meter_stat *ms;
+    long turnaround = elapsed_us - mstat_wire_us(nregs);
+
+    if (address <= 0 || address >= MSTAT_METERS) return;
+    ms = &stats[address];
+
+    ms->turnaround[ms->idx] = turnaround > 0 ? turnaround : 0;
+    ms->idx = (ms->idx + 1) % MSTAT_SAMPLES;
+    if (ms->n < MSTAT_SAMPLES) ms->n++;
+    ms->ok++;
+}
+
+/*--------------------------------------------------------------------------
+    mstat_fail
+----------------------------------------------------------------------------*/
+void mstat_fail(int address)
+{
+    if (address <= 0 || address >= MSTAT_METERS) return;
+    stats[address].fail++;
+}
+
+/*--------------------------------------------------------------------------
+    mstat_turnaround_us
+    Percentile of the last turnarounds, -1 when not enough samples.
+----------------------------------------------------------------------------*/
+long mstat_turnaround_us(int address, int percentile)
+{
+    const struct meter_stat *ms;
+    uint32_t sorted[MSTAT_SAMPLES];
+    uint32_t v;
+    int i, j;
+
+    if (address <= 0 || address >= MSTAT_METERS) return -1;
+    ms = &stats[address];
+    if (ms->n < MSTAT_MINSAMPLES) return -1;
+
+    // Insertion sort, at most MSTAT_SAMPLES values
+    for (i=0; i < ms->n; i++) {
+        v = ms->turnaround[i];
+        for (j=i; j > 0 && sorted[j-1] > v; j--) sorted[j] = sorted[j-1];
+        sorted[j] = v;
+    }
+    return sorted[(ms->n - 1) * percentile / 100];
+}
+
+/*--------------------------------------------------------------------------
+    mstat_timeout_us
+    Response timeout for attempt (1..) of a read of nregs registers.
+----------------------------------------------------------------------------*/
+long mstat_timeout_us(int address, int nregs, long max_us, int attempt)
+{
+    long turnaround = mstat_turnaround_us(address, MSTAT_PERCENTILE);
+    long timeout;
+
+    if (turnaround < 0) return max_us;
+
+    timeout = mstat_wire_us(nregs) + turnaround * 3 / 2 + MSTAT_MARGIN;
+    while (--attempt > 0 && timeout < max_us) timeout *= 2;
+    if (timeout > max_us) timeout = max_us;
+
+    stats[address].timeout_us = timeout;
+    return timeout;
+}
+
+/*--------------------------------------------------------------------------
+    mstat_gap_us
+    Bus idle time needed before sending a request to a meter.
+----------------------------------------------------------------------------*/
+long mstat_gap_us(int address)
+{
+    long t35 = plan_t35_us(&timing);
+
+    if (address <= 0 || address >= MSTAT_METERS) return t35;
+    return (long)stats[address].gap_us > t35 ? (long)stats[address].gap_us : t35;
+}
+
+/*--------------------------------------------------------------------------
+    mstat_set_gap
+----------------------------------------------------------------------------*/
+void mstat_set_gap(int address, long gap_us)
+{
+    if (address <= 0 || address >= MSTAT_METERS) return;
+    stats[address].gap_us = gap_us > 0 ? gap_us : 0;
+}
+
+/*--------------------------------------------------------------------------
+    mstat_get
+----------------------------------------------------------------------------*/
+const struct meter_stat *mstat_get(int address)
+{
+    if (address <= 0 || address >= MSTAT_METERS) return NULL;
+    return &stats[address];
+}
@@ -0,0 +1,54 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   meterstat.h                                                              */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Per meter latency, adaptive response timeout and inter-frame gap        */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __METERSTAT_H__
+#define __METERSTAT_H__
+
+#include <stdint.h>
+
+#include "readplan.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define MSTAT_SAMPLES     32       /* Turnaround samples kept per meter */
+#define MSTAT_MINSAMPLES  4        /* Below this the fixed -j timeout is used */
+#define MSTAT_PERCENTILE  95
+#define MSTAT_MARGIN      10000L   /* us added to scaled percentile */
+#define MSTAT_SAVEPERIOD  60       /* Seconds between state saves in daemon mode */
+#define MSTAT_MAXGAP      100000L  /* Max inter-frame gap searched by calibration (us) */
+
+struct meter_stat {
+    uint32_t turnaround[MSTAT_SAMPLES]; /* us, request sent to response received */
+    uint16_t n;
+    uint16_t idx;
+    uint32_t ok;
+    uint32_t fail;
+    uint32_t timeout_us;           /* Last adaptive timeout */
+    uint32_t gap_us;               /* Calibrated idle time before a request, 0 = t3.5 */
+};
+
+extern void mstat_init(const struct bus_timing *bt);
+extern int  mstat_load(const char *file);
+extern int  mstat_save(const char *file);
+extern void mstat_sample(int address, int nregs, long elapsed_us);
+extern void mstat_fail(int address);
+extern long mstat_turnaround_us(int address, int percentile);
+extern long mstat_timeout_us(int address, int nregs, long max_us, int attempt);
+extern long mstat_gap_us(int address);
+extern void mstat_set_gap(int address, long gap_us);
+extern const struct meter_stat *mstat_get(int address);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __METERSTAT_H__ */
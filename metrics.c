@@ -0,0 +1,194 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   metrics.c                                                                */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Minimal HTTP listener serving an OpenMetrics scrape page               */
+/*                                                                            */
+/*   One detached thread accepts scrapes one at a time and answers GET      */
+/*   /metrics with the page the render callback builds from memory, so a   */
+/*   scrape never waits for or touches the bus. HTTP/1.0, no keep-alive.    */
+/*                                                                            */
+/* ========================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+
+struct listener {
+    int lfd;
+    metrics_render_fn render;
+};
+
+/*--------------------------------------------------------------------------
+    metrics_listen
+    TCP listen socket on "[address:]port", METRICS_ADDR by default.
+    -1 and errno on failure.
+----------------------------------------------------------------------------*/
+int metrics_listen(const char *spec)
+{
+    struct addrinfo hints, *res;
+    char host[64];
+    const char *port = strrchr(spec, ':');
+    int fd, rc, on = 1;
+
+    if (port == NULL) {
+        snprintf(host, sizeof(host), "%s", METRICS_ADDR);
+        port = spec;
+    } else {
+        // [v6 address]:port
+        if (spec[0] == '[' && port > spec && port[-1] == ']') snprintf(host, sizeof(host), "%.*s", (int)(port - spec - 2), spec + 1);
+        else snprintf(host, sizeof(host), "%.*s", (int)(port - spec), spec);
+        port++;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE | AI_NUMERICSERV;
+    if ((rc = getaddrinfo(host, port, &hints, &res)) != 0) {
+        errno = rc == EAI_SYSTEM ? errno : EINVAL;
+        return -1;
+    }
+
+    if ((fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, res->ai_addr, res->ai_addrlen) == -1 || listen(fd, 8) == -1) {
+        int errno_save = errno;
+        close(fd);
+        freeaddrinfo(res);
+        errno = errno_save;
+        return -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/*--------------------------------------------------------------------------
+    readHead
+    Request line and headers, up to the blank line. Length or -1.
+----------------------------------------------------------------------------*/
+static int readHead(int fd, char *buf, int size)
+{
+    int len = 0;
+    ssize_t n;
+
+    while (len < size - 1) {
+        n = recv(fd, buf + len, size - 1 - len, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n") != NULL || strstr(buf, "\n\n") != NULL) return len;
+    }
+    buf[len] = '\0';
+    return len > 0 ? len : -1;
+}
+
+/*--------------------------------------------------------------------------
+    serveOne
+----------------------------------------------------------------------------*/
+static void serveOne(int fd, metrics_render_fn render, struct out_buf *reply, struct out_buf *page)
+{
+    char req[METRICS_MAXREQ];
+    char *path, *end;
+    int head;
+
+    if (readHead(fd, req, sizeof(req)) == -1) return;
+
+    head = strncmp(req, "HEAD ", 5) == 0;
+    if (strncmp(req, "GET ", 4) != 0 && !head) {
+        out_printf(reply, "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        out_flush(reply, fd);
+        return;
+    }
+    path = req + (head ? 5 : 4);
+    if ((end = strpbrk(path, " ?\r\n")) != NULL) *end = '\0';
+    if (strcmp(path, "/metrics") != 0 && strcmp(path, "/") != 0) {
+        out_printf(reply, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        out_flush(reply, fd);
+        return;
+    }
+
+    page->len = 0;
+    render(page);
+    out_printf(reply, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+               METRICS_TYPE, page->len);
+    if (!head && page->len) out_printf(reply, "%.*s", (int)page->len, page->data);
+    out_flush(reply, fd);
+}
+
+/*--------------------------------------------------------------------------
+    metricsThread
+----------------------------------------------------------------------------*/
+static void *metricsThread(void *arg)
+{
+    struct listener *l = arg;
+    struct timeval tv = { METRICS_TIMEOUT, 0 };
+    struct out_buf reply, page;
+    int fd;
+
+    memset(&reply, 0, sizeof(reply));
+    memset(&page, 0, sizeof(page));
+    for (;;) {
+        if ((fd = accept4(l->lfd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+                if (errno != EINTR && errno != ECONNABORTED) sleep(1);
+                continue;
+            }
+            break;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serveOne(fd, l->render, &reply, &page);
+        reply.len = 0;
+        close(fd);
+    }
+    out_free(&reply);
+    out_free(&page);
+    return NULL;
+}
+
+/*--------------------------------------------------------------------------
+    metrics_start
+    Serve lfd from a detached thread with every signal blocked, signals
+    stay with the pollers. 0, or -1 if the thread can't start.
+----------------------------------------------------------------------------*/
+int metrics_start(int lfd, metrics_render_fn render)
+{
+    static struct listener l;
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, saved;
+    int rc;
+
+    l.lfd = lfd;
+    l.render = render;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create(&thread, &attr, metricsThread, &l);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
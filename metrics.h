@@ -0,0 +1,35 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   metrics.h                                                                */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Minimal HTTP listener serving an OpenMetrics scrape page               */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "output.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define METRICS_ADDR      "127.0.0.1"   /* Listen address if only a port is given */
+#define METRICS_TIMEOUT   2        /* s, request read and reply write */
+#define METRICS_MAXREQ    4096     /* Request head read, the rest is ignored */
+#define METRICS_TYPE      "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/* Append the page, "# EOF" included, to the buffer */
+typedef void (*metrics_render_fn)(struct out_buf *page);
+
+extern int metrics_listen(const char *spec);
+extern int metrics_start(int lfd, metrics_render_fn render);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __METRICS_H__ */
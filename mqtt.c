@@ -0,0 +1,493 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   mqtt.c                                                                   */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   MQTT 3.1.1 publisher sink of the spooled json output                   */
+/*                                                                            */
+/*   Only what a publisher needs: CONNECT with a clean session, PUBLISH at  */
+/*   QoS 0, 1 or 2, PINGREQ and DISCONNECT. A record (the json objects of  */
+/*   one bus poll) is sent in one write and only counts as sent once every  */
+/*   publish of it is acknowledged, otherwise the spool sends it again on   */
+/*   a new connection, so QoS 1 and 2 are at least once across reconnects. */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "mqtt.h"
+
+#define MQTT_MAXFIELDS    64
+
+/* Packet types, first byte */
+#define MQTT_CONNECT      0x10
+#define MQTT_CONNACK      0x20
+#define MQTT_PUBLISH      0x30
+#define MQTT_PUBACK       0x40
+#define MQTT_PUBREC       0x50
+#define MQTT_PUBREL       0x62
+#define MQTT_PUBCOMP      0x70
+#define MQTT_PINGREQ      0xc0
+#define MQTT_PINGRESP     0xd0
+#define MQTT_DISCONNECT   0xe0
+
+struct mqtt {
+    char     prefix[128];
+    char     user[64];
+    char     pass[64];
+    char     id[64];
+    int      qos;
+    int      retain;
+    int      values;                /* One topic per value */
+    uint16_t pid;                   /* Last packet identifier */
+    time_t   last_io;               /* Monotonic s */
+    uint8_t *buf;                   /* Packets of a record */
+    size_t   len;
+    size_t   size;
+};
+
+/* A top level member of a json object */
+struct jfield {
+    const char *key;
+    int         klen;
+    const char *val;
+    int         vlen;
+};
+
+/*--------------------------------------------------------------------------
+    now
+----------------------------------------------------------------------------*/
+static time_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*--------------------------------------------------------------------------
+    put, putStr, putHeader
+    Packet bytes into m->buf. -1 if out of memory.
+----------------------------------------------------------------------------*/
+static int put(struct mqtt *m, const void *data, size_t len)
+{
+    if (m->len + len > m->size) {
+        size_t size = m->size ? m->size : 1024;
+        uint8_t *p;
+
+        while (size < m->len + len) size *= 2;
+        if ((p = realloc(m->buf, size)) == NULL) return -1;
+        m->buf = p;
+        m->size = size;
+    }
+    memcpy(m->buf + m->len, data, len);
+    m->len += len;
+    return 0;
+}
+
+static int putStr(struct mqtt *m, const char *s, size_t len)
+{
+    uint8_t l[2] = { len >> 8, len & 0xff };
+
+    return put(m, l, 2) == -1 ? -1 : put(m, s, len);
+}
+
+static int putHeader(struct mqtt *m, uint8_t type, size_t rem)
+{
+    uint8_t h[5];
+    int n = 0;
+
+    h[n++] = type;
+    do {
+        h[n] = rem & 0x7f;
+        rem >>= 7;
+        if (rem) h[n] |= 0x80;
+        n++;
+    } while (rem && n < 5);
+    return put(m, h, n);
+}
+
+/*--------------------------------------------------------------------------
+    readFull
+----------------------------------------------------------------------------*/
+static int readFull(int fd, uint8_t *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = recv(fd, buf, len, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == 0) errno = ECONNRESET;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) errno = ETIMEDOUT;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    readPacket
+    Next packet from the broker, its body in body. Type byte or -1.
+----------------------------------------------------------------------------*/
+static int readPacket(int fd, uint8_t *body, size_t size, size_t *len)
+{
+    uint8_t type, b;
+    size_t rem = 0;
+    int shift = 0;
+
+    if (readFull(fd, &type, 1) == -1) return -1;
+    do {
+        if (readFull(fd, &b, 1) == -1) return -1;
+        rem |= (size_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while ((b & 0x80) && shift < 28);
+    // Acknowledgements only, nothing is subscribed
+    if (rem > size) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (rem && readFull(fd, body, rem) == -1) return -1;
+    *len = rem;
+    return type;
+}
+
+/*--------------------------------------------------------------------------
+    mqttClose
+----------------------------------------------------------------------------*/
+static void mqttClose(struct sink *s)
+{
+    struct mqtt *m = s->priv;
+    static const uint8_t disconnect[2] = { MQTT_DISCONNECT, 0 };
+
+    if (s->fd != -1) {
+        send(s->fd, disconnect, sizeof(disconnect), MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(s->fd);
+    }
+    s->fd = -1;
+    free(m->buf);
+    m->buf = NULL;
+    m->len = m->size = 0;
+}
+
+/*--------------------------------------------------------------------------
+    mqttOpen
+    TCP connection and CONNECT, -1 and errno EACCES if the broker refuses
+    the credentials, ECONNREFUSED anything else.
+----------------------------------------------------------------------------*/
+static int mqttOpen(struct sink *s)
+{
+    struct mqtt *m = s->priv;
+    struct timeval tv = { SINK_TIMEOUT, 0 };
+    size_t ulen = strlen(m->user), plen = strlen(m->pass), ilen = strlen(m->id), len;
+    uint8_t var[10] = { 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, MQTT_KEEPALIVE >> 8, MQTT_KEEPALIVE & 0xff };
+    uint8_t ack[4];
+    int on = 1, type;
+
+    if (sink_tcp_open(s) == -1) return -1;
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (ulen) var[7] |= 0x80;
+    if (plen) var[7] |= 0x40;
+    m->len = 0;
+    if (putHeader(m, MQTT_CONNECT, sizeof(var) + 2 + ilen + (ulen ? 2 + ulen : 0) + (plen ? 2 + plen : 0)) == -1 ||
+        put(m, var, sizeof(var)) == -1 || putStr(m, m->id, ilen) == -1 ||
+        (ulen && putStr(m, m->user, ulen) == -1) || (plen && putStr(m, m->pass, plen) == -1) ||
+        sink_write(s->fd, m->buf, m->len, 1) == -1)
+        goto fail;
+
+    if ((type = readPacket(s->fd, ack, sizeof(ack), &len)) == -1) goto fail;
+    if (type != MQTT_CONNACK || len != 2) {
+        errno = EPROTO;
+        goto fail;
+    }
+    if (ack[1] != 0) {
+        errno = ack[1] == 4 || ack[1] == 5 ? EACCES : ECONNREFUSED;
+        goto fail;
+    }
+    m->last_io = now();
+    return 0;
+
+fail:
+    {
+        int errno_save = errno;
+
+        close(s->fd);
+        s->fd = -1;
+        errno = errno_save;
+    }
+    return -1;
+}
+
+/*--------------------------------------------------------------------------
+    ping
+    PINGREQ once idle half the keepalive, the broker drops a connection
+    after 1.5 keepalives without a packet.
+----------------------------------------------------------------------------*/
+static int ping(struct sink *s)
+{
+    static const uint8_t req[2] = { MQTT_PINGREQ, 0 };
+    struct mqtt *m = s->priv;
+    uint8_t body[4];
+    size_t len;
+    int type;
+
+    if (now() - m->last_io < MQTT_KEEPALIVE / 2) return 0;
+    if (sink_write(s->fd, req, sizeof(req), 1) == -1) return -1;
+    while ((type = readPacket(s->fd, body, sizeof(body), &len)) != -1) {
+        if (type == MQTT_PINGRESP) {
+            m->last_io = now();
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*--------------------------------------------------------------------------
+    scanObject
+    Top level members of the json object at p, flat as sdm120c prints it:
+    no blanks, no escapes in strings. Count or -1.
+----------------------------------------------------------------------------*/
+static int scanObject(const char *p, const char *end, struct jfield f[], int max)
+{
+    const char *q;
+    int n = 0, depth;
+
+    if (p >= end || *p++ != '{') return -1;
+    while (p < end && *p != '}') {
+        if (n == max || *p != '"' || (q = memchr(p + 1, '"', end - p - 1)) == NULL) return -1;
+        f[n].key = p + 1;
+        f[n].klen = q - p - 1;
+        p = q + 1;
+        if (p >= end || *p++ != ':') return -1;
+        q = p;
+        if (p < end && *p == '"') {
+            if ((q = memchr(p + 1, '"', end - p - 1)) == NULL) return -1;
+            q++;
+        } else if (p < end && *p == '{') {
+            for (depth = 0; q < end; q++) {
+                if (*q == '{') depth++;
+                else if (*q == '}' && --depth == 0) break;
+            }
+            if (q++ == end) return -1;
+        } else {
+            while (q < end && *q != ',' && *q != '}') q++;
+        }
+        f[n].val = p;
+        f[n].vlen = q - p;
+        n++;
+        p = q;
+        if (p < end && *p == ',') p++;
+    }
+    return p < end ? n : -1;
+}
+
+/*--------------------------------------------------------------------------
+    putPublish
+----------------------------------------------------------------------------*/
+static int putPublish(struct mqtt *m, const char *topic, int tlen, const char *payload, int plen)
+{
+    uint8_t id[2];
+
+    if (putHeader(m, MQTT_PUBLISH | m->qos << 1 | m->retain, 2 + tlen + (m->qos ? 2 : 0) + plen) == -1 ||
+        putStr(m, topic, tlen) == -1)
+        return -1;
+    if (m->qos) {
+        m->pid = m->pid % 65535 + 1;
+        id[0] = m->pid >> 8;
+        id[1] = m->pid & 0xff;
+        if (put(m, id, 2) == -1) return -1;
+    }
+    return put(m, payload, plen);
+}
+
+/*--------------------------------------------------------------------------
+    putLine
+    The publishes of one json line. Number of publishes, 0 for a line
+    that is no meter object, -1 if out of memory.
+----------------------------------------------------------------------------*/
+static int putLine(struct mqtt *m, const char *line, const char *end)
+{
+    struct jfield f[MQTT_MAXFIELDS];
+    const struct jfield *bus = NULL, *meter = NULL;
+    char topic[256];
+    int nf, i, tlen, n = 0;
+
+    if ((nf = scanObject(line, end, f, MQTT_MAXFIELDS)) <= 0) return 0;
+    for (i=0; i < nf; i++) {
+        if (f[i].klen == 3 && memcmp(f[i].key, "bus", 3) == 0 && f[i].vlen >= 2) bus = &f[i];
+        else if (f[i].klen == 5 && memcmp(f[i].key, "meter", 5) == 0) meter = &f[i];
+    }
+    if (bus == NULL || meter == NULL) return 0;
+    tlen = snprintf(topic, sizeof(topic), "%s/%.*s/%.*s", m->prefix, bus->vlen - 2, bus->val + 1, meter->vlen, meter->val);
+    if (tlen >= (int)sizeof(topic)) return 0;
+
+    if (!m->values) return putPublish(m, topic, tlen, line, end - line) == -1 ? -1 : 1;
+
+    for (i=0; i < nf; i++) {
+        const char *val = f[i].val;
+        int vlen = f[i].vlen, len;
+
+        if (&f[i] == bus || &f[i] == meter || (f[i].klen == 7 && memcmp(f[i].key, "time_us", 7) == 0)) continue;
+        if (vlen == 4 && memcmp(val, "null", 4) == 0) continue;
+        if (vlen >= 2 && val[0] == '"') {
+            val++;
+            vlen -= 2;
+        }
+        len = snprintf(topic + tlen, sizeof(topic) - tlen, "/%.*s", f[i].klen, f[i].key);
+        if (len >= (int)sizeof(topic) - tlen) continue;
+        if (putPublish(m, topic, tlen + len, val, vlen) == -1) return -1;
+        n++;
+    }
+    return n;
+}
+
+/*--------------------------------------------------------------------------
+    mqttSend
+    Publish every json object (line) of data, 0 once all are acknowledged.
+----------------------------------------------------------------------------*/
+static int mqttSend(struct sink *s, const void *data, size_t len)
+{
+    struct mqtt *m = s->priv;
+    const char *p = data, *end = p + len, *eol;
+    uint8_t body[4], rel[4] = { MQTT_PUBREL, 2 };
+    size_t blen;
+    int pending = 0, n, type;
+
+    if (ping(s) == -1) {
+        // Gone while idle, one new connection before giving the record back
+        s->close(s);
+        if (s->open(s) == -1) return -1;
+    }
+
+    m->len = 0;
+    for (; p < end; p = eol + 1) {
+        if ((eol = memchr(p, '\n', end - p)) == NULL) eol = end;
+        if ((n = putLine(m, p, eol)) == -1) return -1;
+        pending += n;
+    }
+    if (m->len == 0) return 0;
+    if (sink_write(s->fd, m->buf, m->len, 1) == -1) return -1;
+
+    while (m->qos && pending > 0) {
+        if ((type = readPacket(s->fd, body, sizeof(body), &blen)) == -1) return -1;
+        switch (type) {
+        case MQTT_PUBACK:
+        case MQTT_PUBCOMP:
+            pending--;
+            break;
+        case MQTT_PUBREC:
+            if (blen < 2) break;
+            rel[2] = body[0];
+            rel[3] = body[1];
+            if (sink_write(s->fd, rel, sizeof(rel), 1) == -1) return -1;
+            break;
+        }
+    }
+    m->last_io = now();
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    copy
+    -1 if src doesn't fit.
+----------------------------------------------------------------------------*/
+static int copy(char *dst, size_t size, const char *src)
+{
+    if (strlen(src) >= size) return -1;
+    strcpy(dst, src);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    mqtt_sink
+    Make s the MQTT sink of spec, the part after "mqtt://". -1 and errno
+    EINVAL if spec isn't one.
+----------------------------------------------------------------------------*/
+int mqtt_sink(struct sink *s, const char *spec)
+{
+    struct mqtt *m;
+    char buf[512], *auth, *path, *query, *at, *colon, *opt, *save;
+    char host[128], port[16];
+
+    if (snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf)) goto invalid;
+    if ((m = calloc(1, sizeof(*m))) == NULL) return -1;
+    s->priv = m;
+    snprintf(m->prefix, sizeof(m->prefix), "%s", MQTT_PREFIX);
+    snprintf(m->id, sizeof(m->id), "sdm120c-%d", (int)getpid());
+
+    if ((query = strchr(buf, '?')) != NULL) *query++ = '\0';
+    if ((path = strchr(buf, '/')) != NULL) {
+        *path++ = '\0';
+        while (*path && path[strlen(path) - 1] == '/') path[strlen(path) - 1] = '\0';
+        if (*path && copy(m->prefix, sizeof(m->prefix), path) == -1) goto invalid;
+    }
+    auth = buf;
+    if ((at = strrchr(buf, '@')) != NULL) {
+        *at = '\0';
+        if ((colon = strchr(buf, ':')) != NULL) {
+            *colon = '\0';
+            if (copy(m->pass, sizeof(m->pass), colon + 1) == -1) goto invalid;
+        }
+        if (copy(m->user, sizeof(m->user), buf) == -1) goto invalid;
+        auth = at + 1;
+    }
+    // host[:port], [v6 address][:port]
+    snprintf(port, sizeof(port), "%s", MQTT_PORT);
+    if (auth[0] == '[') {
+        if ((colon = strchr(auth, ']')) == NULL) goto invalid;
+        *colon++ = '\0';
+        if (*colon == ':' && copy(port, sizeof(port), colon + 1) == -1) goto invalid;
+        if (*colon && *colon != ':') goto invalid;
+        if (copy(host, sizeof(host), auth + 1) == -1) goto invalid;
+    } else {
+        if ((colon = strrchr(auth, ':')) != NULL) {
+            *colon = '\0';
+            if (copy(port, sizeof(port), colon + 1) == -1) goto invalid;
+        }
+        if (copy(host, sizeof(host), auth) == -1) goto invalid;
+    }
+    if (host[0] == '\0' || port[0] == '\0') goto invalid;
+
+    for (opt = query ? strtok_r(query, "&", &save) : NULL; opt != NULL; opt = strtok_r(NULL, "&", &save)) {
+        char *val = strchr(opt, '=');
+
+        if (val == NULL) goto invalid;
+        *val++ = '\0';
+        if (strcmp(opt, "qos") == 0 && strlen(val) == 1 && *val >= '0' && *val <= '2') m->qos = *val - '0';
+        else if (strcmp(opt, "retain") == 0 && strlen(val) == 1 && (*val == '0' || *val == '1')) m->retain = *val - '0';
+        else if (strcmp(opt, "values") == 0 && strlen(val) == 1 && (*val == '0' || *val == '1')) m->values = *val - '0';
+        else if (strcmp(opt, "id") == 0 && *val && copy(m->id, sizeof(m->id), val) == 0) continue;
+        else goto invalid;
+    }
+
+    s->host  = strdup(host);
+    s->port  = strdup(port);
+    s->json  = 1;
+    s->open  = mqttOpen;
+    s->send  = mqttSend;
+    s->close = mqttClose;
+    // Between polls longer than the keepalive too
+    s->tick  = ping;
+    // Logged on failures, without the password
+    snprintf(buf, sizeof(buf), "mqtt://%s:%s/%s", host, port, m->prefix);
+    free(s->spec);
+    s->spec = strdup(buf);
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
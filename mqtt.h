@@ -0,0 +1,36 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   mqtt.h                                                                   */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   MQTT 3.1.1 publisher sink of the spooled json output                   */
+/*                                                                            */
+/*   mqtt://[user[:password]@]host[:port][/prefix][?qos=0|1|2&retain=1      */
+/*   &values=1&id=client]: every json object of a record is published to   */
+/*   prefix/bus/meter, or with values=1 each of its values to               */
+/*   prefix/bus/meter/name. One connection, all publishes of a record in   */
+/*   one write, then their acknowledgements collected.                       */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __MQTT_H__
+#define __MQTT_H__
+
+#include "sink.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define MQTT_PORT         "1883"
+#define MQTT_PREFIX       "sdm120c"
+#define MQTT_KEEPALIVE    60       /* s, pinged when idle half of it, polling or not */
+
+extern int mqtt_sink(struct sink *s, const char *spec);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __MQTT_H__ */
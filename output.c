@@ -0,0 +1,407 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   output.c                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Readings output styles, built in a buffer and written at once          */
+/*                                                                            */
+/*   Every style is driven by out_fields[]. The text styles print exactly   */
+/*   what sdm120c always did; json, csv and influx carry the bus, meter     */
+/*   and read time of every sample, binary the values as the meter sent    */
+/*   them in sdmrec.h records. A poll is appended to one buffer and        */
+/*   written with a single write(2) by out_flush.                            */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "sdmrec.h"
+#include "rollup.h"
+#include "integ.h"
+
+const struct out_field out_fields[SNAP_VALUES] = {
+    {'v', "voltage",                "V",   "V",    "Voltage",                 "V",      0},
+    {'c', "current",                "C",   "A",    "Current",                 "A",      0},
+    {'p', "power",                  "P",   "W",    "Power",                   "W",      0},
+    {'l', "apparent_power",         "VA",  "VA",   "Active Apparent Power",   "VA",     0},
+    {'n', "reactive_power",         "VAR", "VAR",  "Reactive Apparent Power", "VAR",    0},
+    {'g', "power_factor",           "PF",  "F",    "Power Factor",            "",       0},
+    {'o', "phase_angle",            "PA",  "Dg",   "Phase Angle",             "Degree", 0},
+    {'f', "frequency",              "F",   "Hz",   "Frequency",               "Hz",     0},
+    {'i', "import_energy",          "IE",  "Wh",   "Import Active Energy",    "Wh",     1},
+    {'e', "export_energy",          "EE",  "Wh",   "Export Active Energy",    "Wh",     1},
+    {'t', "total_energy",           "TE",  "Wh",   "Total Active Energy",     "Wh",     1},
+    {'A', "import_reactive_energy", "IRE", "VARh", "Import Reactive Energy",  "VARh",   1},
+    {'B', "export_reactive_energy", "ERE", "VARh", "Export Reactive Energy",  "VARh",   1},
+    {'C', "total_reactive_energy",  "TRE", "VARh", "Total Reactive Energy",   "VARh",   1},
+    {'T', "display_time",           NULL,  "s",    "Display rotation time",   "",       1},
+};
+
+static const char *style_names[] = {
+    [OUT_JSON]   = "json",
+    [OUT_CSV]    = "csv",
+    [OUT_INFLUX] = "influx",
+    [OUT_BINARY] = "binary",
+};
+
+_Static_assert(SDMREC_VALUES == SNAP_VALUES, "sdmrec.h values differ from shmsnap.h");
+_Static_assert(sizeof(struct sdmrec) % 8 == 0 && sizeof(struct sdmrec_header) % 8 == 0,
+               "sdmrec.h records not 8 byte aligned in a stream");
+
+/*--------------------------------------------------------------------------
+    out_style
+    --format name, -1 if unknown.
+----------------------------------------------------------------------------*/
+int out_style(const char *name)
+{
+    int i;
+
+    for (i=OUT_JSON; i <= OUT_BINARY; i++)
+        if (strcmp(name, style_names[i]) == 0) return i;
+    return -1;
+}
+
+/*--------------------------------------------------------------------------
+    out_printf
+    Append to the buffer, grown as needed. Out of memory drops the text.
+----------------------------------------------------------------------------*/
+void out_printf(struct out_buf *b, const char *format, ...)
+{
+    va_list ap;
+    size_t size;
+    char *data;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(b->data ? b->data + b->len : NULL, b->size - b->len, format, ap);
+    va_end(ap);
+    if (n < 0 || b->len + n < b->size) {
+        if (n > 0) b->len += n;
+        return;
+    }
+
+    for (size = b->size ? b->size : 1024; size <= b->len + n; size *= 2);
+    if ((data = realloc(b->data, size)) == NULL) {
+        if (b->data) b->data[b->len] = '\0';
+        return;
+    }
+    b->data = data;
+    b->size = size;
+
+    va_start(ap, format);
+    vsnprintf(b->data + b->len, b->size - b->len, format, ap);
+    va_end(ap);
+    b->len += n;
+}
+
+/*--------------------------------------------------------------------------
+    out_append
+    Append len bytes as they are.
+----------------------------------------------------------------------------*/
+static void out_append(struct out_buf *b, const void *data, size_t len)
+{
+    size_t size;
+    char *p;
+
+    if (b->len + len >= b->size) {
+        for (size = b->size ? b->size : 1024; size <= b->len + len; size *= 2);
+        if ((p = realloc(b->data, size)) == NULL) return;
+        b->data = p;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/*--------------------------------------------------------------------------
+    out_integer
+    Value printed as an integer, not the --integrate energies.
+----------------------------------------------------------------------------*/
+static int out_integer(int i, uint32_t columns)
+{
+    return out_fields[i].integer && !((columns & OUT_INTEGRATED) && (INTEG_FIELDS & (1U << i)));
+}
+
+/*--------------------------------------------------------------------------
+    out_decimals
+    Decimals of a value not printed as an integer: the --integrate
+    energies to the mWh.
+----------------------------------------------------------------------------*/
+static int out_decimals(int i, uint32_t columns)
+{
+    return (columns & OUT_INTEGRATED) && (INTEG_FIELDS & (1U << i)) ? 3 : 2;
+}
+
+/*--------------------------------------------------------------------------
+    out_number
+    A value of a structured style, empty if not a number.
+----------------------------------------------------------------------------*/
+static void out_number(struct out_buf *b, int i, double value, const char *none, uint32_t columns)
+{
+    if (!isfinite(value)) out_printf(b, "%s", none);
+    else if (out_integer(i, columns)) out_printf(b, "%d", (int)value);
+    else out_printf(b, "%.*f", out_decimals(i, columns), value);
+}
+
+/*--------------------------------------------------------------------------
+    out_header
+    CSV column names: the values in fields, as out_sample columns.
+----------------------------------------------------------------------------*/
+void out_header(struct out_buf *b, int style, uint32_t fields)
+{
+    int i;
+
+    if (style != OUT_CSV) return;
+    out_printf(b, "time_us,bus,meter");
+    for (i=0; i < SNAP_VALUES; i++)
+        if (fields & (1U << i)) out_printf(b, ",%s", out_fields[i].name);
+    if (fields & OUT_CORRECTED) out_printf(b, ",corrected");
+    out_printf(b, "\n");
+}
+
+/*--------------------------------------------------------------------------
+    out_sample
+    The values in fields of one meter read at time_us. CSV rows have a
+    cell for every value in columns, empty for those not read this time.
+    OUT_CORRECTED in fields flags a sample the energy guard corrected,
+    OUT_INTEGRATED in columns prints the fine energies with decimals.
+    Doubles, so those keep their mWh on any counter.
+----------------------------------------------------------------------------*/
+void out_sample(struct out_buf *b, int style, const char *bus, int address, int64_t time_us,
+                const double value[], uint32_t fields, uint32_t columns)
+{
+    const struct out_field *f;
+    int i, n = 0;
+
+    switch (style) {
+    case OUT_JSON:
+        out_printf(b, "{\"bus\":\"%s\",\"meter\":%d,\"time_us\":%lld", bus, address, (long long)time_us);
+        for (i=0; i < SNAP_VALUES; i++) {
+            if (!(fields & (1U << i))) continue;
+            out_printf(b, ",\"%s\":", out_fields[i].name);
+            out_number(b, i, value[i], "null", columns);
+        }
+        if (fields & OUT_CORRECTED) out_printf(b, ",\"corrected\":true");
+        out_printf(b, "}\n");
+        return;
+
+    case OUT_CSV:
+        out_printf(b, "%lld,%s,%d", (long long)time_us, bus, address);
+        for (i=0; i < SNAP_VALUES; i++) {
+            if (!(columns & (1U << i))) continue;
+            out_printf(b, ",");
+            if (fields & (1U << i)) out_number(b, i, value[i], "", columns);
+        }
+        if (columns & OUT_CORRECTED) out_printf(b, ",%d", (fields & OUT_CORRECTED) != 0);
+        out_printf(b, "\n");
+        return;
+
+    case OUT_INFLUX:
+        for (i=0; i < SNAP_VALUES; i++) {
+            if (!(fields & (1U << i)) || !isfinite(value[i])) continue;
+            out_printf(b, n++ ? "," : "sdm120c,bus=%s,meter=%d ", bus, address);
+            out_printf(b, "%s=", out_fields[i].name);
+            out_number(b, i, value[i], "", columns);
+        }
+        if (n && (fields & OUT_CORRECTED)) out_printf(b, ",corrected=1");
+        if (n) out_printf(b, " %lld\n", (long long)time_us * 1000);
+        return;
+    }
+
+    for (i=0; i < SNAP_VALUES; i++) {
+        if (!(fields & (1U << i))) continue;
+        f = &out_fields[i];
+        if (f->iec == NULL) {
+            if (style == OUT_COMPACT) out_printf(b, "%d ", (int)value[i]);
+            else out_printf(b, "%s: %d\n", f->label, (int)value[i]);
+        } else if (style == OUT_METERN) {
+            if (out_integer(i, columns)) out_printf(b, "%d_%s(%d*%s)\n", address, f->iec, (int)value[i], f->unit);
+            else out_printf(b, "%d_%s(%3.*f*%s)\n", address, f->iec, out_decimals(i, columns), value[i], f->unit);
+        } else if (style == OUT_COMPACT) {
+            if (out_integer(i, columns)) out_printf(b, "%d ", (int)value[i]);
+            else out_printf(b, "%3.*f ", out_decimals(i, columns), value[i]);
+        } else {
+            if (out_integer(i, columns)) out_printf(b, "%s: %d %s%s\n", f->label, (int)value[i], f->vunit, *f->vunit ? " " : "");
+            else out_printf(b, "%s: %3.*f %s%s\n", f->label, out_decimals(i, columns), value[i], f->vunit, *f->vunit ? " " : "");
+        }
+    }
+}
+
+/*--------------------------------------------------------------------------
+    out_rollup_header
+    CSV column names of out_rollup rows.
+----------------------------------------------------------------------------*/
+void out_rollup_header(struct out_buf *b, int style, uint32_t columns)
+{
+    const char *name;
+    int i;
+
+    if (style != OUT_CSV) return;
+    out_printf(b, "time_us,bus,meter,window_s,samples");
+    for (i=0; i < SNAP_VALUES; i++) {
+        if (!(columns & ROLLUP_FIELDS & (1U << i))) continue;
+        name = out_fields[i].name;
+        if (ROLLUP_ENERGIES & (1U << i)) out_printf(b, ",%s_last,%s_delta", name, name);
+        else out_printf(b, ",%s_min,%s_max,%s_mean,%s_last", name, name, name, name);
+    }
+    out_printf(b, "\n");
+}
+
+/*--------------------------------------------------------------------------
+    out_rollup
+    A closed window of one meter, at its start time. Energies carry last
+    and delta, the other values min, max, mean and last. CSV rows have the
+    cells of every value in columns, empty for those without samples.
+----------------------------------------------------------------------------*/
+void out_rollup(struct out_buf *b, int style, const char *bus, int address,
+                const struct rollup *r, uint32_t columns)
+{
+    const struct rollup_stat *s;
+    const char *name;
+    float v[5];
+    int i, j, n;
+
+    switch (style) {
+    case OUT_JSON:
+        out_printf(b, "{\"bus\":\"%s\",\"meter\":%d,\"time_us\":%lld,\"window_s\":%d,\"samples\":%u",
+                   bus, address, (long long)r->start_us, r->window_s, r->samples);
+        break;
+    case OUT_CSV:
+        out_printf(b, "%lld,%s,%d,%d,%u", (long long)r->start_us, bus, address, r->window_s, r->samples);
+        break;
+    case OUT_INFLUX:
+        out_printf(b, "sdm120c_rollup,bus=%s,meter=%d,window=%d samples=%u", bus, address, r->window_s, r->samples);
+        break;
+    default:
+        return;
+    }
+
+    for (i=0; i < SNAP_VALUES; i++) {
+        static const char *const stats[2][4] = { {"min", "max", "mean", "last"}, {"last", "delta"} };
+        int energy = (ROLLUP_ENERGIES & (1U << i)) != 0;
+
+        if (!(columns & ROLLUP_FIELDS & (1U << i))) continue;
+        s = &r->stat[i];
+        name = out_fields[i].name;
+        if (!(r->fields & (1U << i))) {
+            if (style == OUT_CSV) out_printf(b, energy ? ",," : ",,,,");
+            continue;
+        }
+        if (energy) {
+            v[0] = s->last;
+            v[1] = s->delta;
+            n = 2;
+        } else {
+            v[0] = s->min;
+            v[1] = s->max;
+            v[2] = s->sum / s->count;
+            v[3] = s->last;
+            n = 4;
+        }
+
+        if (style == OUT_JSON) out_printf(b, ",\"%s\":{", name);
+        for (j=0; j < n; j++) {
+            if (style == OUT_INFLUX && !isfinite(v[j])) continue;
+            if (style == OUT_JSON) out_printf(b, "%s\"%s\":", j ? "," : "", stats[energy][j]);
+            else if (style == OUT_INFLUX) out_printf(b, ",%s_%s=", name, stats[energy][j]);
+            else out_printf(b, ",");
+            out_number(b, i, v[j], style == OUT_JSON ? "null" : "", columns);
+        }
+        if (style == OUT_JSON) out_printf(b, "}");
+    }
+
+    if (style == OUT_JSON) out_printf(b, "}\n");
+    else if (style == OUT_INFLUX) out_printf(b, " %lld\n", (long long)r->start_us * 1000);
+    else out_printf(b, "\n");
+}
+
+/*--------------------------------------------------------------------------
+    out_rec_header
+    Start of a binary stream, bus names by sdmrec.bus index.
+----------------------------------------------------------------------------*/
+void out_rec_header(struct out_buf *b, const char *const bus[], int nbuses)
+{
+    struct sdmrec_header hdr;
+    int i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SDMREC_MAGIC, 4);
+    hdr.version     = htole16(SDMREC_VERSION);
+    hdr.header_size = htole16(sizeof(struct sdmrec_header));
+    hdr.record_size = htole16(sizeof(struct sdmrec));
+    hdr.values      = htole16(SDMREC_VALUES);
+    if (nbuses > SDMREC_MAXBUSES) nbuses = SDMREC_MAXBUSES;
+    hdr.nbuses      = htole16(nbuses);
+    for (i=0; i < nbuses; i++) snprintf(hdr.bus[i], sizeof(hdr.bus[i]), "%s", bus[i]);
+    out_append(b, &hdr, sizeof(hdr));
+}
+
+/*--------------------------------------------------------------------------
+    out_record
+    One binary record, raw values as read from the meter.
+----------------------------------------------------------------------------*/
+void out_record(struct out_buf *b, int bus, int address, int64_t mono_us, int64_t wall_us,
+                const float raw[], uint32_t fields)
+{
+    struct sdmrec rec;
+    int i;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.address = address;
+    rec.bus     = bus;
+    rec.fields  = fields & ~OUT_CORRECTED;
+    rec.flags   = fields & OUT_CORRECTED ? SDMREC_CORRECTED : 0;
+    rec.mono_us = mono_us;
+    rec.wall_us = wall_us;
+    for (i=0; i < SDMREC_VALUES; i++)
+        if (fields & (1U << i)) rec.value[i] = raw[i];
+    sdmrec_encode(&rec);
+    out_append(b, &rec, sizeof(rec));
+}
+
+/*--------------------------------------------------------------------------
+    out_status
+    OK/NOK ending the text output, none for -m and structured styles.
+----------------------------------------------------------------------------*/
+void out_status(struct out_buf *b, int style, int ok)
+{
+    if (style == OUT_VERBOSE || style == OUT_COMPACT) out_printf(b, ok ? "OK\n" : "NOK\n");
+}
+
+/*--------------------------------------------------------------------------
+    out_flush
+    Write the buffer to fd and empty it. One write(2) unless the reader
+    takes less at a time.
+----------------------------------------------------------------------------*/
+int out_flush(struct out_buf *b, int fd)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < b->len) {
+        n = write(fd, b->data + done, b->len - done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    n = done == b->len ? 0 : -1;
+    b->len = 0;
+    return n;
+}
+
+/*--------------------------------------------------------------------------
+    out_free
+----------------------------------------------------------------------------*/
+void out_free(struct out_buf *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
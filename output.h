@@ -0,0 +1,79 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   output.h                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Readings output styles, built in a buffer and written at once          */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "shmsnap.h"
+#include "rollup.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+/* Output styles */
+enum {
+    OUT_VERBOSE,                   /* Voltage: 230.00 V */
+    OUT_COMPACT,                   /* -q, 230.00 on one line */
+    OUT_METERN,                    /* -m, 1_V(230.00*V) */
+    OUT_JSON,                      /* One object per meter and poll */
+    OUT_CSV,                       /* Header once, one row per meter and poll */
+    OUT_INFLUX,                    /* InfluxDB line protocol */
+    OUT_BINARY                     /* sdmrec.h records */
+};
+
+/* Values, SNAP_x order */
+struct out_field {
+    char opt;                      /* sdm120c option letter */
+    const char *name;              /* json, csv and influx key */
+    const char *iec;               /* -m id, NULL if not printed */
+    const char *unit;
+    const char *label;             /* Verbose output */
+    const char *vunit;             /* Verbose unit, "" for none */
+    int  integer;                  /* Printed as an integer */
+};
+
+extern const struct out_field out_fields[SNAP_VALUES];
+
+/* Sample fields: energy counter corrected by --energy-guard. Columns: csv
+   has a corrected column */
+#define OUT_CORRECTED     (1U << 31)
+/* Columns: import and export energy from --integrate, with decimals */
+#define OUT_INTEGRATED    (1U << 30)
+
+struct out_buf {
+    char  *data;
+    size_t len;
+    size_t size;
+};
+
+extern int  out_style(const char *name);
+extern void out_printf(struct out_buf *b, const char *format, ...) __attribute__((format(printf, 2, 3)));
+extern void out_header(struct out_buf *b, int style, uint32_t fields);
+extern void out_sample(struct out_buf *b, int style, const char *bus, int address, int64_t time_us,
+                       const double value[], uint32_t fields, uint32_t columns);
+extern void out_rollup_header(struct out_buf *b, int style, uint32_t columns);
+extern void out_rollup(struct out_buf *b, int style, const char *bus, int address,
+                       const struct rollup *r, uint32_t columns);
+extern void out_rec_header(struct out_buf *b, const char *const bus[], int nbuses);
+extern void out_record(struct out_buf *b, int bus, int address, int64_t mono_us, int64_t wall_us,
+                       const float raw[], uint32_t fields);
+extern void out_status(struct out_buf *b, int style, int ok);
+extern int  out_flush(struct out_buf *b, int fd);
+extern void out_free(struct out_buf *b);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __OUTPUT_H__ */
@@ -0,0 +1,170 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   readplan.c                                                               */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Split requested registers in the cheapest set of RTU read transactions  */
+/*                                                                            */
+/*   Every transaction costs a fixed overhead (request frame, response       */
+/*   header and CRC, two t3.5 silent intervals, meter turnaround and the     */
+/*   expected share of a lost response timeout), every register read costs   */
+/*   2 chars on the wire. Bridging a gap between two requested registers is  */
+/*   worth it only while the gap bytes cost less than a new transaction.     */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "readplan.h"
+
+/*--------------------------------------------------------------------------
+    plan_timing_init
+----------------------------------------------------------------------------*/
+void plan_timing_init(struct bus_timing *bt, int baud, char parity, int stop_bits, long resp_timeout_us)
+{
+    bt->baud            = baud;
+    bt->parity          = parity;
+    bt->stop_bits       = stop_bits;
+    bt->turnaround_us   = PLAN_TURNAROUND;
+    bt->resp_timeout_us = resp_timeout_us;
+    bt->fail_rate       = PLAN_FAILRATE;
+    bt->max_regs        = PLAN_MAXREGS;
+}
+
+/*--------------------------------------------------------------------------
+    plan_char_us
+    Time of one char on the wire: start + 8 data + parity + stop bits.
+----------------------------------------------------------------------------*/
+long plan_char_us(const struct bus_timing *bt)
+{
+    int bits = 1 + 8 + (bt->parity != 'N' ? 1 : 0) + bt->stop_bits;
+
+    return (bits * 1000000L + bt->baud - 1) / bt->baud;
+}
+
+/*--------------------------------------------------------------------------
+    plan_t35_us
+    Modbus RTU silent interval between frames, fixed above 19200 baud.
+----------------------------------------------------------------------------*/
+long plan_t35_us(const struct bus_timing *bt)
+{
+    if (bt->baud > 19200) return 1750L;
+    return (plan_char_us(bt) * 7 + 1) / 2;
+}
+
+/*--------------------------------------------------------------------------
+    plan_transaction_us
+    Estimated bus time for one read of nregs registers.
+----------------------------------------------------------------------------*/
+long plan_transaction_us(const struct bus_timing *bt, int nregs)
+{
+    long chars = 8 + 5 + 2L * nregs;   /* Request: id fc addr(2) nb(2) crc(2), Response: id fc count crc(2) + data */
+
+    return chars * plan_char_us(bt) + 2 * plan_t35_us(bt) + bt->turnaround_us
+           + bt->resp_timeout_us * bt->fail_rate / 10000;
+}
+
+/*--------------------------------------------------------------------------
+    plan_clear
+----------------------------------------------------------------------------*/
+void plan_clear(struct read_plan *plan)
+{
+    memset(plan, 0, sizeof(*plan));
+}
+
+/*--------------------------------------------------------------------------
+    plan_add
+    Append a window as is.
+----------------------------------------------------------------------------*/
+int plan_add(struct read_plan *plan, const struct bus_timing *bt, int function, int start, int count)
+{
+    struct plan_window *w;
+
+    if (plan->nwindows >= PLAN_MAXWINDOWS) return -1;
+
+    w = &plan->window[plan->nwindows++];
+    w->function = function;
+    w->start    = start;
+    w->count    = count;
+    w->cost_us  = plan_transaction_us(bt, count);
+    plan->total_us += w->cost_us;
+
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    plan_build
+    Append the cheapest windows covering requests[], one entry per float
+    (2 registers) starting at register 0. Optimal partition by dynamic
+    programming over the requested slots: best[j] is the cheapest cost to
+    cover the first j of them, the last window spanning slot i..j-1.
+    Returns the number of windows appended, -1 if they don't fit.
+----------------------------------------------------------------------------*/
+int plan_build(struct read_plan *plan, const struct bus_timing *bt, int function,
+               const unsigned char requests[], int nslots)
+{
+    int  slot[nslots];
+    long best[nslots+1];
+    int  from[nslots+1];
+    int  n = 0;
+    int  i, j, span, added;
+    long cost;
+
+    for (i=0; i<nslots; i++)
+        if (requests[i]) slot[n++] = i;
+
+    best[0] = 0;
+    for (j=1; j<=n; j++) {
+        best[j] = -1;
+        for (i=j-1; i>=0; i--) {
+            span = 2 * (slot[j-1] - slot[i] + 1);
+            if (span > bt->max_regs) break;
+            cost = best[i] + plan_transaction_us(bt, span);
+            if (best[j] == -1 || cost < best[j]) {
+                best[j] = cost;
+                from[j] = i;
+            }
+        }
+    }
+
+    // Walk back the chosen windows, then append them in register order
+    added = 0;
+    for (j=n; j>0; j=from[j]) added++;
+    if (plan->nwindows + added > PLAN_MAXWINDOWS) return -1;
+
+    i = plan->nwindows + added;
+    for (j=n; j>0; j=from[j]) {
+        struct plan_window *w = &plan->window[--i];
+        w->function = function;
+        w->start    = 2 * slot[from[j]];
+        w->count    = 2 * (slot[j-1] - slot[from[j]] + 1);
+        w->cost_us  = plan_transaction_us(bt, w->count);
+        plan->total_us += w->cost_us;
+    }
+    plan->nwindows += added;
+
+    return added;
+}
+
+/*--------------------------------------------------------------------------
+    plan_print
+    --plan explain output.
+----------------------------------------------------------------------------*/
+void plan_print(FILE *out, const struct read_plan *plan, const struct bus_timing *bt)
+{
+    int i;
+
+    fprintf(out, "Read plan: %d transaction(s) at %d 8%c%d, char %ldus, t3.5 %ldus, turnaround %ldus\n",
+            plan->nwindows, bt->baud, bt->parity, bt->stop_bits,
+            plan_char_us(bt), plan_t35_us(bt), bt->turnaround_us);
+    for (i=0; i<plan->nwindows; i++) {
+        const struct plan_window *w = &plan->window[i];
+        int base = w->function == PLAN_FC_INPUT ? 30001 : 400001;
+        fprintf(out, "  FC%02X 0x%04X-0x%04X %3d reg(s) (%d-%d) ~%ldus\n",
+                w->function, w->start, w->start + w->count - 1, w->count,
+                base + w->start, base + w->start + w->count - 1, w->cost_us);
+    }
+    fprintf(out, "Estimated bus time: %ldus per meter\n", plan->total_us);
+}
@@ -0,0 +1,68 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   readplan.h                                                               */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Split requested registers in the cheapest set of RTU read transactions  */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __READPLAN_H__
+#define __READPLAN_H__
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define PLAN_FC_HOLDING   0x03     /* modbus_read_registers */
+#define PLAN_FC_INPUT     0x04     /* modbus_read_input_registers */
+
+#define PLAN_MAXREG       0x0160   /* Input registers map size, TRENERGY included */
+#define PLAN_MAXREGS      0x50     /* Max regs in 1 RTU transaction */
+#define PLAN_MAXWINDOWS   32
+
+#define PLAN_TURNAROUND   30000L   /* Default meter turnaround estimate (us) */
+#define PLAN_FAILRATE     100      /* Default transaction failure rate (1/10000) */
+
+struct bus_timing {
+    int  baud;
+    char parity;
+    int  stop_bits;
+    long turnaround_us;            /* Request end to response start */
+    long resp_timeout_us;          /* Lost on a failed transaction */
+    int  fail_rate;                /* Failed transactions every 10000 */
+    int  max_regs;                 /* Max registers in one transaction */
+};
+
+struct plan_window {
+    int  function;                 /* PLAN_FC_INPUT or PLAN_FC_HOLDING */
+    int  start;                    /* First register */
+    int  count;                    /* Number of registers */
+    long cost_us;                  /* Estimated bus time */
+};
+
+struct read_plan {
+    int  nwindows;
+    struct plan_window window[PLAN_MAXWINDOWS];
+    long total_us;
+};
+
+extern void plan_timing_init(struct bus_timing *bt, int baud, char parity, int stop_bits, long resp_timeout_us);
+extern long plan_char_us(const struct bus_timing *bt);
+extern long plan_t35_us(const struct bus_timing *bt);
+extern long plan_transaction_us(const struct bus_timing *bt, int nregs);
+
+extern void plan_clear(struct read_plan *plan);
+extern int  plan_build(struct read_plan *plan, const struct bus_timing *bt, int function,
+                       const unsigned char requests[], int nslots);
+extern int  plan_add(struct read_plan *plan, const struct bus_timing *bt, int function, int start, int count);
+extern void plan_print(FILE *out, const struct read_plan *plan, const struct bus_timing *bt);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __READPLAN_H__ */
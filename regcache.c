@@ -0,0 +1,174 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   regcache.c                                                               */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Register blocks read by recent runs, for --max-age                      */
+/*                                                                            */
+/*   Blocks are keyed by meter, function and register window, and kept in  */
+/*   a small file next to the LCK.. file. A window is served by any block   */
+/*   of the same meter and function holding all of its registers. Loads    */
+/*   share-lock the file; saves lock it exclusively, merge the blocks this  */
+/*   run stored into what other runs saved meanwhile and write it back.     */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/file.h>
+
+#include "regcache.h"
+
+struct rcache_header {
+    char     magic[4];
+    uint32_t version;
+    uint32_t entries;
+    uint32_t entry_size;
+};
+
+static __thread struct rcache_entry cache[RCACHE_ENTRIES];
+static __thread long long loaded_us;   /* Ages are taken at load time */
+
+/*--------------------------------------------------------------------------
+    rcache_now_us
+----------------------------------------------------------------------------*/
+static long long rcache_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*--------------------------------------------------------------------------
+    rcache_read
+    Entries of an open cache file, cleared if missing or of another layout.
+----------------------------------------------------------------------------*/
+static int rcache_read(int fd, struct rcache_entry *entries)
+{
+    struct rcache_header hdr;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        memcmp(hdr.magic, RCACHE_MAGIC, 4) == 0 && hdr.version == RCACHE_VERSION &&
+        hdr.entries == RCACHE_ENTRIES && hdr.entry_size == sizeof(struct rcache_entry) &&
+        pread(fd, entries, RCACHE_ENTRIES * sizeof(*entries), sizeof(hdr)) == RCACHE_ENTRIES * sizeof(*entries))
+        return 0;
+    memset(entries, 0, RCACHE_ENTRIES * sizeof(*entries));
+    return -1;
+}
+
+/*--------------------------------------------------------------------------
+    rcache_load
+----------------------------------------------------------------------------*/
+int rcache_load(const char *file)
+{
+    int fd, rc;
+
+    memset(cache, 0, sizeof(cache));
+    loaded_us = rcache_now_us();
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1) return -1;
+    while (flock(fd, LOCK_SH) == -1 && errno == EINTR);
+    rc = rcache_read(fd, cache);
+    close(fd);
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    rcache_slot
+    Entry for a block: the same window, else the free or oldest one.
+----------------------------------------------------------------------------*/
+static struct rcache_entry *rcache_slot(struct rcache_entry *entries, int address, int function, int start, int count)
+{
+    struct rcache_entry *e, *victim = &entries[0];
+
+    for (e = entries; e < entries + RCACHE_ENTRIES; e++) {
+        if (e->address == address && e->function == function && e->start == start && e->count == count) return e;
+        if (e->time_us < victim->time_us) victim = e;
+    }
+    return victim;
+}
+
+/*--------------------------------------------------------------------------
+    rcache_save
+    Merge the blocks stored by this run into the file, newest read wins.
+----------------------------------------------------------------------------*/
+int rcache_save(const char *file)
+{
+    static __thread struct rcache_entry saved[RCACHE_ENTRIES];
+    struct rcache_header hdr;
+    struct rcache_entry *e, *s;
+    int fd, rc, dirty = 0;
+
+    for (e = cache; e < cache + RCACHE_ENTRIES; e++) dirty += e->dirty;
+    if (dirty == 0) return 0;
+
+    if ((fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) return -1;
+    while (flock(fd, LOCK_EX) == -1 && errno == EINTR);
+    rcache_read(fd, saved);
+
+    for (e = cache; e < cache + RCACHE_ENTRIES; e++) {
+        if (!e->dirty) continue;
+        s = rcache_slot(saved, e->address, e->function, e->start, e->count);
+        if (s->address == e->address && s->function == e->function && s->start == e->start &&
+            s->count == e->count && s->time_us > e->time_us) continue;
+        *s = *e;
+        s->dirty = 0;
+        e->dirty = 0;
+    }
+
+    memcpy(hdr.magic, RCACHE_MAGIC, 4);
+    hdr.version    = RCACHE_VERSION;
+    hdr.entries    = RCACHE_ENTRIES;
+    hdr.entry_size = sizeof(struct rcache_entry);
+    rc = (pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+          pwrite(fd, saved, sizeof(saved), sizeof(hdr)) == sizeof(saved)) ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    rcache_lookup
+    Registers start..start+count-1 of a meter read at most max_age_us
+    before rcache_load, so that every lookup of a run agrees, and when
+    they were read. 0, or -1 on a miss.
+----------------------------------------------------------------------------*/
+int rcache_lookup(int address, int function, int start, int count, long long max_age_us,
+                  uint16_t *dest, int64_t *time_us)
+{
+    const struct rcache_entry *e, *best = NULL;
+    long long oldest = loaded_us - max_age_us;
+
+    for (e = cache; e < cache + RCACHE_ENTRIES; e++) {
+        if (e->address != address || e->function != function || e->time_us < oldest ||
+            e->start > start || e->start + e->count < start + count) continue;
+        if (best == NULL || e->time_us > best->time_us) best = e;
+    }
+    if (best == NULL) return -1;
+    memcpy(dest, &best->regs[start - best->start], count * sizeof(*dest));
+    if (time_us != NULL) *time_us = best->time_us;
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    rcache_store
+----------------------------------------------------------------------------*/
+void rcache_store(int address, int function, int start, int count, const uint16_t *regs)
+{
+    struct rcache_entry *e;
+
+    if (address <= 0 || address > 247 || count <= 0 || count > PLAN_MAXREGS) return;
+    e = rcache_slot(cache, address, function, start, count);
+    e->address  = address;
+    e->function = function;
+    e->start    = start;
+    e->count    = count;
+    e->dirty    = 1;
+    e->time_us  = rcache_now_us();
+    memcpy(e->regs, regs, count * sizeof(*regs));
+}
@@ -0,0 +1,46 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   regcache.h                                                               */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Register blocks read by recent runs, for --max-age                      */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __REGCACHE_H__
+#define __REGCACHE_H__
+
+#include <stdint.h>
+
+#include "readplan.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define RCACHE_MAGIC      "SDMC"
+#define RCACHE_VERSION    1
+#define RCACHE_ENTRIES    128      /* Blocks kept per bus, oldest replaced */
+
+struct rcache_entry {
+    uint8_t  address;              /* Meter, 0 = free entry */
+    uint8_t  function;             /* PLAN_FC_INPUT or PLAN_FC_HOLDING */
+    uint16_t start;
+    uint16_t count;
+    uint16_t dirty;                /* Stored by this run, not saved yet */
+    int64_t  time_us;              /* Realtime of the read */
+    uint16_t regs[PLAN_MAXREGS];
+};
+
+extern int  rcache_load(const char *file);
+extern int  rcache_save(const char *file);
+extern int  rcache_lookup(int address, int function, int start, int count, long long max_age_us,
+                          uint16_t *dest, int64_t *time_us);
+extern void rcache_store(int address, int function, int start, int count, const uint16_t *regs);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __REGCACHE_H__ */
@@ -0,0 +1,105 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   rollup.c                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Min, max, mean and last of every value and energy used per window     */
+/*                                                                            */
+/*   A window is a fixed struct updated by each sample, whatever its       */
+/*   length. Windows start on multiples of their length in local time, so  */
+/*   15 minute windows are the tariff quarters, and close on the first     */
+/*   sample past their end. An energy delta runs from the last reading of  */
+/*   the previous window, no Wh is lost between windows or across a gap.   */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rollup.h"
+
+/*--------------------------------------------------------------------------
+    rollup_window
+    --rollup window, seconds or 30s, 15m, 1h. -1 unless it divides a day.
+----------------------------------------------------------------------------*/
+int rollup_window(const char *spec)
+{
+    char *end;
+    long s = strtol(spec, &end, 10);
+
+    if (end == spec) return -1;
+    if (*end == 'm') s *= 60, end++;
+    else if (*end == 'h') s *= 3600, end++;
+    else if (*end == 's') end++;
+    if (*end != '\0' || s <= 0 || s > ROLLUP_MAXWINDOW || ROLLUP_MAXWINDOW % s != 0) return -1;
+    return s;
+}
+
+/*--------------------------------------------------------------------------
+    rollup_init
+----------------------------------------------------------------------------*/
+void rollup_init(struct rollup *r, int window_s)
+{
+    memset(r, 0, sizeof(*r));
+    r->window_s = window_s;
+}
+
+/*--------------------------------------------------------------------------
+    windowStart
+    Start of the window holding time_us, local time.
+----------------------------------------------------------------------------*/
+static int64_t windowStart(int64_t time_us, int window_s)
+{
+    time_t t = time_us / 1000000;
+    struct tm tm;
+    int64_t local;
+
+    localtime_r(&t, &tm);
+    local = (int64_t)t + tm.tm_gmtoff;
+    return (local - local % window_s - tm.tm_gmtoff) * 1000000LL;
+}
+
+/*--------------------------------------------------------------------------
+    rollup_add
+    Account a sample. If it is past the window, the window is copied to
+    closed and 1 returned, the sample starting the next one.
+----------------------------------------------------------------------------*/
+int rollup_add(struct rollup *r, int64_t time_us, const float value[], uint32_t fields,
+               struct rollup *closed)
+{
+    struct rollup_stat *s;
+    int i, ret = 0;
+
+    if (r->start_us != 0 && time_us >= r->start_us + r->window_s * 1000000LL) {
+        for (i=0; i < SNAP_VALUES; i++) {
+            s = &r->stat[i];
+            if (!(r->fields & ROLLUP_ENERGIES & (1U << i))) continue;
+            s->delta = s->last - (r->based & (1U << i) ? r->base[i] : s->first);
+            r->base[i] = s->last;
+            r->based |= 1U << i;
+        }
+        *closed = *r;
+        memset(r->stat, 0, sizeof(r->stat));
+        r->samples = 0;
+        r->fields = 0;
+        r->start_us = 0;
+        ret = 1;
+    }
+    if (r->start_us == 0 || time_us < r->start_us) r->start_us = windowStart(time_us, r->window_s);
+
+    fields &= ROLLUP_FIELDS;
+    for (i=0; i < SNAP_VALUES; i++) {
+        if (!(fields & (1U << i))) continue;
+        s = &r->stat[i];
+        if (s->count++ == 0) s->min = s->max = s->first = value[i];
+        if (value[i] < s->min) s->min = value[i];
+        if (value[i] > s->max) s->max = value[i];
+        s->last = value[i];
+        s->sum += value[i];
+    }
+    r->fields |= fields;
+    r->samples++;
+    return ret;
+}
@@ -0,0 +1,60 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   rollup.h                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Min, max, mean and last of every value and energy used per window     */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __ROLLUP_H__
+#define __ROLLUP_H__
+
+#include <stdint.h>
+
+#include "shmsnap.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define ROLLUP_WINDOWS    4        /* --rollup windows at most */
+#define ROLLUP_MAXWINDOW  86400    /* s, windows divide a day */
+
+/* Counters: last and used in the window (delta) instead of min/max/mean */
+#define ROLLUP_ENERGIES   ((1U << SNAP_IAENERGY) | (1U << SNAP_EAENERGY) | (1U << SNAP_TAENERGY) | \
+                           (1U << SNAP_IRAENERGY) | (1U << SNAP_ERAENERGY) | (1U << SNAP_TRENERGY))
+/* Values rolled up, not the display time */
+#define ROLLUP_FIELDS     ((1U << SNAP_TIMEDISP) - 1)
+
+struct rollup_stat {
+    float    min;
+    float    max;
+    float    first;
+    float    last;
+    float    delta;                /* Energies: last - last of the window before */
+    uint32_t count;
+    double   sum;
+};
+
+struct rollup {
+    int64_t  start_us;             /* Window start, 0 = none yet */
+    int      window_s;
+    uint32_t samples;              /* Polls in the window */
+    uint32_t fields;               /* Values with samples, SNAP_x bits */
+    struct rollup_stat stat[SNAP_VALUES];
+    float    base[SNAP_VALUES];    /* Energies at the previous window close */
+    uint32_t based;
+};
+
+extern int  rollup_window(const char *spec);
+extern void rollup_init(struct rollup *r, int window_s);
+extern int  rollup_add(struct rollup *r, int64_t time_us, const float value[], uint32_t fields,
+                       struct rollup *closed);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __ROLLUP_H__ */
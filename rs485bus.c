@@ -0,0 +1,860 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   rs485bus.c                                                               */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   RS485 bus arbitration library shared by sdm120c and aurora              */
+/*                                                                            */
+/*   LCK..<tty> holds one "PID COMMAND" line per client, the first line     */
+/*   owns the bus. Each client also holds an exclusive flock on its own     */
+/*   ticket file, LCK..<tty>.q<PID>, from before it queues until it has     */
+/*   left the queue; the ticket holds the client's priority class. A client */
+/*   inserts its line after every waiter of its class or better, and waits  */
+/*   in flock() on the ticket of the line just ahead of it, so the kernel   */
+/*   wakes it as soon as that client releases or dies. A ticket found       */
+/*   unlocked while its line is still queued is a dead client whose line is */
+/*   cleared at once. Lines with no ticket come from older clients: they    */
+/*   rank as normal, the process is pinned with a pidfd and the waiter      */
+/*   sleeps until it exits or the lock file is rewritten.                   */
+/*                                                                            */
+/*   A client with a bus time budget that has used it up queues in the      */
+/*   last class until the budget refills. Holders record who has the bus,  */
+/*   and bus and queue time per class, in LCK..<tty>.occ.                   */
+/*                                                                            */
+/* ========================================================================== */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <libgen.h>
+
+#include "rs485bus.h"
+
+#define LEGACY_POLL_US  25000               /* Recheck period for a client without ticket, no pidfd */
+#define TIMEOUT_REFIRE  50000000L           /* ns, timer period once the wait deadline passed */
+#define YIELD_MIN_US    20000L              /* Idle time worth releasing the bus for */
+#define PIN_STALE       -1                  /* pinPID: holder gone or PID reused */
+#define PIN_NONE        -2                  /* pinPID: no pidfd_open (kernel < 5.3) */
+
+#ifndef sigev_notify_thread_id              /* glibc < 2.38 */
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#ifndef SYS_pidfd_open                      /* glibc < 2.31 headers */
+#define SYS_pidfd_open 434
+#endif
+
+struct rs485_bus {
+    char *lckfile;                 /* LCK..<tty> */
+    char *lckfileNew;              /* LCK..<tty>.<PID>, rewritten queue */
+    char *ticket;                  /* LCK..<tty>.q<PID> */
+    char *occfile;                 /* LCK..<tty>.occ */
+    char *device;
+    char *command;                 /* Ours, in the queue line */
+    unsigned long pid;
+    unsigned long owner;           /* First line at the last check */
+    int  prio;
+    int  cls;                      /* Class of the current request */
+    int  ticketfd;
+    int  locked;
+    long budget_us, period_us;     /* 0 = no budget */
+    long long tokens_us, refill_us;
+    long long req_us, acq_us;
+};
+
+static const char *lckloc = "/var/lock/LCK..";
+static rs485_log_fn lck_log = NULL;
+static int lck_debug = 0;
+
+static const char *class_names[RS485_CLASSES] = { "high", "normal", "low", "over" };
+
+/*--------------------------------------------------------------------------
+    bus_log
+----------------------------------------------------------------------------*/
+static void bus_log(const int log, const char *format, ...)
+{
+    va_list args;
+    char buffer[1024];
+
+    if (!log) return;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if (lck_log != NULL) lck_log(log, "%s", buffer);
+    else if (log & RS485_LOG_STDERR) fprintf(stderr, "rs485bus(%d) %s\n", getpid(), buffer);
+}
+
+/*--------------------------------------------------------------------------
+    now_us
+----------------------------------------------------------------------------*/
+static long long now_us(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*--------------------------------------------------------------------------
+    pidCommand
+    First string of /proc/<pid>/cmdline, NULL if no such process.
+----------------------------------------------------------------------------*/
+static char *pidCommand(unsigned long pid)
+{
+    char cmdFilename[32];
+    char buffer[1024];
+    ssize_t length;
+    int fdcmd;
+
+    snprintf(cmdFilename, sizeof(cmdFilename), "/proc/%lu/cmdline", pid);
+    if ((fdcmd = open(cmdFilename, O_RDONLY | O_CLOEXEC)) < 0) return NULL;
+    length = read(fdcmd, buffer, sizeof(buffer) - 1);
+    close(fdcmd);
+    if (length <= 0) return NULL;
+    buffer[length] = '\0';
+    return strdup(buffer);
+}
+
+/*--------------------------------------------------------------------------
+    setNames
+    File names depend on the PID, redone in a forked child.
+----------------------------------------------------------------------------*/
+static int setNames(rs485_bus *bus)
+{
+    const char *tty = strrchr(bus->device, '/');
+
+    tty = tty != NULL ? tty + 1 : bus->device;
+    bus->pid = getpid();
+    free(bus->lckfile); free(bus->lckfileNew); free(bus->ticket); free(bus->occfile); free(bus->command);
+    bus->lckfileNew = bus->ticket = bus->occfile = bus->command = NULL;
+    if (asprintf(&bus->lckfile, "%s%s", lckloc, tty) == -1) {
+        bus->lckfile = NULL;
+        return -1;
+    }
+    if (asprintf(&bus->lckfileNew, "%s.%lu", bus->lckfile, bus->pid) == -1 ||
+        asprintf(&bus->ticket, "%s.q%lu", bus->lckfile, bus->pid) == -1 ||
+        asprintf(&bus->occfile, "%s.occ", bus->lckfile) == -1) return -1;
+    if ((bus->command = pidCommand(bus->pid)) == NULL) bus->command = strdup("");
+    return bus->command != NULL ? 0 : -1;
+}
+
+/*--------------------------------------------------------------------------
+    openLCKfile
+    Open and flock the lock file. The queue is rewritten as a new file
+    renamed over it, so a lock granted on a file no longer at that path is
+    dropped and the open retried, or appends and rewrites would land in a
+    dead copy.
+----------------------------------------------------------------------------*/
+static FILE *openLCKfile(const rs485_bus *bus, const char *mode, int operation)
+{
+    struct stat stFd, stPath;
+    FILE *fdserlck;
+    int errno_save;
+
+    for (;;) {
+        if ((fdserlck = fopen(bus->lckfile, mode)) == NULL) return NULL;
+        while (flock(fileno(fdserlck), operation) == -1) {
+            if (errno == EINTR) continue;
+            errno_save = errno;
+            fclose(fdserlck);
+            errno = errno_save;
+            return NULL;
+        }
+        if (fstat(fileno(fdserlck), &stFd) == 0 && stat(bus->lckfile, &stPath) == 0 &&
+            stFd.st_dev == stPath.st_dev && stFd.st_ino == stPath.st_ino) return fdserlck;
+        fclose(fdserlck);
+    }
+}
+
+/*--------------------------------------------------------------------------
+    ticketName
+----------------------------------------------------------------------------*/
+static char *ticketName(const rs485_bus *bus, unsigned long pid)
+{
+    char *ticket;
+
+    if (asprintf(&ticket, "%s.q%lu", bus->lckfile, pid) == -1) return NULL;
+    return ticket;
+}
+
+/*--------------------------------------------------------------------------
+    lineClass
+    Class in a client's ticket, normal for older clients without one.
+----------------------------------------------------------------------------*/
+static int lineClass(const rs485_bus *bus, unsigned long pid)
+{
+    char *ticket = ticketName(bus, pid);
+    char c = '0' + RS485_PRIO_NORMAL;
+    int fd;
+
+    if (ticket != NULL && (fd = open(ticket, O_RDONLY | O_CLOEXEC)) != -1) {
+        if (read(fd, &c, 1) != 1) c = '0' + RS485_PRIO_NORMAL;
+        close(fd);
+    }
+    free(ticket);
+    return (c >= '0' && c < '0' + RS485_CLASSES) ? c - '0' : RS485_PRIO_NORMAL;
+}
+
+/*--------------------------------------------------------------------------
+    takeTicket
+    Create and flock our ticket before queueing. A ticket left by a dead
+    process with our PID may be unlinked by a waiter under us, so the lock
+    must be on the file that is at the path.
+----------------------------------------------------------------------------*/
+static int takeTicket(rs485_bus *bus)
+{
+    struct stat stFd, stPath;
+    char cls[2];
+
+    for (;;) {
+        if ((bus->ticketfd = open(bus->ticket, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) return -1;
+        while (flock(bus->ticketfd, LOCK_EX) == -1 && errno == EINTR);
+        if (fstat(bus->ticketfd, &stFd) == 0 && stat(bus->ticket, &stPath) == 0 &&
+            stFd.st_dev == stPath.st_dev && stFd.st_ino == stPath.st_ino) break;
+        close(bus->ticketfd);
+    }
+    cls[0] = '0' + bus->cls;
+    cls[1] = '\n';
+    if (pwrite(bus->ticketfd, cls, 2, 0) != 2) bus_log(lck_debug, "Can't write class to %s", bus->ticket);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    dropTicket
+    Wakes the client queued behind us.
+----------------------------------------------------------------------------*/
+static void dropTicket(rs485_bus *bus)
+{
+    if (bus->ticketfd == -1) return;
+    unlink(bus->ticket);
+    close(bus->ticketfd);
+    bus->ticketfd = -1;
+}
+
+/*--------------------------------------------------------------------------
+    rewriteQueue
+    Under an exclusive lock, copy the queue to lckfileNew without the lines
+    of dropPID and, if insert, with our line after every waiter of our
+    class or better (never ahead of the owner), then rename it over.
+----------------------------------------------------------------------------*/
+static int rewriteQueue(rs485_bus *bus, unsigned long dropPID, int insert)
+{
+    FILE *fdserlck, *fdserlcknew;
+    char **lines = NULL, *line = NULL;
+    unsigned long *pids = NULL;
+    size_t size = 0;
+    int n = 0, max = 0, pos, i, rc = 0;
+
+    if ((fdserlck = openLCKfile(bus, insert ? "a+" : "r", LOCK_EX)) == NULL) return -1;
+
+    while (getline(&line, &size, fdserlck) > 0) {
+        if (n == max) {
+            char **newLines;
+            unsigned long *newPids;
+
+            max = max ? 2 * max : 16;
+            if ((newLines = realloc(lines, max * sizeof(*lines))) != NULL) lines = newLines;
+            if ((newPids = realloc(pids, max * sizeof(*pids))) != NULL) pids = newPids;
+            if (newLines == NULL || newPids == NULL) {
+                fclose(fdserlck);
+                for (i=0; i < n; i++) free(lines[i]);
+                free(lines); free(pids); free(line);
+                return -1;
+            }
+        }
+        if ((pids[n] = strtoul(line, NULL, 10)) == 0) continue;
+        lines[n++] = line;
+        line = NULL; size = 0;
+    }
+    free(line);
+
+    pos = n;
+    if (insert) while (pos > 1 && (pids[pos-1] == dropPID || lineClass(bus, pids[pos-1]) > bus->cls)) pos--;
+
+    if ((fdserlcknew = fopen(bus->lckfileNew, "w")) == NULL) {
+        rc = -1;
+    } else {
+        for (i=0; i <= n; i++) {
+            if (insert && i == pos) fprintf(fdserlcknew, "%lu %s\n", bus->pid, bus->command);
+            if (i < n && pids[i] != dropPID) fputs(lines[i], fdserlcknew);
+        }
+        if (fclose(fdserlcknew) != 0 || rename(bus->lckfileNew, bus->lckfile) != 0) {
+            bus_log(lck_debug | RS485_LOG_SYSLOG, "Problem updating serial device lock file: %s. (%d) %s", bus->lckfile, errno, strerror(errno));
+            unlink(bus->lckfileNew);
+            rc = -1;
+        }
+    }
+    fclose(fdserlck);
+
+    for (i=0; i < n; i++) free(lines[i]);
+    free(lines); free(pids);
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    readQueue
+    Position of pid in the lock queue (0 = owns the bus, -1 = not queued),
+    the owner and the client just ahead of pid with its command.
+----------------------------------------------------------------------------*/
+static int readQueue(rs485_bus *bus, unsigned long pid, unsigned long *LckPID, unsigned long *PrevPID, char **PrevCOMMAND)
+{
+    FILE *fdserlck;
+    char *line = NULL, *prev = NULL, *swap, *cmd;
+    size_t lineSize = 0, prevSize = 0, swapSize;
+    unsigned long linePID = 0;
+    int pos = 0;
+
+    *LckPID = 0; *PrevPID = 0;
+    if ((fdserlck = openLCKfile(bus, "r", LOCK_SH)) == NULL) return -2;
+
+    while (getline(&line, &lineSize, fdserlck) > 0) {
+        if ((linePID = strtoul(line, NULL, 10)) == 0) continue;
+        if (pos == 0) *LckPID = linePID;
+        if (linePID == pid) break;
+        *PrevPID = linePID;
+        swap = prev; prev = line; line = swap;
+        swapSize = prevSize; prevSize = lineSize; lineSize = swapSize;
+        pos++;
+    }
+    if (*LckPID == 0 || linePID != pid) pos = -1;
+    fclose(fdserlck);
+
+    if (PrevCOMMAND != NULL && *PrevPID != 0) {
+        strtoul(prev, &cmd, 10);
+        cmd += strspn(cmd, " ");
+        cmd[strcspn(cmd, "\n")] = '\0';
+        *PrevCOMMAND = strdup(cmd);
+    }
+    free(line); free(prev);
+    return pos;
+}
+
+/*--------------------------------------------------------------------------
+    lockTimer
+    Per thread timer interrupting the blocking flock() at the deadline,
+    then every TIMEOUT_REFIRE in case it fired while we were not blocked.
+----------------------------------------------------------------------------*/
+static void lockWake(int sig) { }
+
+static int lockTimer(timer_t *timer, long long deadline)
+{
+    struct sigaction sa;
+    struct sigevent sev;
+    struct itimerspec its;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lockWake;           // No SA_RESTART, flock() returns EINTR
+    sigemptyset(&sa.sa_mask);
+    sigaction(RS485_WAKESIG, &sa, NULL);
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = RS485_WAKESIG;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_MONOTONIC, &sev, timer) == -1) return -1;
+
+    its.it_value.tv_sec = deadline / 1000000;
+    its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = TIMEOUT_REFIRE;
+    if (timer_settime(*timer, TIMER_ABSTIME, &its, NULL) == -1) {
+        timer_delete(*timer);
+        return -1;
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    pinPID
+    pidfd on a client without ticket, checked once against the command in
+    its lock line: a PID that exists but runs another program was reused.
+----------------------------------------------------------------------------*/
+static int pinPID(unsigned long LckPID, const char *LckCOMMAND)
+{
+    char *LckPIDcommand;
+    int pidfd, stale;
+
+    if ((pidfd = syscall(SYS_pidfd_open, (pid_t)LckPID, 0)) == -1)
+        return errno == ESRCH ? PIN_STALE : PIN_NONE;
+
+    LckPIDcommand = pidCommand(LckPID);
+    stale = LckPIDcommand == NULL || LckPIDcommand[0] == '\0' ||
+            (LckCOMMAND != NULL && LckCOMMAND[0] != '\0' && strcmp(LckPIDcommand, LckCOMMAND) != 0);
+    bus_log(lck_debug, "Pinned %lu LckCOMMAND='%s' LckPIDcommand='%s'%s", LckPID, LckCOMMAND, LckPIDcommand, stale ? " stale" : "");
+    free(LckPIDcommand);
+    if (stale) {
+        close(pidfd);
+        return PIN_STALE;
+    }
+    return pidfd;
+}
+
+/*--------------------------------------------------------------------------
+    watchLCKdir
+    Older clients release by renaming a rewritten copy over the lock file.
+----------------------------------------------------------------------------*/
+static int watchLCKdir(const rs485_bus *bus)
+{
+    char dir[strlen(bus->lckfile)+1];
+    int fd;
+
+    strcpy(dir, bus->lckfile);
+    if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) return -1;
+    if (inotify_add_watch(fd, dirname(dir), IN_MOVED_TO | IN_CLOSE_WRITE) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*--------------------------------------------------------------------------
+    waitPID
+    Until the pinned client exits (1), the lock file changes or the
+    deadline (0). Without inotify the lock file is rechecked every
+    LEGACY_POLL_US.
+----------------------------------------------------------------------------*/
+static int waitPID(int pidfd, int inotifyfd, long long deadline)
+{
+    struct pollfd fds[2];
+    char events[4096];
+    long ms;
+
+    ms = (deadline - now_us(CLOCK_MONOTONIC)) / 1000 + 1;
+    if (inotifyfd == -1 && ms > LEGACY_POLL_US / 1000) ms = LEGACY_POLL_US / 1000;
+
+    fds[0].fd = pidfd;     fds[0].events = POLLIN; fds[0].revents = 0;
+    fds[1].fd = inotifyfd; fds[1].events = POLLIN; fds[1].revents = 0;
+    if (poll(fds, inotifyfd == -1 ? 1 : 2, ms) <= 0) return 0;
+    if (fds[1].revents & POLLIN) while (read(inotifyfd, events, sizeof(events)) > 0);
+    return (fds[0].revents & POLLIN) ? 1 : 0;
+}
+
+/*--------------------------------------------------------------------------
+    clearStale
+----------------------------------------------------------------------------*/
+static void clearStale(rs485_bus *bus, unsigned long LckPID)
+{
+    bus_log(lck_debug | RS485_LOG_SYSLOG, "Clearing stale serial port lock. (%lu)", LckPID);
+    rewriteQueue(bus, LckPID, 0);
+}
+
+/*--------------------------------------------------------------------------
+    budgetRefill
+    Token bucket, budget_us of bus time per period_us.
+----------------------------------------------------------------------------*/
+static void budgetRefill(rs485_bus *bus)
+{
+    long long now = now_us(CLOCK_MONOTONIC);
+
+    if (bus->period_us <= 0) return;
+    bus->tokens_us += (now - bus->refill_us) * bus->budget_us / bus->period_us;
+    if (bus->tokens_us > bus->budget_us) bus->tokens_us = bus->budget_us;
+    bus->refill_us = now;
+}
+
+/*--------------------------------------------------------------------------
+    occupancyUpdate
+----------------------------------------------------------------------------*/
+static void occupancyUpdate(rs485_bus *bus, int acquired)
+{
+    struct rs485_occupancy occ;
+    int fd;
+
+    if ((fd = open(bus->occfile, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) return;
+    while (flock(fd, LOCK_EX) == -1 && errno == EINTR);
+
+    if (pread(fd, &occ, sizeof(occ), 0) != sizeof(occ) || occ.version != RS485BUS_API) {
+        memset(&occ, 0, sizeof(occ));
+        occ.version = RS485BUS_API;
+    }
+    if (acquired) {
+        occ.holder = bus->pid;
+        occ.holder_class = bus->cls;
+        snprintf(occ.holder_command, sizeof(occ.holder_command), "%s", bus->command);
+        occ.acquired[bus->cls]++;
+        occ.wait_us[bus->cls] += bus->acq_us - bus->req_us;
+    } else {
+        occ.holder = 0;
+        occ.busy_us[bus->cls] += now_us(CLOCK_MONOTONIC) - bus->acq_us;
+        occ.handoffs++;
+    }
+    occ.since_us = now_us(CLOCK_REALTIME);
+    if (pwrite(fd, &occ, sizeof(occ), 0) != sizeof(occ)) bus_log(lck_debug, "Can't write %s", bus->occfile);
+    close(fd);
+}
+
+/*--------------------------------------------------------------------------
+    rs485_set_log
+    log is called as log(bits, "%s", message), debug is or'ed into the
+    bits of debug messages. Without log, RS485_LOG_STDERR goes to stderr.
+----------------------------------------------------------------------------*/
+void rs485_set_log(rs485_log_fn log, int debug)
+{
+    lck_log = log;
+    lck_debug = debug;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_set_lockdir
+    Lock file prefix, default "/var/lock/LCK..". Set before rs485_open.
+----------------------------------------------------------------------------*/
+void rs485_set_lockdir(const char *prefix)
+{
+    lckloc = prefix;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_open
+    Handle on the lock of a serial device, not locked yet.
+----------------------------------------------------------------------------*/
+rs485_bus *rs485_open(const char *device, int prio)
+{
+    rs485_bus *bus;
+
+    if (device == NULL || prio < RS485_PRIO_HIGH || prio > RS485_PRIO_LOW) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((bus = calloc(1, sizeof(*bus))) == NULL) return NULL;
+    bus->ticketfd = -1;
+    bus->prio = bus->cls = prio;
+    if ((bus->device = strdup(device)) == NULL || setNames(bus) == -1) {
+        rs485_close(bus);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return bus;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_close
+----------------------------------------------------------------------------*/
+void rs485_close(rs485_bus *bus)
+{
+    if (bus == NULL) return;
+    rs485_unlock(bus);
+    free(bus->lckfile); free(bus->lckfileNew); free(bus->ticket); free(bus->occfile);
+    free(bus->device); free(bus->command);
+    free(bus);
+}
+
+/*--------------------------------------------------------------------------
+    rs485_set_budget
+    At most busy_us of bus time per period_us at the client's class,
+    beyond that it queues behind everyone. 0 = no budget.
+----------------------------------------------------------------------------*/
+void rs485_set_budget(rs485_bus *bus, long busy_us, long period_us)
+{
+    bus->budget_us = busy_us > 0 && period_us > 0 ? busy_us : 0;
+    bus->period_us = busy_us > 0 && period_us > 0 ? period_us : 0;
+    bus->tokens_us = bus->budget_us;
+    bus->refill_us = now_us(CLOCK_MONOTONIC);
+}
+
+/*--------------------------------------------------------------------------
+    rs485_lock
+    Queue and wait up to wait_s seconds (0 = only if free or stale) for
+    the bus. 0 when locked, -1 with errno ETIMEDOUT if still busy (see
+    rs485_owner) or the error of a lock file operation.
+----------------------------------------------------------------------------*/
+int rs485_lock(rs485_bus *bus, int wait_s)
+{
+    unsigned long LckPID = 0, PrevPID = 0, ChkPID, ChkPrevPID, pinnedPID = 0;
+    char *LckCOMMAND = NULL;
+    char *LckPIDcommand = NULL;
+    char *PrevTicket = NULL;
+    long long deadline;
+    timer_t timer;
+    int timerSet = 0;
+    int queuePos, prevfd, errno_save;
+    int pidfd = PIN_NONE, inotifyfd = -1;
+    int staleLockRetries = 0;
+    int const staleLockRetriesMax = 2;
+    unsigned long clrStaleTargetPID = 0;
+
+    if (bus->locked) return 0;
+    if (bus->pid != (unsigned long)getpid() && setNames(bus) == -1) return -1;
+
+    budgetRefill(bus);
+    bus->cls = (bus->period_us > 0 && bus->tokens_us <= 0) ? RS485_PRIO_OVER : bus->prio;
+
+    bus_log(lck_debug, "devLCKfile: <%s> ticket: <%s> class %s", bus->lckfile, bus->ticket, class_names[bus->cls]);
+    bus->req_us = now_us(CLOCK_MONOTONIC);
+    deadline = bus->req_us + wait_s * 1000000LL;
+
+    if (takeTicket(bus) == -1) {
+        errno_save = errno;
+        bus_log(RS485_LOG_STDERR | RS485_LOG_SYSLOG, "Problem locking serial device, can't open ticket file: %s. (%d) %s", bus->ticket, errno_save, strerror(errno_save));
+        errno = errno_save;
+        return -1;
+    }
+    if (rewriteQueue(bus, bus->pid, 1) == -1) {
+        errno_save = errno;
+        bus_log(RS485_LOG_STDERR | RS485_LOG_SYSLOG, "Problem locking serial device, can't write lock file: %s. (%d) %s", bus->lckfile, errno_save, strerror(errno_save));
+        dropTicket(bus);
+        errno = errno_save;
+        return -1;
+    }
+
+    for (;;) {
+        free(LckCOMMAND); LckCOMMAND = NULL;
+        queuePos = readQueue(bus, bus->pid, &LckPID, &PrevPID, &LckCOMMAND);
+        bus->owner = LckPID;
+        if (queuePos == 0) break;
+
+        if (queuePos == -2) {
+            errno_save = errno;
+            bus_log(RS485_LOG_STDERR | RS485_LOG_SYSLOG, "Problem locking serial device, can't open lock file: %s for read. (%d) %s", bus->lckfile, errno_save, strerror(errno_save));
+            break;
+        }
+        if (queuePos < 0) {
+            // Cleared by someone else, queue again
+            bus_log(lck_debug | RS485_LOG_SYSLOG, "%s miss process self PID from lock file, amending.", bus->lckfile);
+            rewriteQueue(bus, bus->pid, 1);
+            continue;
+        }
+        bus_log(lck_debug, "Queued %d behind %lu (%s), owner %lu", queuePos, PrevPID, LckCOMMAND, LckPID);
+
+        free(PrevTicket);
+        PrevTicket = ticketName(bus, PrevPID);
+        if (PrevTicket != NULL && (prevfd = open(PrevTicket, O_RDONLY | O_CLOEXEC)) != -1) {
+            if (flock(prevfd, LOCK_EX | LOCK_NB) == 0) {
+                // Unlocked ticket: stale if its line is still ahead of us
+                if (readQueue(bus, bus->pid, &ChkPID, &ChkPrevPID, NULL) > 0 && ChkPrevPID == PrevPID) {
+                    clearStale(bus, PrevPID);
+                    unlink(PrevTicket);
+                }
+                close(prevfd);
+                continue;
+            }
+            if (wait_s == 0 || now_us(CLOCK_MONOTONIC) >= deadline) {
+                close(prevfd);
+                break;
+            }
+            if (!timerSet) timerSet = (lockTimer(&timer, deadline) == 0);
+            bus_log(lck_debug, "Waiting for %lu to release %s", PrevPID, PrevTicket);
+            flock(prevfd, LOCK_EX);     // Released, died or timed out: recheck
+            close(prevfd);
+            if (now_us(CLOCK_MONOTONIC) >= deadline) {
+                readQueue(bus, bus->pid, &bus->owner, &PrevPID, NULL);
+                break;
+            }
+            continue;
+        }
+
+        // No ticket, client from an older build: pin it once, then sleep
+        // until it exits or the lock file changes
+        if (PrevPID != pinnedPID) {
+            if (pidfd >= 0) close(pidfd);
+            pinnedPID = PrevPID;
+            if ((pidfd = pinPID(PrevPID, LckCOMMAND)) == PIN_STALE) {
+                clearStale(bus, PrevPID);
+                pinnedPID = 0;
+                continue;
+            }
+        }
+        if (pidfd >= 0) {
+            if (wait_s == 0 || now_us(CLOCK_MONOTONIC) >= deadline) break;
+            if (inotifyfd == -1) inotifyfd = watchLCKdir(bus);
+            if (waitPID(pidfd, inotifyfd, deadline) == 1) {
+                bus_log(lck_debug, "Process %lu exited", PrevPID);
+                if (readQueue(bus, bus->pid, &ChkPID, &ChkPrevPID, NULL) > 0 && ChkPrevPID == PrevPID)
+                    clearStale(bus, PrevPID);
+                close(pidfd);
+                pidfd = PIN_NONE;
+                pinnedPID = 0;
+            }
+            continue;
+        }
+
+        // No pidfd_open, poll /proc as older builds do
+        LckPIDcommand = pidCommand(PrevPID);
+        if (LckPIDcommand == NULL || (LckCOMMAND[0]!='\0' && strcmp(LckPIDcommand,LckCOMMAND) != 0) || strcmp(LckPIDcommand,"") == 0) {
+            // Is it a stale lock pid?
+            if (staleLockRetries < staleLockRetriesMax || PrevPID != clrStaleTargetPID) {
+                if (PrevPID != clrStaleTargetPID) staleLockRetries = 0;
+                staleLockRetries++;
+                clrStaleTargetPID = PrevPID;
+                bus_log(lck_debug | (staleLockRetries > 1 ? RS485_LOG_SYSLOG : 0), "Stale pid lock(%d)? PID=%lu, LckPID=%lu, LckCOMMAND='%s', LckPIDCommand='%s'", staleLockRetries, bus->pid, PrevPID, LckCOMMAND, LckPIDcommand);
+            } else {
+                clearStale(bus, PrevPID);
+                staleLockRetries = 0;
+                clrStaleTargetPID = 0;
+            }
+        } else {
+            // Pid lock have a process running, let's reset stale pid retries
+            staleLockRetries = 0;
+            clrStaleTargetPID = 0;
+        }
+        free(LckPIDcommand); LckPIDcommand = NULL;
+
+        if (wait_s == 0 || now_us(CLOCK_MONOTONIC) >= deadline) break;
+        usleep(LEGACY_POLL_US);
+    } // for
+
+    if (timerSet) timer_delete(timer);
+    if (pidfd >= 0) close(pidfd);
+    if (inotifyfd >= 0) close(inotifyfd);
+    free(LckCOMMAND); free(PrevTicket);
+
+    if (queuePos != 0) {
+        errno_save = queuePos == -2 ? errno : ETIMEDOUT;
+        rewriteQueue(bus, bus->pid, 0);
+        dropTicket(bus);
+        errno = errno_save;
+        return -1;
+    }
+
+    bus->locked = 1;
+    bus->acq_us = now_us(CLOCK_MONOTONIC);
+    occupancyUpdate(bus, 1);
+    bus_log(lck_debug, "Appears we got the lock.");
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_unlock
+    Leave the queue, the next client is woken by the ticket release.
+----------------------------------------------------------------------------*/
+int rs485_unlock(rs485_bus *bus)
+{
+    int rc;
+
+    if (!bus->locked) return 0;
+    bus_log(lck_debug, "Clearing Serial Port Lock (%lu)...", bus->pid);
+    occupancyUpdate(bus, 0);
+    if (bus->period_us > 0) {
+        budgetRefill(bus);
+        bus->tokens_us -= now_us(CLOCK_MONOTONIC) - bus->acq_us;
+    }
+    rc = rewriteQueue(bus, bus->pid, 0);
+    dropTicket(bus);
+    bus->locked = 0;
+    bus_log(lck_debug, "Clearing Serial Port Lock done");
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_yield
+    For a holder between transactions, idle_us until it needs the bus
+    again. Releases the bus (1) if it stays idle long enough, so a client
+    showing up meanwhile doesn't wait for us, or if a client of a better
+    class waits, or anyone waits while we are over budget. The caller then
+    calls rs485_lock before its next transaction. 0 = kept.
+----------------------------------------------------------------------------*/
+int rs485_yield(rs485_bus *bus, long idle_us)
+{
+    FILE *fdserlck;
+    char *line = NULL;
+    size_t size = 0;
+    unsigned long linePID;
+    int waiting = 0, best = RS485_CLASSES, cls, yield;
+
+    if (!bus->locked) return 0;
+    if (idle_us >= YIELD_MIN_US) {
+        bus_log(lck_debug, "Bus idle for %ldus, releasing", idle_us);
+        rs485_unlock(bus);
+        return 1;
+    }
+    if ((fdserlck = openLCKfile(bus, "r", LOCK_SH)) == NULL) return 0;
+    while (getline(&line, &size, fdserlck) > 0) {
+        if ((linePID = strtoul(line, NULL, 10)) == 0 || linePID == bus->pid) continue;
+        waiting++;
+        if ((cls = lineClass(bus, linePID)) < best) best = cls;
+    }
+    fclose(fdserlck);
+    free(line);
+    if (waiting == 0) return 0;
+
+    budgetRefill(bus);
+    yield = best < bus->cls ||
+            (bus->period_us > 0 && bus->tokens_us - (now_us(CLOCK_MONOTONIC) - bus->acq_us) <= 0);
+    if (!yield) return 0;
+
+    bus_log(lck_debug, "Yielding bus to %d waiting client(s), best class %s", waiting, class_names[best]);
+    rs485_unlock(bus);
+    return 1;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_locked
+----------------------------------------------------------------------------*/
+int rs485_locked(const rs485_bus *bus)
+{
+    return bus->locked;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_owner
+    Owner seen at the last check, i.e. who still had the bus at timeout.
+----------------------------------------------------------------------------*/
+unsigned long rs485_owner(const rs485_bus *bus)
+{
+    return bus->owner;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_lockfile
+----------------------------------------------------------------------------*/
+const char *rs485_lockfile(const rs485_bus *bus)
+{
+    return bus->lckfile;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_sidefile
+    Name of a file next to the lock file of device, LCK..<tty><suffix>,
+    for state that goes with the bus. Malloc'ed, NULL if out of memory.
+----------------------------------------------------------------------------*/
+char *rs485_sidefile(const char *device, const char *suffix)
+{
+    const char *tty = strrchr(device, '/');
+    char *file;
+
+    tty = tty != NULL ? tty + 1 : device;
+    if (asprintf(&file, "%s%s%s", lckloc, tty, suffix) == -1) return NULL;
+    return file;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_occupancy
+    Read the occupancy record of a device, -1 if none (yet).
+----------------------------------------------------------------------------*/
+int rs485_occupancy(const char *device, struct rs485_occupancy *occ)
+{
+    char *occfile;
+    int fd, rc = -1;
+
+    if ((occfile = rs485_sidefile(device, ".occ")) == NULL) return -1;
+    if ((fd = open(occfile, O_RDONLY | O_CLOEXEC)) != -1) {
+        while (flock(fd, LOCK_SH) == -1 && errno == EINTR);
+        if (pread(fd, occ, sizeof(*occ), 0) == sizeof(*occ) && occ->version == RS485BUS_API) rc = 0;
+        else errno = EPROTO;
+        close(fd);
+    }
+    free(occfile);
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    rs485_class_name
+----------------------------------------------------------------------------*/
+const char *rs485_class_name(int cls)
+{
+    return (cls >= 0 && cls < RS485_CLASSES) ? class_names[cls] : "?";
+}
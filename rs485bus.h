@@ -0,0 +1,79 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   rs485bus.h                                                               */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   RS485 bus arbitration library shared by sdm120c and aurora              */
+/*                                                                            */
+/*   Clients of one serial line queue in /var/lock/LCK..<tty>, one          */
+/*   "PID COMMAND" line each, the first line owns the bus, as the lock code */
+/*   both tools carried so far. Older builds keep interoperating.           */
+/*   Link with librs485bus.a -lrt. The library interrupts its blocking      */
+/*   lock wait with RS485_WAKESIG, do not use that signal elsewhere.        */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __RS485BUS_H__
+#define __RS485BUS_H__
+
+#include <stdint.h>
+#include <signal.h>
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define RS485BUS_API       1        /* Bumped on incompatible API or record changes */
+
+#define RS485_LOG_STDERR   1        /* Log bits, as sdm120c DEBUG_STDERR/DEBUG_SYSLOG */
+#define RS485_LOG_SYSLOG   2
+
+#define RS485_WAKESIG      (SIGRTMIN + 2)
+
+/* Priority classes, served in this order, FIFO within a class */
+#define RS485_PRIO_HIGH    0        /* Rare reads that must not starve, i.e. inverter energy */
+#define RS485_PRIO_NORMAL  1        /* One shot reads, clients of older builds */
+#define RS485_PRIO_LOW     2        /* High rate polling daemons */
+#define RS485_PRIO_OVER    3        /* Any client over its bus time budget */
+#define RS485_CLASSES      4
+
+typedef struct rs485_bus rs485_bus;
+typedef void (*rs485_log_fn)(const int log, const char *format, ...);
+
+/* Occupancy record, LCK..<tty>.occ, updated by every holder on lock and unlock */
+struct rs485_occupancy {
+    uint32_t version;               /* RS485BUS_API */
+    uint32_t holder;                /* PID owning the bus, 0 = free */
+    int32_t  holder_class;
+    char     holder_command[64];
+    int64_t  since_us;              /* Realtime us, bus taken or freed */
+    uint64_t handoffs;
+    uint64_t acquired[RS485_CLASSES];
+    uint64_t busy_us[RS485_CLASSES];   /* Bus time held */
+    uint64_t wait_us[RS485_CLASSES];   /* Time queued */
+};
+
+extern void  rs485_set_log(rs485_log_fn log, int debug);
+extern void  rs485_set_lockdir(const char *prefix);
+
+extern rs485_bus *rs485_open(const char *device, int prio);
+extern void  rs485_close(rs485_bus *bus);
+extern void  rs485_set_budget(rs485_bus *bus, long busy_us, long period_us);
+
+extern int   rs485_lock(rs485_bus *bus, int wait_s);
+extern int   rs485_unlock(rs485_bus *bus);
+extern int   rs485_yield(rs485_bus *bus, long idle_us);
+extern int   rs485_locked(const rs485_bus *bus);
+
+extern unsigned long rs485_owner(const rs485_bus *bus);
+extern const char *rs485_lockfile(const rs485_bus *bus);
+extern char *rs485_sidefile(const char *device, const char *suffix);
+extern int   rs485_occupancy(const char *device, struct rs485_occupancy *occ);
+extern const char *rs485_class_name(int cls);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __RS485BUS_H__ */
@@ -0,0 +1,431 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   rtu.c                                                                    */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Native Modbus RTU master: raw termios, non blocking I/O on epoll        */
+/*                                                                            */
+/*   Alternative to libmodbus for the bus transactions (--native). The       */
+/*   response is parsed as bytes arrive: its length is known from the        */
+/*   third byte, so the frame completes on its last byte instead of on a    */
+/*   byte timeout. Request end is taken after tcdrain(), which gives a real  */
+/*   meter turnaround to the callbacks. CRC16 is computed 4 bytes at a time */
+/*   with sliced tables.                                                     */
+/*                                                                            */
+/*   Errors are reported in errno with libmodbus values, so                  */
+/*   modbus_strerror() works for both paths.                                 */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <modbus.h>
+
+#include "readplan.h"
+#include "sched.h"
+#include "rtu.h"
+
+static uint16_t crc_table[4][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/*--------------------------------------------------------------------------
+    rtu_crc_init
+    crc_table[k][b]: CRC contribution of byte b followed by k zero bytes.
+    Once per process, bus threads may compute their first CRC together.
+----------------------------------------------------------------------------*/
+static void rtu_crc_init(void)
+{
+    int i, k;
+    uint16_t c;
+
+    for (i=0; i < 256; i++) {
+        c = i;
+        for (k=0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0xA001 : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (i=0; i < 256; i++)
+        for (k=1; k < 4; k++)
+            crc_table[k][i] = (crc_table[k-1][i] >> 8) ^ crc_table[0][crc_table[k-1][i] & 0xFF];
+}
+
+/*--------------------------------------------------------------------------
+    rtu_crc16
+----------------------------------------------------------------------------*/
+uint16_t rtu_crc16(const uint8_t *data, int len)
+{
+    uint16_t crc = 0xFFFF;
+
+    pthread_once(&crc_once, rtu_crc_init);
+
+    while (len >= 4) {
+        crc = crc_table[3][(crc ^ data[0]) & 0xFF] ^ crc_table[2][((crc >> 8) ^ data[1]) & 0xFF] ^
+              crc_table[1][data[2]] ^ crc_table[0][data[3]];
+        data += 4;
+        len -= 4;
+    }
+    while (len--) crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xFF];
+
+    return crc;
+}
+
+/*--------------------------------------------------------------------------
+    rtu_parser_reset
+----------------------------------------------------------------------------*/
+void rtu_parser_reset(struct rtu_parser *p)
+{
+    p->len = 0;
+    p->expect = 0;
+}
+
+/*--------------------------------------------------------------------------
+    rtu_parse
+    Feed received bytes of a response. Returns 1 when the frame is
+    complete (bytes after it are dropped), 0 if more are needed, -1 if the
+    frame can't be valid.
+----------------------------------------------------------------------------*/
+int rtu_parse(struct rtu_parser *p, const uint8_t *data, int len)
+{
+    int n;
+
+    while (len > 0) {
+        if (p->expect == 0) {
+            p->buf[p->len++] = *data++;
+            len--;
+            if (p->len == 2) {
+                if (p->buf[1] & 0x80)                          p->expect = 5;
+                else if (p->buf[1] == 0x10 || p->buf[1] == 0x06) p->expect = 8;
+                else if (p->buf[1] != 0x03 && p->buf[1] != 0x04) return -1;
+            } else if (p->len == 3 && p->expect == 0) {
+                p->expect = 5 + p->buf[2];
+                if (p->expect > RTU_MAXFRAME) return -1;
+            }
+            continue;
+        }
+
+        n = p->expect - p->len;
+        if (n > len) n = len;
+        memcpy(&p->buf[p->len], data, n);
+        p->len += n;
+        data += n;
+        len -= n;
+        if (p->len == p->expect) return 1;
+    }
+
+    return (p->expect && p->len == p->expect) ? 1 : 0;
+}
+
+/*--------------------------------------------------------------------------
+    rtu_speed
+----------------------------------------------------------------------------*/
+static speed_t rtu_speed(int baud)
+{
+    switch (baud) {
+        case 1200:  return B1200;
+        case 2400:  return B2400;
+        case 4800:  return B4800;
+        case 9600:  return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        default:    return B0;
+    }
+}
+
+/*--------------------------------------------------------------------------
+    rtu_open
+----------------------------------------------------------------------------*/
+int rtu_open(struct rtu_port *port, const char *device, int baud, char parity, int stop_bits)
+{
+    struct termios tios;
+    struct epoll_event ev;
+    speed_t speed = rtu_speed(baud);
+
+    memset(port, 0, sizeof(*port));
+    port->fd = -1;
+    port->epfd = -1;
+    plan_timing_init(&port->bt, baud, parity, stop_bits, 0);
+    port->timeout_us = 500000L;
+
+    if (speed == B0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((port->fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1) return -1;
+
+    if (tcgetattr(port->fd, &tios) == -1) goto fail;
+    cfmakeraw(&tios);
+    tios.c_cflag |= CLOCAL | CREAD;
+    tios.c_cflag &= ~(PARENB | PARODD | CSTOPB | CSIZE);
+    tios.c_cflag |= CS8;
+    if (parity == 'E') tios.c_cflag |= PARENB;
+    if (parity == 'O') tios.c_cflag |= PARENB | PARODD;
+    if (stop_bits == 2) tios.c_cflag |= CSTOPB;
+    tios.c_cc[VMIN] = 0;
+    tios.c_cc[VTIME] = 0;
+    cfsetispeed(&tios, speed);
+    cfsetospeed(&tios, speed);
+    if (tcsetattr(port->fd, TCSANOW, &tios) == -1) goto fail;
+
+    if ((port->epfd = epoll_create1(0)) == -1) goto fail;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = port->fd;
+    if (epoll_ctl(port->epfd, EPOLL_CTL_ADD, port->fd, &ev) == -1) goto fail;
+
+    tcflush(port->fd, TCIOFLUSH);
+    return 0;
+
+fail:
+    rtu_close(port);
+    return -1;
+}
+
+/*--------------------------------------------------------------------------
+    rtu_close
+----------------------------------------------------------------------------*/
+void rtu_close(struct rtu_port *port)
+{
+    int errno_save = errno;
+
+    if (port->epfd != -1) close(port->epfd);
+    if (port->fd != -1) close(port->fd);
+    port->epfd = -1;
+    port->fd = -1;
+    errno = errno_save;
+}
+
+/*--------------------------------------------------------------------------
+    rtu_set_timeout
+----------------------------------------------------------------------------*/
+void rtu_set_timeout(struct rtu_port *port, long timeout_us)
+{
+    port->timeout_us = timeout_us;
+}
+
+/*--------------------------------------------------------------------------
+    rtu_wait
+    Wait for fd events until deadline. Returns 1 if ready, 0 on timeout.
+----------------------------------------------------------------------------*/
+static int rtu_wait(struct rtu_port *port, long long deadline_us)
+{
+    struct epoll_event ev;
+    long long left;
+    int rc;
+
+    do {
+        left = deadline_us - sched_now_us();
+        if (left <= 0) return 0;
+        rc = epoll_wait(port->epfd, &ev, 1, (int)((left + 999) / 1000));
+    } while (rc == -1 && errno == EINTR);
+
+    return rc > 0 ? 1 : 0;
+}
+
+/*--------------------------------------------------------------------------
+    rtu_send
+----------------------------------------------------------------------------*/
+static int rtu_send(struct rtu_port *port, const uint8_t *frame, int len)
+{
+    struct epoll_event ev;
+    int n, done = 0;
+
+    while (done < len) {
+        n = write(port->fd, frame + done, len - done);
+        if (n > 0) {
+            done += n;
+        } else if (n == -1 && errno == EAGAIN) {
+            // Output queue full, wait for room
+            ev.events = EPOLLOUT;
+            ev.data.fd = port->fd;
+            epoll_ctl(port->epfd, EPOLL_CTL_MOD, port->fd, &ev);
+            rtu_wait(port, sched_now_us() + port->timeout_us);
+            ev.events = EPOLLIN;
+            epoll_ctl(port->epfd, EPOLL_CTL_MOD, port->fd, &ev);
+        } else if (!(n == -1 && errno == EINTR)) {
+            return -1;
+        }
+    }
+    tcdrain(port->fd);
+
+    return done;
+}
+
+/*--------------------------------------------------------------------------
+    rtu_check
+    Validate a complete response against its request.
+    Returns registers read/written, -1 with errno.
+----------------------------------------------------------------------------*/
+static int rtu_check(const struct rtu_request *req, const struct rtu_parser *p)
+{
+    const uint8_t *f = p->buf;
+    int i;
+
+    if (rtu_crc16(f, p->len - 2) != (f[p->len-2] | f[p->len-1] << 8)) {
+        errno = EMBBADCRC;
+        return -1;
+    }
+    if (f[0] != req->slave || (f[1] & 0x7F) != req->function) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+    if (f[1] & 0x80) {
+        errno = MODBUS_ENOBASE + f[2];
+        return -1;
+    }
+
+    if (req->function == 0x10) {
+        if (((f[2] << 8) | f[3]) != req->start || ((f[4] << 8) | f[5]) != req->count) {
+            errno = EMBBADDATA;
+            return -1;
+        }
+        return req->count;
+    }
+
+    if (f[2] != 2 * req->count) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+    for (i=0; i < req->count; i++)
+        req->regs[i] = (f[3 + 2*i] << 8) | f[4 + 2*i];
+
+    return req->count;
+}
+
+/*--------------------------------------------------------------------------
+    rtu_transact
+    One request/response. Returns the number of registers read or written,
+    -1 with errno (ETIMEDOUT, EMBBADCRC, EMBBADDATA, EMBX* exceptions).
+----------------------------------------------------------------------------*/
+int rtu_transact(struct rtu_port *port, struct rtu_request *req)
+{
+    uint8_t frame[RTU_MAXFRAME];
+    uint8_t rx[RTU_MAXFRAME];
+    struct rtu_parser parser;
+    long long sent_us, deadline_us;
+    uint16_t crc;
+    int len = 0, n, i, rc = -1;
+
+    if (req->count <= 0 || req->count > 125) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    frame[len++] = req->slave;
+    frame[len++] = req->function;
+    frame[len++] = req->start >> 8;
+    frame[len++] = req->start & 0xFF;
+    frame[len++] = req->count >> 8;
+    frame[len++] = req->count & 0xFF;
+    if (req->function == 0x10) {
+        frame[len++] = 2 * req->count;
+        for (i=0; i < req->count; i++) {
+            frame[len++] = req->regs[i] >> 8;
+            frame[len++] = req->regs[i] & 0xFF;
+        }
+    }
+    crc = rtu_crc16(frame, len);
+    frame[len++] = crc & 0xFF;
+    frame[len++] = crc >> 8;
+
+    // Drop leftovers of a previous late response
+    while (read(port->fd, rx, sizeof(rx)) > 0);
+
+    port->requests++;
+    if (rtu_send(port, frame, len) == -1) goto end;
+    sent_us = sched_now_us();
+    if (req->sent) req->sent(req, len, sent_us);
+
+    rtu_parser_reset(&parser);
+    deadline_us = sent_us + port->timeout_us;
+    for (;;) {
+        if (!rtu_wait(port, deadline_us)) {
+            errno = ETIMEDOUT;
+            break;
+        }
+        n = read(port->fd, rx, sizeof(rx));
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            break;
+        }
+
+        n = rtu_parse(&parser, rx, n);
+        if (n == 1) {
+            rc = rtu_check(req, &parser);
+            break;
+        }
+        if (n == -1) {
+            errno = EMBBADDATA;
+            break;
+        }
+
+        // Rest of the frame: its wire time plus the adapter burst gap
+        deadline_us = sched_now_us() + RTU_BYTEGAP +
+                      (parser.expect ? parser.expect - parser.len : RTU_MAXFRAME) * plan_char_us(&port->bt);
+    }
+
+end:
+    if (rc == -1) port->errors++;
+    if (req->done) {
+        int errno_save = errno;
+        req->done(req, rc, sched_now_us());
+        errno = errno_save;
+    }
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    rtu_read_input
+----------------------------------------------------------------------------*/
+int rtu_read_input(struct rtu_port *port, int slave, int start, int count, uint16_t *dest)
+{
+    struct rtu_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.slave = slave;
+    req.function = 0x04;
+    req.start = start;
+    req.count = count;
+    req.regs = dest;
+    return rtu_transact(port, &req);
+}
+
+/*--------------------------------------------------------------------------
+    rtu_read_holding
+----------------------------------------------------------------------------*/
+int rtu_read_holding(struct rtu_port *port, int slave, int start, int count, uint16_t *dest)
+{
+    struct rtu_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.slave = slave;
+    req.function = 0x03;
+    req.start = start;
+    req.count = count;
+    req.regs = dest;
+    return rtu_transact(port, &req);
+}
+
+/*--------------------------------------------------------------------------
+    rtu_write
+    Write multiple registers (0x10).
+----------------------------------------------------------------------------*/
+int rtu_write(struct rtu_port *port, int slave, int start, int count, const uint16_t *src)
+{
+    struct rtu_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.slave = slave;
+    req.function = 0x10;
+    req.start = start;
+    req.count = count;
+    req.regs = (uint16_t *)src;
+    return rtu_transact(port, &req);
+}
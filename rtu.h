@@ -0,0 +1,74 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   rtu.h                                                                    */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Native Modbus RTU master: raw termios, non blocking I/O on epoll        */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __RTU_H__
+#define __RTU_H__
+
+#include <stdint.h>
+
+#include "readplan.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define RTU_MAXFRAME      256      /* Modbus RTU ADU max size */
+#define RTU_BYTEGAP       20000L   /* us, USB adapters deliver in bursts */
+
+struct rtu_request;
+
+typedef void (*rtu_callback)(const struct rtu_request *req, int rc, long long t_us);
+
+struct rtu_request {
+    int  slave;
+    int  function;                 /* 0x03, 0x04 or 0x10 */
+    int  start;
+    int  count;
+    uint16_t *regs;                /* Destination of reads, source of writes */
+    rtu_callback sent;             /* Request on the wire (rc = frame bytes) */
+    rtu_callback done;             /* Response parsed or failed (rc as rtu_transact) */
+    void *arg;
+};
+
+struct rtu_parser {
+    uint8_t buf[RTU_MAXFRAME];
+    int  len;
+    int  expect;                   /* Frame length, 0 = not known yet */
+};
+
+struct rtu_port {
+    int  fd;
+    int  epfd;
+    struct bus_timing bt;
+    long timeout_us;               /* First response byte after request end */
+    int  debug;
+    unsigned long requests;
+    unsigned long errors;
+};
+
+extern uint16_t rtu_crc16(const uint8_t *data, int len);
+
+extern void rtu_parser_reset(struct rtu_parser *p);
+extern int  rtu_parse(struct rtu_parser *p, const uint8_t *data, int len);
+
+extern int  rtu_open(struct rtu_port *port, const char *device, int baud, char parity, int stop_bits);
+extern void rtu_close(struct rtu_port *port);
+extern void rtu_set_timeout(struct rtu_port *port, long timeout_us);
+extern int  rtu_transact(struct rtu_port *port, struct rtu_request *req);
+
+extern int  rtu_read_input(struct rtu_port *port, int slave, int start, int count, uint16_t *dest);
+extern int  rtu_read_holding(struct rtu_port *port, int slave, int start, int count, uint16_t *dest);
+extern int  rtu_write(struct rtu_port *port, int slave, int start, int count, const uint16_t *src);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __RTU_H__ */
@@ -0,0 +1,262 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   rtubench.c                                                               */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   libmodbus vs native RTU engine on a pty meter stand-in                  */
+/*                                                                            */
+/*   A child process answers FC03/FC04 reads on the pty master, after an     */
+/*   optional turnaround. The parent runs the same reads through libmodbus  */
+/*   and through rtu.c and prints the per transaction latency, both timed   */
+/*   around the call. "native rx" is the native sent to done part alone.    */
+/*   A pty has no baud rate and ignores parity, so this measures software   */
+/*   overhead and response detection only, not the wire.                    */
+/*                                                                            */
+/*   Usage: rtubench [-n transactions] [-r registers] [-l turnaround_ms]     */
+/*                                                                            */
+/* ========================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <modbus.h>
+
+#include "readplan.h"
+#include "sched.h"
+#include "rtu.h"
+
+static long long *lat;
+static long long *rx;              /* Native sent to done */
+static long long sent_us;
+
+/*--------------------------------------------------------------------------
+    meter
+    Stand-in meter on the pty master, slave 1.
+----------------------------------------------------------------------------*/
+static void meter(int fd, int turnaround_ms)
+{
+    uint8_t req[RTU_MAXFRAME], rsp[RTU_MAXFRAME];
+    int len = 0, n, i, count;
+    uint16_t crc;
+
+    for (;;) {
+        n = read(fd, req + len, sizeof(req) - len);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            _exit(0);
+        }
+        len += n;
+
+        while (len >= 8) {
+            if (req[0] != 1 || (req[1] != 0x03 && req[1] != 0x04) ||
+                rtu_crc16(req, 6) != (req[6] | req[7] << 8)) {
+                len = 0;
+                break;
+            }
+            count = (req[4] << 8) | req[5];
+            rsp[0] = 1;
+            rsp[1] = req[1];
+            rsp[2] = 2 * count;
+            for (i=0; i < count; i++) {
+                rsp[3 + 2*i] = i >> 8;
+                rsp[4 + 2*i] = i & 0xFF;
+            }
+            crc = rtu_crc16(rsp, 3 + 2*count);
+            rsp[3 + 2*count] = crc & 0xFF;
+            rsp[4 + 2*count] = crc >> 8;
+
+            if (turnaround_ms) usleep(turnaround_ms * 1000);
+            if (write(fd, rsp, 5 + 2*count) < 0) _exit(1);
+
+            memmove(req, req + 8, len - 8);
+            len -= 8;
+        }
+    }
+}
+
+/*--------------------------------------------------------------------------
+    report
+----------------------------------------------------------------------------*/
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, long long *v, int n, int errors, long long total_us)
+{
+    long long sum = 0;
+    int i;
+
+    for (i=0; i < n; i++) sum += v[i];
+    qsort(v, n, sizeof(v[0]), cmp_ll);
+    printf("%-10s %6d tx %4d err  mean %6lldus  p50 %6lldus  p99 %6lldus  max %6lldus",
+           name, n, errors, sum / n, v[n/2], v[n*99/100], v[n-1]);
+    if (total_us > 0) printf("  %7.1f tx/s", n * 1000000.0 / total_us);
+    printf("\n");
+}
+
+/*--------------------------------------------------------------------------
+    native callbacks
+----------------------------------------------------------------------------*/
+static void on_sent(const struct rtu_request *req, int rc, long long t_us)
+{
+    sent_us = t_us;
+}
+
+static void on_done(const struct rtu_request *req, int rc, long long t_us)
+{
+    *(long long *)req->arg = t_us - sent_us;
+}
+
+/*--------------------------------------------------------------------------
+    crc bench
+----------------------------------------------------------------------------*/
+static uint16_t crc_bitwise(const uint8_t *p, int len)
+{
+    uint16_t crc = 0xFFFF;
+    int k;
+
+    while (len--) {
+        crc ^= *p++;
+        for (k=0; k < 8; k++) crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+    return crc;
+}
+
+static void crcBench(void)
+{
+    uint8_t buf[RTU_MAXFRAME];
+    long long t0, t1, t2;
+    volatile uint16_t sink = 0;
+    int i, rounds = 100000;
+
+    for (i=0; i < (int)sizeof(buf); i++) buf[i] = i * 7 + 3;
+    if (crc_bitwise(buf, sizeof(buf)) != rtu_crc16(buf, sizeof(buf)) ||
+        crc_bitwise(buf, 7) != rtu_crc16(buf, 7)) {
+        printf("CRC mismatch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    t0 = sched_now_us();
+    for (i=0; i < rounds; i++) sink ^= crc_bitwise(buf, sizeof(buf));
+    t1 = sched_now_us();
+    for (i=0; i < rounds; i++) sink ^= rtu_crc16(buf, sizeof(buf));
+    t2 = sched_now_us();
+
+    printf("CRC16      bitwise %.2fns/byte, sliced %.2fns/byte\n",
+           (t1 - t0) * 1000.0 / rounds / sizeof(buf), (t2 - t1) * 1000.0 / rounds / sizeof(buf));
+}
+
+/*--------------------------------------------------------------------------
+    main
+----------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    struct termios tios;
+    struct rtu_port port;
+    struct rtu_request req;
+    uint16_t regs[125];
+    char *slave;
+    modbus_t *ctx;
+    long long t0, t1;
+    int ntx = 1000, nregs = 38, turnaround_ms = 0;
+    int master, keep, c, i, errors;
+    pid_t child;
+
+    while ((c = getopt(argc, argv, "n:r:l:")) != -1) {
+        switch (c) {
+            case 'n': ntx = atoi(optarg); break;
+            case 'r': nregs = atoi(optarg); break;
+            case 'l': turnaround_ms = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n transactions] [-r registers] [-l turnaround_ms]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (ntx < 1 || nregs < 1 || nregs > 125) {
+        fprintf(stderr, "%s: bad arguments\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    lat = calloc(ntx, sizeof(lat[0]));
+    rx = calloc(ntx, sizeof(rx[0]));
+
+    crcBench();
+
+    if ((master = posix_openpt(O_RDWR | O_NOCTTY)) == -1 || grantpt(master) || unlockpt(master)) {
+        perror("posix_openpt");
+        exit(EXIT_FAILURE);
+    }
+    slave = ptsname(master);
+    // Held open so the master doesn't hang up between the two runs
+    if ((keep = open(slave, O_RDWR | O_NOCTTY)) == -1) {
+        perror(slave);
+        exit(EXIT_FAILURE);
+    }
+    tcgetattr(master, &tios);
+    cfmakeraw(&tios);
+    tcsetattr(master, TCSANOW, &tios);
+
+    if ((child = fork()) == 0) meter(master, turnaround_ms);
+
+    // libmodbus
+    ctx = modbus_new_rtu(slave, 9600, 'N', 8, 1);
+    modbus_set_slave(ctx, 1);
+    if (modbus_connect(ctx) == -1) {
+        fprintf(stderr, "modbus_connect: %s\n", modbus_strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    errors = 0;
+    t0 = sched_now_us();
+    for (i=0; i < ntx; i++) {
+        long long s = sched_now_us();
+        if (modbus_read_input_registers(ctx, 0, nregs, regs) != nregs) errors++;
+        lat[i] = sched_now_us() - s;
+    }
+    t1 = sched_now_us();
+    modbus_close(ctx);
+    modbus_free(ctx);
+    report("libmodbus", lat, ntx, errors, t1 - t0);
+
+    // Native engine, timed the same way, sent to done from the callbacks
+    if (rtu_open(&port, slave, 9600, 'N', 1) == -1) {
+        perror("rtu_open");
+        exit(EXIT_FAILURE);
+    }
+    rtu_set_timeout(&port, 1000000L);
+    memset(&req, 0, sizeof(req));
+    req.slave = 1;
+    req.function = 0x04;
+    req.count = nregs;
+    req.regs = regs;
+    req.sent = on_sent;
+    req.done = on_done;
+    errors = 0;
+    t0 = sched_now_us();
+    for (i=0; i < ntx; i++) {
+        long long s = sched_now_us();
+        req.arg = &rx[i];
+        if (rtu_transact(&port, &req) != nregs) errors++;
+        lat[i] = sched_now_us() - s;
+    }
+    t1 = sched_now_us();
+    rtu_close(&port);
+    report("native", lat, ntx, errors, t1 - t0);
+    report("native rx", rx, ntx, errors, 0);
+
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    close(keep);
+    free(lat);
+    free(rx);
+
+    return 0;
+}
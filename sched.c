@@ -0,0 +1,190 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   sched.c                                                                  */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Earliest deadline first poll scheduler for register rate classes        */
+/*                                                                            */
+/*   A job is one meter + one rate class (period): the registers of that     */
+/*   meter read every period. A job is released at the start of its period   */
+/*   and must complete before the end (its deadline). Each bus turn takes    */
+/*   the released job with the earliest deadline and reads, in the same      */
+/*   plan, every other released job of the same meter.                       */
+/*                                                                            */
+/*   Bus transactions can't be preempted, so admission control uses the      */
+/*   non-preemptive EDF sufficient test: U + Cmax/Tmin <= 1.                 */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "readplan.h"
+#include "sched.h"
+
+/*--------------------------------------------------------------------------
+    sched_now_us
+----------------------------------------------------------------------------*/
+long long sched_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*--------------------------------------------------------------------------
+    sched_init
+----------------------------------------------------------------------------*/
+void sched_init(struct sched *s)
+{
+    memset(s, 0, sizeof(*s));
+}
+
+/*--------------------------------------------------------------------------
+    sched_add
+    Find or create the job of a meter rate class.
+----------------------------------------------------------------------------*/
+struct sched_job *sched_add(struct sched *s, int address, long period_ms)
+{
+    int i;
+
+    for (i=0; i < s->njobs; i++)
+        if (s->job[i].address == address && s->job[i].period_ms == period_ms) return &s->job[i];
+
+    if (s->njobs >= SCHED_MAXJOBS) return NULL;
+
+    memset(&s->job[s->njobs], 0, sizeof(s->job[0]));
+    s->job[s->njobs].address   = address;
+    s->job[s->njobs].period_ms = period_ms;
+    return &s->job[s->njobs++];
+}
+
+/*--------------------------------------------------------------------------
+    sched_admit
+    Estimate every job cost and check the bus can sustain the load.
+    Returns 0 if schedulable, -1 if not.
+----------------------------------------------------------------------------*/
+int sched_admit(struct sched *s, const struct bus_timing *bt)
+{
+    struct read_plan plan;
+    long cmax = 0;
+    long tmin = 0;
+    int i;
+
+    s->utilization = 0;
+    for (i=0; i < s->njobs; i++) {
+        struct sched_job *job = &s->job[i];
+
+        plan_clear(&plan);
+        plan_build(&plan, bt, PLAN_FC_INPUT, job->slots, PLAN_MAXREG/2);
+        if (job->time_disp) plan_add(&plan, bt, PLAN_FC_HOLDING, job->holding_address, 1);
+        job->cost_us = plan.total_us;
+
+        s->utilization += (double)job->cost_us / (job->period_ms * 1000.0);
+        if (job->cost_us > cmax) cmax = job->cost_us;
+        if (tmin == 0 || job->period_ms < tmin) tmin = job->period_ms;
+    }
+    s->blocking = tmin ? (double)cmax / (tmin * 1000.0) : 0;
+
+    return s->utilization + s->blocking <= 1.0 ? 0 : -1;
+}
+
+/*--------------------------------------------------------------------------
+    sched_start
+    Release every job now.
+----------------------------------------------------------------------------*/
+void sched_start(struct sched *s, long long now)
+{
+    int i;
+
+    for (i=0; i < s->njobs; i++)
+        s->job[i].deadline_us = now + s->job[i].period_ms * 1000LL;
+}
+
+/*--------------------------------------------------------------------------
+    sched_pick
+    Earliest deadline released job, merged with the other released jobs of
+    the same meter. Fills picked[] (per job), slots[] and time_disp.
+    Returns the meter address, 0 if nothing is released.
+----------------------------------------------------------------------------*/
+int sched_pick(struct sched *s, long long now, int picked[],
+               unsigned char slots[], int *time_disp)
+{
+    struct sched_job *edf = NULL;
+    int i, j;
+
+    for (i=0; i < s->njobs; i++) {
+        struct sched_job *job = &s->job[i];
+        picked[i] = 0;
+        if (job->deadline_us - job->period_ms * 1000LL > now) continue;     // Not released yet
+        if (edf == NULL || job->deadline_us < edf->deadline_us) edf = job;
+    }
+    if (edf == NULL) return 0;
+
+    memset(slots, 0, PLAN_MAXREG/2);
+    *time_disp = 0;
+    for (i=0; i < s->njobs; i++) {
+        struct sched_job *job = &s->job[i];
+        if (job->address != edf->address) continue;
+        if (job->deadline_us - job->period_ms * 1000LL > now) continue;
+        picked[i] = 1;
+        for (j=0; j < PLAN_MAXREG/2; j++) slots[j] |= job->slots[j];
+        *time_disp |= job->time_disp;
+    }
+
+    return edf->address;
+}
+
+/*--------------------------------------------------------------------------
+    sched_done
+    Move picked jobs to their next period. Periods missed while the bus
+    was busy are skipped, not queued.
+----------------------------------------------------------------------------*/
+void sched_done(struct sched *s, const int picked[], long long now)
+{
+    int i;
+
+    for (i=0; i < s->njobs; i++) {
+        struct sched_job *job = &s->job[i];
+        if (!picked[i]) continue;
+        job->runs++;
+        if (now > job->deadline_us) job->misses++;
+        job->deadline_us += job->period_ms * 1000LL;
+        while (job->deadline_us <= now) job->deadline_us += job->period_ms * 1000LL;
+    }
+}
+
+/*--------------------------------------------------------------------------
+    sched_next_release
+----------------------------------------------------------------------------*/
+long long sched_next_release(const struct sched *s)
+{
+    long long next = 0;
+    int i;
+
+    for (i=0; i < s->njobs; i++) {
+        long long release = s->job[i].deadline_us - s->job[i].period_ms * 1000LL;
+        if (i == 0 || release < next) next = release;
+    }
+    return next;
+}
+
+/*--------------------------------------------------------------------------
+    sched_print
+----------------------------------------------------------------------------*/
+void sched_print(FILE *out, const struct sched *s)
+{
+    int i, j, n;
+
+    fprintf(out, "Schedule: %d job(s), utilization %.1f%%, blocking %.1f%%\n",
+            s->njobs, s->utilization * 100, s->blocking * 100);
+    for (i=0; i < s->njobs; i++) {
+        const struct sched_job *job = &s->job[i];
+        for (j=0, n=0; j < PLAN_MAXREG/2; j++) n += job->slots[j] ? 1 : 0;
+        fprintf(out, "  meter %3d every %6ldms: %2d value(s)%s ~%ldus\n",
+                job->address, job->period_ms, n, job->time_disp ? " + display time" : "", job->cost_us);
+    }
+}
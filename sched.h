@@ -0,0 +1,58 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   sched.h                                                                  */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Earliest deadline first poll scheduler for register rate classes        */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdio.h>
+
+#include "readplan.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define SCHED_MAXJOBS     64
+
+struct sched_job {
+    int  address;                  /* Meter */
+    long period_ms;                /* Rate class */
+    unsigned char slots[PLAN_MAXREG/2]; /* Input registers of this class */
+    int  time_disp;                /* Display time holding register too */
+    int  holding_address;
+    long cost_us;                  /* Estimated bus time read alone */
+    long long deadline_us;         /* End of current period, monotonic */
+    unsigned long runs;
+    unsigned long misses;          /* Completed after deadline */
+};
+
+struct sched {
+    int  njobs;
+    struct sched_job job[SCHED_MAXJOBS];
+    double utilization;            /* Sum of cost/period */
+    double blocking;               /* Longest job / shortest period */
+};
+
+extern long long sched_now_us(void);
+extern void sched_init(struct sched *s);
+extern struct sched_job *sched_add(struct sched *s, int address, long period_ms);
+extern int  sched_admit(struct sched *s, const struct bus_timing *bt);
+extern void sched_start(struct sched *s, long long now);
+extern int  sched_pick(struct sched *s, long long now, int picked[],
+                       unsigned char slots[], int *time_disp);
+extern void sched_done(struct sched *s, const int picked[], long long now);
+extern long long sched_next_release(const struct sched *s);
+extern void sched_print(FILE *out, const struct sched *s);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __SCHED_H__ */
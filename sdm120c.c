@@ -37,6 +37,9 @@ extern "C" {
 #include <ctype.h>
 #include <getopt.h>
 #include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <termios.h>
 
 #include <modbus-version.h>
 #include <modbus.h>
@@ -44,6 +47,22 @@ extern "C" {
 #include "sdm120c.h"
 #include "RS485_lock.h"
 #include "log.h"
+#include "readplan.h"
+#include "sched.h"
+#include "meterstat.h"
+#include "rtu.h"
+#include "broker.h"
+#include "shmsnap.h"
+#include "regcache.h"
+#include "output.h"
+#include "metrics.h"
+#include "tstore.h"
+#include "rollup.h"
+#include "eguard.h"
+#include "integ.h"
+#include "deadband.h"
+#include "spool.h"
+#include "sink.h"
 
 #define DEFAULT_RATE 2400
 
@@ -66,9 +85,16 @@ extern "C" {
 #define TAENERGY  0x0156
 #define TRENERGY  0x0158
 
-uint16_t RTU_ReadRegistersBuffer[0x50]; // 0x50 = Max regs in 1 RTU transaction
-unsigned char RTU_ReadRegistersRequests[0x50/2]; // Registers to read
-unsigned char RTU_ReadRegistersAvailable[0x50/2]; // Registers already read
+#define RTU_MAXREG PLAN_MAXREG
+
+// __thread: per bus state, one thread per bus with several devices
+__thread uint16_t RTU_ReadRegistersBuffer[RTU_MAXREG];
+unsigned char RTU_ReadRegistersRequests[RTU_MAXREG/2]; // Registers to read
+__thread unsigned char RTU_ReadRegistersAvailable[RTU_MAXREG/2]; // Registers already read
+
+struct bus_timing bus_timing;
+struct read_plan read_plan;
+__thread struct sched poll_sched;
 
 // Write
 #define NPARSTOP  0x0012
@@ -97,6 +123,26 @@ int debug_flag     = 0;
 int trace_flag     = 0;
 
 int metern_flag    = 0;
+int compact_flag   = 0;
+
+int model          = MODEL_120;
+int num_retries    = 1;
+
+int power_flag     = 0;
+int volt_flag      = 0;
+int current_flag   = 0;
+int pangle_flag    = 0;
+int freq_flag      = 0;
+int pf_flag        = 0;
+int apower_flag    = 0;
+int rapower_flag   = 0;
+int export_flag    = 0;
+int import_flag    = 0;
+int total_flag     = 0;
+int rexport_flag   = 0;
+int rimport_flag   = 0;
+int rtotal_flag    = 0;
+int time_disp_flag = 0;
 
 const char *version     = "1.4";
 char *programName;
@@ -109,21 +155,254 @@ long unsigned int PPID;
 char *PARENTCOMMAND = NULL;
 
 int yLockWait = 0;                 /* Seconds to wait to lock serial port */
+int yLockPrio = -1;                /* Bus priority class, -1 = low polling, normal one shot */
+int yLockBudget = 0;               /* Bus time % before waiting clients go first, 0 = none */
 static time_t command_delay = -1;  /* MilliSeconds to wait before sending a command */
 static time_t settle_time = -1;    /* us to wait line to settle before starting chat */
 
-unsigned long TotalModbusTime = 0L;
+__thread unsigned long TotalModbusTime = 0L;
+
+static long response_timeout = 0;  /* us, -j */
+static int adaptive_flag = 0;      /* Response timeout learned from meter latency */
+static int calibrate_flag = 0;
+static __thread long long last_frame_us = 0; /* Bus idle since (monotonic us) */
+static __thread int current_address = 0;    /* Meter being read */
+static int native_flag = 0;        /* Bus I/O on the in-tree RTU engine */
+static __thread struct rtu_port rtu_port;
+static long byte_timeout_us = -1;  /* -y, -1 = disabled */
+
+static int scan_flag = 0;
+static int scan_bauds[4];          /* -b list with --scan */
+static int scan_nbauds = 0;
+static char scan_parities[3];      /* -P list with --scan */
+static int scan_nparities = 0;
+static int scan_stop_bits = 0;     /* -S, 0 = default for parity */
+
+static int poll_interval = 0;      /* Seconds between polls in daemon mode, 0 = one shot */
+static volatile sig_atomic_t daemon_stop = 0;
+#define BUS_RELOCK_WAIT 5          /* s, -w unset: lock wait between "still locked" logs */
+
+static int broker_flag = 0;        /* Serve reads to --via-broker clients */
+static int via_broker_flag = 0;
+static char *broker_socket = NULL; /* LCK..<tty>.sock */
+static int broker_absent = 0;      /* --via-broker and nobody listening */
+static modbus_t *broker_ctx = NULL;
+#define BROKER_WAIT 10             /* s, reply wait on top of -w */
+
+static int shm_flag = 0;           /* Publish readings to SNAP_DIR/sdm120c.<tty> */
+static char *metrics_spec = NULL;  /* --metrics [address:]port */
+static __thread struct snap_file *snap = NULL;
+
+static long max_age = -1;          /* --max-age ms, -1 = always read the meters */
+static char *cache_file = NULL;    /* LCK..<tty>.cache */
+
+static char *store_dir = NULL;     /* --store, <tty>.<meter>.<YYYYMMDD>.sdts files */
+static __thread struct ts_file *store_files[SNAP_METERS];
+static __thread int32_t store_day[SNAP_METERS]; /* Day of the file, -day if it failed */
+
+/* Serial buses polled by one daemon, each in its own thread */
+#define MAX_BUSES 8
+
+struct bus {
+    char *device;
+    int  address[10];              /* Meters, -a list if not given */
+    int  naddress;
+    pthread_t thread;
+    rs485_bus *lock;               /* Lock held, for cleanup at exit */
+    struct snap_file *snap;        /* Latest readings, for --metrics */
+    uint64_t transactions;         /* Bus statistics, for --metrics */
+    uint64_t failures;
+    uint64_t busy_us;
+};
+
+static struct bus buses[MAX_BUSES];
+static int nbuses = 0;
+static int buses_running = 0;
+static pthread_mutex_t buses_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct out_buf *sample_buf = NULL; /* pollDevice output */
+static __thread const char *sample_bus = NULL;     /* Bus tag of the samples */
+static __thread int sample_busidx = 0;             /* buses[] of this thread */
+static int output_style = OUT_VERBOSE;
+static uint32_t output_columns = 0; /* Values any poll may read, SNAP_x bits */
+static struct out_buf output;      /* One shot output, written at exit */
+static int rollup_windows[ROLLUP_WINDOWS]; /* --rollup, s */
+static int nrollups = 0;
+static __thread struct rollup *rollups[SNAP_METERS]; /* nrollups windows per meter */
+static char *guard_dir = NULL;     /* --energy-guard, <tty>.energy state files */
+static __thread struct eguard *guard = NULL;
+static __thread char *guard_file = NULL;
+static int integrate_flag = 0;     /* --integrate, fine energy counters from power */
+static __thread struct integs *integs;
+static int deadband_flag = 0;      /* --deadband or --heartbeat: changes only */
+static struct deadband deadband;
+static __thread struct deadband_meter *reported[SNAP_METERS];
+static char *spool_path = NULL;    /* --spool file, NULL = in memory */
+static long spool_kb = SPOOL_SIZE;
+static struct sink *sink = NULL;   /* --sink, or stdout with --spool */
+static struct spool *spool = NULL; /* Poll output goes through it if set */
+
+#define OPT_PLAN  256
+#define OPT_RATE  257
+#define OPT_ADAPTIVE 258
+#define OPT_CALIBRATE 259
+#define OPT_SCAN  260
+#define OPT_NATIVE 261
+#define OPT_PRIORITY 262
+#define OPT_BUDGET 263
+#define OPT_BUSSTATUS 264
+#define OPT_BROKER 265
+#define OPT_VIABROKER 266
+#define OPT_SHM 267
+#define OPT_MAXAGE 268
+#define OPT_FORMAT 269
+#define OPT_METRICS 270
+#define OPT_STORE 271
+#define OPT_ROLLUP 272
+#define OPT_EGUARD 273
+#define OPT_INTEGRATE 274
+#define OPT_DEADBAND 275
+#define OPT_HEARTBEAT 276
+#define OPT_SPOOL 277
+#define OPT_SPOOLSIZE 278
+#define OPT_SINK 279
+
+static struct option long_options[] = {
+    {"plan",  no_argument,       NULL, OPT_PLAN},
+    {"rate",  required_argument, NULL, OPT_RATE},
+    {"adaptive-timeout", no_argument, NULL, OPT_ADAPTIVE},
+    {"calibrate", no_argument, NULL, OPT_CALIBRATE},
+    {"scan",  no_argument,       NULL, OPT_SCAN},
+    {"native", no_argument,      NULL, OPT_NATIVE},
+    {"priority", required_argument, NULL, OPT_PRIORITY},
+    {"bus-budget", required_argument, NULL, OPT_BUDGET},
+    {"bus-status", no_argument,  NULL, OPT_BUSSTATUS},
+    {"broker", no_argument,      NULL, OPT_BROKER},
+    {"via-broker", no_argument,  NULL, OPT_VIABROKER},
+    {"shm",   no_argument,       NULL, OPT_SHM},
+    {"max-age", required_argument, NULL, OPT_MAXAGE},
+    {"format", required_argument, NULL, OPT_FORMAT},
+    {"metrics", required_argument, NULL, OPT_METRICS},
+    {"store", required_argument, NULL, OPT_STORE},
+    {"rollup", required_argument, NULL, OPT_ROLLUP},
+    {"energy-guard", required_argument, NULL, OPT_EGUARD},
+    {"integrate", no_argument,   NULL, OPT_INTEGRATE},
+    {"deadband", required_argument, NULL, OPT_DEADBAND},
+    {"heartbeat", required_argument, NULL, OPT_HEARTBEAT},
+    {"spool", required_argument, NULL, OPT_SPOOL},
+    {"spool-size", required_argument, NULL, OPT_SPOOLSIZE},
+    {"sink",  required_argument, NULL, OPT_SINK},
+    {NULL,    0,                 NULL, 0}
+};
+
+/* Reading options usable in --rate, i.e. --rate p=1000 --rate 2:ie=60000 */
+static struct {
+    char opt;
+    int *flag;
+    int  reg;
+} rate_opts[] = {
+    {'v', &volt_flag,    VOLTAGE},
+    {'c', &current_flag, CURRENT},
+    {'p', &power_flag,   POWER},
+    {'l', &apower_flag,  APOWER},
+    {'n', &rapower_flag, RAPOWER},
+    {'g', &pf_flag,      PFACTOR},
+    {'o', &pangle_flag,  PANGLE},
+    {'f', &freq_flag,    FREQUENCY},
+    {'i', &import_flag,  IAENERGY},
+    {'e', &export_flag,  EAENERGY},
+    {'t', &total_flag,   TAENERGY},
+    {'A', &rimport_flag, IRAENERGY},
+    {'B', &rexport_flag, ERAENERGY},
+    {'C', &rtotal_flag,  TRENERGY}
+};
+#define NRATEOPTS (int)(sizeof(rate_opts)/sizeof(rate_opts[0]))
+
+#define MAX_RATES 16
+
+static struct {
+    int  address;                  /* 0 = every meter */
+    long period_ms;
+    unsigned char opts[NRATEOPTS];
+} rates[MAX_RATES];
+static int nrates = 0;
+
+/*--------------------------------------------------------------------------
+    parseRate
+    [address:]options=milliseconds
+----------------------------------------------------------------------------*/
+int parseRate(const char *spec)
+{
+    const char *p = spec;
+    char *end;
+    int i;
+
+    if (nrates >= MAX_RATES) return -1;
+    memset(&rates[nrates], 0, sizeof(rates[0]));
+
+    if (strchr(p, ':') != NULL) {
+        rates[nrates].address = strtol(p, &end, 10);
+        if (*end != ':' || !(0 < rates[nrates].address && rates[nrates].address <= 247)) return -1;
+        p = end + 1;
+    }
+    for (; *p && *p != '='; p++) {
+        for (i=0; i < NRATEOPTS && rate_opts[i].opt != *p; i++);
+        if (i == NRATEOPTS) return -1;
+        rates[nrates].opts[i] = 1;
+    }
+    if (*p != '=' || p == spec) return -1;
+    rates[nrates].period_ms = strtol(p+1, &end, 10);
+    if (*end != '\0' || rates[nrates].period_ms < 100 || rates[nrates].period_ms > 86400000L) return -1;
+
+    nrates++;
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    buildSchedule
+    One job per meter and rate class. Values without a --rate class are
+    read every poll_interval, a meter specific class wins over a generic.
+----------------------------------------------------------------------------*/
+int buildSchedule(const int device_address[], int ndevices)
+{
+    struct sched_job *job;
+    int idevices, i, r;
+    long period_ms;
+
+    sched_init(&poll_sched);
+    for (idevices=0; idevices < ndevices; idevices++) {
+        int address = device_address[idevices];
+
+        for (i=0; i < NRATEOPTS; i++) {
+            if (!RTU_ReadRegistersRequests[rate_opts[i].reg/2]) continue;
+            period_ms = poll_interval * 1000L;
+            for (r=0; r < nrates; r++)
+                if (rates[r].address == 0 && rates[r].opts[i]) period_ms = rates[r].period_ms;
+            for (r=0; r < nrates; r++)
+                if (rates[r].address == address && rates[r].opts[i]) period_ms = rates[r].period_ms;
+            if ((job = sched_add(&poll_sched, address, period_ms)) == NULL) return -1;
+            job->slots[rate_opts[i].reg/2] = 1;
+        }
+        if (time_disp_flag == 1) {
+            if ((job = sched_add(&poll_sched, address, poll_interval * 1000L)) == NULL) return -1;
+            job->time_disp = 1;
+            job->holding_address = model == MODEL_120 ? TIME_DISP : TIME_DISP_220;
+        }
+    }
+    return 0;
+}
 
 void usage(char* program) {
     printf("sdm120c %s: ModBus RTU client to read EASTRON SDM120C smart mini power meter registers\n",version);
     printf("Copyright (C) 2015 Gianfranco Di Prinzio <gianfrdp@inwind.it>\n");
     printf("Complied with libmodbus %s\n\n", LIBMODBUS_VERSION_STRING);
-    printf("Usage: %s [-a address] [-d] [-x] [-p] [-v] [-c] [-e] [-i] [-t] [-f] [-g] [-T] [[-m]|[-q]] [-b baud_rate] [-P parity] [-S bit] [-z num_retries] [-j seconds] [-w seconds] [-1 | -2] device\n", program);
+    printf("Usage: %s [-a address] [-d] [-x] [-p] [-v] [-c] [-e] [-i] [-t] [-f] [-g] [-T] [[-m]|[-q]] [-I seconds] [-b baud_rate] [-P parity] [-S bit] [-z num_retries] [-j seconds] [-w seconds] [-1 | -2] device\n", program);
     printf("       %s [-a address] [-d] [-x] [-b baud_rate] [-P parity] [-S bit] [-1 | -2] [-z num_retries] [-j seconds] [-w seconds] -s new_address device\n", program);
     printf("       %s [-a address] [-d] [-x] [-b baud_rate] [-P parity] [-S bit] [-1 | -2] [-z num_retries] [-j seconds] [-w seconds] -r baud_rate device \n", program);
-    printf("       %s [-a address] [-d] [-x] [-b baud_rate] [-P parity] [-S bit] [-1 | -2] [-z num_retries] [-j seconds] [-w seconds] -R new_time device\n\n", program);
+    printf("       %s [-a address] [-d] [-x] [-b baud_rate] [-P parity] [-S bit] [-1 | -2] [-z num_retries] [-j seconds] [-w seconds] -R new_time device\n", program);
+    printf("       %s [-d] [-x] [-b baud_rate[,baud_rate..]] [-P parity[,parity..]] [-S bit] [-j seconds] --scan device\n\n", program);
     printf("Required:\n");
     printf("\tdevice\t\tSerial device (i.e. /dev/ttyUSB0)\n");
+    printf("\t\t\tWith -I: device[@address,..] device[@address,..] .. one thread per bus\n");
     printf("Connection parameters:\n");
     printf("\t-a address \tMeter number (1-247). Default: 1\n");
     printf("\t-b baud_rate \tUse baud_rate serial port speed (1200, 2400, 4800, 9600)\n");
@@ -132,6 +411,8 @@ void usage(char* program) {
     printf("\t-S bit \t\tUse stop bits (1, 2). Default: 1\n");
     printf("\t-1 \t\tModel: SDM120C (default)\n");
     printf("\t-2 \t\tModel: SDM220\n");
+    printf("\t--scan \t\tFind meters on addresses 1-247 at every -b/-P combination.\n");
+    printf("\t\t\tCSV output: address,baud,parity,stop_bits,model,latency_us\n");
     printf("Reading parameters (no parameter = retrieves all values):\n");
     printf("\t-p \t\tGet power (W)\n");
     printf("\t-v \t\tGet voltage (V)\n");
@@ -150,6 +431,12 @@ void usage(char* program) {
     printf("\t-T \t\tGet Time for rotating display values (0=no rotation)\n");
     printf("\t-m \t\tOutput values in IEC 62056 format ID(VALUE*UNIT)\n");
     printf("\t-q \t\tOutput values in compact mode\n");
+    printf("\t-I seconds \tDaemon mode: keep port open and locked, poll all meters\n");
+    printf("\t\t\tevery seconds until SIGTERM/SIGINT (1-86400)\n");
+    printf("\t--rate [address:]options=ms\n");
+    printf("\t\t\tDaemon mode: read values of options (vcplngofieatABC) every\n");
+    printf("\t\t\tms (100-86400000), of all meters or of meter address only.\n");
+    printf("\t\t\tRepeatable, i.e. --rate p=1000 --rate iet=60000. Use with -m\n");
     printf("Writing new settings parameters:\n");
     printf("\t-s new_address \tSet new meter number (1-247)\n");
     printf("\t-r baud_rate \tSet baud_rate meter speed (1200, 2400, 4800, 9600)\n");
@@ -164,13 +451,58 @@ void usage(char* program) {
     printf("\t-z num_retries\tTry to read max num_retries times on bus before exiting\n");
     printf("\t\t\twith error. Default: 1 (no retry)\n");
     printf("\t-j 1/10 secs\tResponse timeout. Default: 2=0.2s\n");
-    printf("\t-D 1/1000 secs\tDelay before sending commands. Default: 0ms\n");
+    printf("\t--native\tBus I/O on the in-tree RTU engine instead of libmodbus\n");
+    printf("\t--adaptive-timeout\n");
+    printf("\t\t\tResponse timeout from each meter measured latency (-j max)\n");
+    printf("\t-D 1/1000 secs\tDelay before sending commands. Default: t3.5 or calibrated gap\n");
+    printf("\t--calibrate\tFind the smallest safe inter-frame gap of the meters, then exit\n");
     printf("\t-w seconds\tTime to wait to lock serial port (1-30s). Default: 0s\n");
-    printf("\t-W 1/1000 secs\tTime to wait for 485 line to settle. Default: 0ms\n");
+    printf("\t--priority high|normal|low\n");
+    printf("\t\t\tBus priority class. Default: low with -I, else normal\n");
+    printf("\t--bus-budget percent\n");
+    printf("\t\t\tWith -I: share of bus time (1-100) before waiting clients go first\n");
+    printf("\t--bus-status\tShow who holds each serial device and bus use per class, then exit\n");
+    printf("\t--broker\tOwn device and serve reads of --via-broker clients until SIGTERM,\n");
+    printf("\t\t\tmerging requests for the same meter\n");
+    printf("\t--via-broker\tRead through the broker of device, the bus if none runs\n");
+    printf("\t--shm \t\tPublish every reading to %s/sdm120c.<tty>, see shmread\n", SNAP_DIR);
+    printf("\t--metrics [address:]port\n");
+    printf("\t\t\tWith -I or --broker: serve the latest values and bus statistics\n");
+    printf("\t\t\tat http://address:port/metrics (OpenMetrics). Default address: %s\n", METRICS_ADDR);
+    printf("\t--store dir\tWith -I: keep every reading compressed in dir, a file per meter\n");
+    printf("\t\t\tand day, see tsdump\n");
+    printf("\t--format json|csv|influx|binary\n");
+    printf("\t\t\tOne record per meter and poll with bus, meter and read time\n");
+    printf("\t--rollup 1m,15m,1h\n");
+    printf("\t\t\tWith -I and --format json|csv|influx: instead of every poll,\n");
+    printf("\t\t\tmin, max, mean, last and energy used per meter and window\n");
+    printf("\t--energy-guard dir\n");
+    printf("\t\t\tKeep import, export and total energy from going back (blackout,\n");
+    printf("\t\t\tmeter swap), offsets in dir/<tty>.energy\n");
+    printf("\t--integrate\tWith -I: import and export energy to a fraction of Wh, power\n");
+    printf("\t\t\tintegrated between energy register changes\n");
+    printf("\t--deadband options=threshold[%%]\n");
+    printf("\t\t\tWith -I: print a value only when it moved past threshold (in its\n");
+    printf("\t\t\tunit, or %% of it) or on --heartbeat, i.e. --deadband p=5 --deadband v=1%%\n");
+    printf("\t--heartbeat seconds\n");
+    printf("\t\t\tWith -I: print every value at least this often, the others only\n");
+    printf("\t\t\twhen they change\n");
+    printf("\t--spool file\tWith -I: queue the output in file, forwarded to the sink by a\n");
+    printf("\t\t\tthread, kept across restarts while the sink is down\n");
+    printf("\t--spool-size KiB\tRing size of a new spool, oldest output dropped when full.\n");
+    printf("\t\t\tDefault: %d\n", SPOOL_SIZE);
+    printf("\t--sink -|tcp://host:port|mqtt://[user[:password]@]host[:port][/prefix][?options]\n");
+    printf("\t\t\tWith -I: where the spool sends the output. Default: - (stdout)\n");
+    printf("\t\t\tmqtt: --format json objects to prefix/bus/meter, options\n");
+    printf("\t\t\tqos=0|1|2, retain=1, values=1 (prefix/bus/meter/value), id=client\n");
+    printf("\t--max-age ms\tValues read by another run up to ms ago are good enough,\n");
+    printf("\t\t\tthe bus is read only for the others\n");
+    printf("\t-W 1/1000 secs\tTime to wait for 485 line to settle. Default: t3.5\n");
     printf("\t-y 1/1000 secs\tSet timeout between every bytes (1-500). Default: disabled\n");
     printf("\t-d debug_level\tDebug (0=disable, 1=debug, 2=errors to syslog, 3=both)\n");
     printf("\t\t\tDefault: Fatal errors to syslog + fatal errors to stderr\n");
     printf("\t-x \t\tTrace (libmodbus debug on)\n");
+    printf("\t--plan \t\tShow register read plan and estimated bus time, then exit\n");
 }
 
 /*--------------------------------------------------------------------------
@@ -217,6 +549,158 @@ void *getMemPtr(size_t mSize)
 }
 
 
+/*--------------------------------------------------------------------------
+    busClose
+----------------------------------------------------------------------------*/
+void busClose(modbus_t *ctx)
+{
+    if (native_flag)
+        rtu_close(&rtu_port);
+    else
+        modbus_close(ctx);
+}
+
+/*--------------------------------------------------------------------------
+    getStatFile
+    Meter latency state, next to the serial port lock file.
+----------------------------------------------------------------------------*/
+char *getStatFile()
+{
+    static __thread char *statFile = NULL;
+
+    if (statFile == NULL && devLCKfile != NULL) {
+        statFile = getMemPtr(strlen(devLCKfile)+6);
+        sprintf(statFile, "%s.stat", devLCKfile);
+    }
+    return statFile;
+}
+
+/*--------------------------------------------------------------------------
+    openSnapshot
+    --shm, with the bus locked. --metrics alone keeps the same records in
+    memory.
+----------------------------------------------------------------------------*/
+void openSnapshot(const char *device)
+{
+    if (shm_flag) snap = snap_open(device);
+    else if (metrics_spec != NULL) snap = snap_anon(device);
+    else return;
+    if (snap == NULL)
+        log_message(debug_flag | DEBUG_SYSLOG, "Can't open the readings snapshot of %s (%d) %s", device, errno, strerror(errno));
+
+    pthread_mutex_lock(&buses_mutex);
+    buses[sample_busidx].snap = snap;
+    pthread_mutex_unlock(&buses_mutex);
+}
+
+/*--------------------------------------------------------------------------
+    closeSnapshot
+----------------------------------------------------------------------------*/
+void closeSnapshot()
+{
+    pthread_mutex_lock(&buses_mutex);
+    buses[sample_busidx].snap = NULL;
+    snap_close(snap);
+    snap = NULL;
+    pthread_mutex_unlock(&buses_mutex);
+}
+
+/*--------------------------------------------------------------------------
+    openGuard
+    --energy-guard: counters state of the meters of device.
+----------------------------------------------------------------------------*/
+void openGuard(const char *device)
+{
+    const char *tty = strrchr(device, '/');
+
+    if (guard_dir == NULL) return;
+    tty = tty != NULL ? tty + 1 : device;
+    guard = getMemPtr(sizeof(*guard));
+    guard_file = getMemPtr(strlen(guard_dir) + strlen(tty) + 9);
+    sprintf(guard_file, "%s/%s.energy", guard_dir, tty);
+    if (eguard_load(guard, guard_file) == 0)
+        log_message(debug_flag, "Energy guard loaded from %s", guard_file);
+}
+
+/*--------------------------------------------------------------------------
+    saveGuard
+----------------------------------------------------------------------------*/
+void saveGuard()
+{
+    if (guard != NULL && eguard_save(guard, guard_file) != 0)
+        log_message(debug_flag | DEBUG_SYSLOG, "Can't save energy guard to %s (%d) %s", guard_file, errno, strerror(errno));
+}
+
+/*--------------------------------------------------------------------------
+    closeGuard
+----------------------------------------------------------------------------*/
+void closeGuard()
+{
+    saveGuard();
+    free(guard);
+    free(guard_file);
+    guard = NULL;
+    guard_file = NULL;
+}
+
+/*--------------------------------------------------------------------------
+    openSpool
+    --spool, --sink: queue the daemon output, stream header (already in
+    output) first on every sink connection.
+----------------------------------------------------------------------------*/
+void openSpool()
+{
+    if (sink == NULL) sink = sink_new("-");
+    if ((spool = spool_open(spool_path, spool_kb * 1024)) == NULL) {
+        log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Can't open spool %s: (%d) %s",
+                    spool_path ? spool_path : "in memory", errno,
+                    errno == EWOULDBLOCK ? "in use by another process" : strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // A sink gone is retried, not a reason to die
+    signal(SIGPIPE, SIG_IGN);
+    if (spool_start(spool, sink, output.data, output.len, log_message, debug_flag) == -1) {
+        log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Can't start the spool drain: (%d) %s", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    output.len = 0;
+}
+
+/*--------------------------------------------------------------------------
+    writeOutput
+    A poll output to the spool, or stdout.
+----------------------------------------------------------------------------*/
+void writeOutput(struct out_buf *b)
+{
+    if (spool == NULL) {
+        out_flush(b, STDOUT_FILENO);
+        return;
+    }
+    if (spool_append(spool, b->data, b->len) == -1)
+        log_message(debug_flag | DEBUG_SYSLOG, "Output of %zu bytes dropped: (%d) %s", b->len, errno, strerror(errno));
+    b->len = 0;
+}
+
+/*--------------------------------------------------------------------------
+    closeSpool
+----------------------------------------------------------------------------*/
+void closeSpool()
+{
+    spool_close(spool, SPOOL_DRAINWAIT);
+    sink_free(sink);
+    spool = NULL;
+    sink = NULL;
+}
+
+/*--------------------------------------------------------------------------
+    saveMeterStat
+----------------------------------------------------------------------------*/
+void saveMeterStat()
+{
+    if ((adaptive_flag || calibrate_flag) && getStatFile() != NULL && mstat_save(getStatFile()) != 0)
+        log_message(debug_flag | DEBUG_SYSLOG, "Can't save meter latency to %s (%d) %s", getStatFile(), errno, strerror(errno));
+}
+
 void exit_error(modbus_t *ctx)
 {
 /*
@@ -225,15 +709,19 @@ void exit_error(modbus_t *ctx)
       usleep(1000 * settle_time);
       log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
 */
-      modbus_close(ctx);
+      busClose(ctx);
       modbus_free(ctx);
+      saveMeterStat();
+      closeGuard();
       ClrSerLock(PID);
       free(devLCKfile);
-      free(devLCKfileNew);
-      if (!metern_flag) {
+      if (sample_buf != NULL) {
+        out_status(sample_buf, output_style, 0);
+        out_flush(sample_buf, STDOUT_FILENO);
+      } else if (!metern_flag) {
         printf("NOK\n");
-        log_message(debug_flag | DEBUG_SYSLOG, "NOK");
       }
+      if (!metern_flag) log_message(debug_flag | DEBUG_SYSLOG, "NOK");
       free(PARENTCOMMAND);
       exit(EXIT_FAILURE);
 }
@@ -329,7 +817,342 @@ int getMeasureBCD(modbus_t *ctx, int address, int retries, int nb) {
 
 #endif
 
-float getMeasureFloat(modbus_t *ctx, int address, int retries, int nb) {
+/*--------------------------------------------------------------------------
+    setResponseTimeout
+----------------------------------------------------------------------------*/
+void setResponseTimeout(modbus_t *ctx, long timeout_us)
+{
+    if (native_flag) {
+        rtu_set_timeout(&rtu_port, timeout_us);
+        return;
+    }
+
+#if LIBMODBUS_VERSION_MAJOR >= 3 && LIBMODBUS_VERSION_MINOR >= 1 && LIBMODBUS_VERSION_MICRO >= 2
+    modbus_set_response_timeout(ctx, timeout_us / 1000000, timeout_us % 1000000);
+#else
+    struct timeval timeout;
+
+    timeout.tv_sec = timeout_us / 1000000;
+    timeout.tv_usec = timeout_us % 1000000;
+    modbus_set_response_timeout(ctx, &timeout);
+#endif
+}
+
+/*--------------------------------------------------------------------------
+    busReadInput, busReadHolding, busWrite
+    Bus transactions on libmodbus or, with --native, on the RTU engine.
+----------------------------------------------------------------------------*/
+int busReadInput(modbus_t *ctx, int address, int nb, uint16_t *dest)
+{
+    if (native_flag) return rtu_read_input(&rtu_port, current_address, address, nb, dest);
+    return modbus_read_input_registers(ctx, address, nb, dest);
+}
+
+int busReadHolding(modbus_t *ctx, int address, int nb, uint16_t *dest)
+{
+    if (native_flag) return rtu_read_holding(&rtu_port, current_address, address, nb, dest);
+    return modbus_read_registers(ctx, address, nb, dest);
+}
+
+int busWrite(modbus_t *ctx, int address, int nb, const uint16_t *src)
+{
+    int rc;
+
+    if (native_flag)
+        rc = rtu_write(&rtu_port, current_address, address, nb, src);
+    else
+        rc = modbus_write_registers(ctx, address, nb, src);
+    last_frame_us = sched_now_us();
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    adaptTimeout
+    With --adaptive-timeout, response timeout from the meter latency.
+----------------------------------------------------------------------------*/
+void adaptTimeout(modbus_t *ctx, int nregs, int attempt)
+{
+    long timeout_us;
+
+    if (!adaptive_flag) return;
+
+    timeout_us = mstat_timeout_us(current_address, nregs, response_timeout, attempt);
+    if (debug_flag) log_message(debug_flag, "Adaptive response timeout: %ldus", timeout_us);
+    setResponseTimeout(ctx, timeout_us);
+}
+
+/*--------------------------------------------------------------------------
+    recordTransaction
+----------------------------------------------------------------------------*/
+void recordTransaction(int nregs, int rc, long elapsed_us)
+{
+    struct bus *bus = &buses[sample_busidx];
+
+    __atomic_add_fetch(&bus->transactions, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bus->busy_us, elapsed_us, __ATOMIC_RELAXED);
+    if (rc == -1) __atomic_add_fetch(&bus->failures, 1, __ATOMIC_RELAXED);
+    last_frame_us = sched_now_us();
+    if (rc == -1)
+        mstat_fail(current_address);
+    else
+        mstat_sample(current_address, nregs, elapsed_us);
+}
+
+/*--------------------------------------------------------------------------
+    interFrameGap
+    Fixed -D if given, else only what is left of the meter gap (RTU t3.5
+    or calibrated) since the last frame on the bus.
+----------------------------------------------------------------------------*/
+void interFrameGap()
+{
+    long long idle;
+    long gap;
+
+    if (command_delay) {
+        log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
+        usleep(command_delay);
+        return;
+    }
+
+    gap = mstat_gap_us(current_address);
+    idle = sched_now_us() - last_frame_us;
+    if (idle < gap) {
+        if (debug_flag) log_message(debug_flag, "Inter-frame gap: %ldus", gap - (long)idle);
+        usleep(gap - idle);
+    }
+}
+
+/*--------------------------------------------------------------------------
+    lineSettle
+    Fixed -W if given, else t3.5 of silence since the port was opened.
+----------------------------------------------------------------------------*/
+void lineSettle()
+{
+    long long idle;
+    long gap = plan_t35_us(&bus_timing);
+
+    if (settle_time) {
+        log_message(debug_flag, "Sleeping %ldus for line settle...", settle_time);
+        usleep(settle_time);
+        return;
+    }
+
+    idle = sched_now_us() - last_frame_us;
+    if (idle < gap) usleep(gap - idle);
+}
+
+/*--------------------------------------------------------------------------
+    calibrateProbe
+    CAL_ROUNDS back to back reads with gap_us of bus idle before each.
+----------------------------------------------------------------------------*/
+#define CAL_ROUNDS  8        /* Reads per probed gap */
+#define CAL_STEP    250L     /* Search resolution (us) */
+
+int calibrateProbe(modbus_t *ctx, long gap_us)
+{
+    uint16_t tab_reg[2];
+    struct timeval tvStart, tvStop;
+    long long idle;
+    int i, rc;
+
+    for (i=0; i < CAL_ROUNDS; i++) {
+        idle = sched_now_us() - last_frame_us;
+        if (idle < gap_us) usleep(gap_us - idle);
+        setResponseTimeout(ctx, mstat_timeout_us(current_address, 2, response_timeout, 1));
+        gettimeofday(&tvStart, NULL);
+        rc = busReadInput(ctx, VOLTAGE, 2, tab_reg);
+        gettimeofday(&tvStop, NULL);
+        recordTransaction(2, rc, tv_diff(&tvStop, &tvStart));
+        if (rc == -1) {
+            log_message(debug_flag, "Gap %ldus: failed at read %d/%d", gap_us, i+1, CAL_ROUNDS);
+            // Let the line and the meter recover before the next probe
+            usleep(MSTAT_MAXGAP);
+            return -1;
+        }
+    }
+    log_message(debug_flag, "Gap %ldus: OK", gap_us);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    calibrateGap
+    Binary search of the smallest bus idle time before a request the meter
+    answers reliably, between t3.5 and MSTAT_MAXGAP.
+----------------------------------------------------------------------------*/
+void calibrateGap(modbus_t *ctx, int address)
+{
+    long t35 = plan_t35_us(&bus_timing);
+    long lo = t35, hi = MSTAT_MAXGAP, mid;
+
+    modbus_set_slave(ctx, address);
+    current_address = address;
+    mstat_set_gap(address, 0);
+
+    if (calibrateProbe(ctx, MSTAT_MAXGAP) == -1 && calibrateProbe(ctx, MSTAT_MAXGAP) == -1) {
+        printf("Meter %d: no answer\n", address);
+        return;
+    }
+
+    if (calibrateProbe(ctx, t35) == 0) {
+        hi = t35;
+    } else {
+        while (hi - lo > CAL_STEP) {
+            mid = (lo + hi) / 2;
+            if (calibrateProbe(ctx, mid) == 0) hi = mid;
+            else lo = mid;
+        }
+    }
+
+    mstat_set_gap(address, hi);
+    printf("Meter %d: gap %ldus (t3.5 %ldus), turnaround p50 %ldus p95 %ldus\n",
+           address, hi, t35, mstat_turnaround_us(address, 50), mstat_turnaround_us(address, 95));
+}
+
+/*--------------------------------------------------------------------------
+    scanProbe
+    One value read. Returns 1 on data, 0 on a Modbus exception (a meter
+    is there too), -1 if nobody answered. Elapsed time in *elapsed_us.
+----------------------------------------------------------------------------*/
+int scanProbe(modbus_t *ctx, const struct bus_timing *bt, int function, int address, long timeout_us, long *elapsed_us)
+{
+    uint16_t tab_reg[2];
+    struct timeval tvStart, tvStop;
+    long long idle;
+    int rc, errno_save;
+
+    idle = sched_now_us() - last_frame_us;
+    if (idle < plan_t35_us(bt)) usleep(plan_t35_us(bt) - idle);
+
+    setResponseTimeout(ctx, timeout_us);
+    gettimeofday(&tvStart, NULL);
+    if (function == PLAN_FC_INPUT)
+        rc = modbus_read_input_registers(ctx, address, 2, tab_reg);
+    else
+        rc = modbus_read_registers(ctx, address, 1, tab_reg);
+    errno_save = errno;
+    gettimeofday(&tvStop, NULL);
+    last_frame_us = sched_now_us();
+    *elapsed_us = tv_diff(&tvStop, &tvStart);
+
+    if (rc != -1) return 1;
+    return (errno_save >= EMBXILFUN && errno_save <= EMBXGTAR) ? 0 : -1;
+}
+
+/*--------------------------------------------------------------------------
+    scanBus
+    Probe addresses 1-247 for every -b/-P combination. Until a meter
+    answers each miss costs -j; then the probe timeout is twice the slowest
+    answer seen plus 2 t3.5, so a miss costs a few ms.
+    Prints one CSV line per meter, returns the number of meters found.
+----------------------------------------------------------------------------*/
+int scanBus(const char *device, int baud_rate, char parity)
+{
+    struct bus_timing bt;
+    struct timeval tvStart, tvStop;
+    modbus_t *ctx;
+    long probe_timeout, latency, slowest, elapsed;
+    int nbauds = scan_nbauds ? scan_nbauds : 1;
+    int nparities = scan_nparities ? scan_nparities : 1;
+    int b, p, address, stop, model_found;
+    int found = 0;
+
+    gettimeofday(&tvStart, NULL);
+    printf("# address,baud,parity,stop_bits,model,latency_us\n");
+    for (b=0; b < nbauds; b++) {
+        int baud = scan_nbauds ? scan_bauds[b] : baud_rate;
+
+        for (p=0; p < nparities; p++) {
+            char par = scan_nparities ? scan_parities[p] : parity;
+
+            stop = scan_stop_bits ? scan_stop_bits : (par != N_PARITY ? 1 : 2);
+            log_message(debug_flag, "Scanning %d%c%d", baud, par, stop);
+
+            ctx = modbus_new_rtu(device, baud, par, 8, stop);
+            if (ctx == NULL || modbus_connect(ctx) == -1) {
+                log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Connection failed at %d%c%d: (%d) %s", baud, par, stop, errno, modbus_strerror(errno));
+                if (ctx != NULL) modbus_free(ctx);
+                continue;
+            }
+            modbus_set_error_recovery(ctx, MODBUS_ERROR_RECOVERY_NONE);
+            if (trace_flag == 1) modbus_set_debug(ctx, 1);
+            last_frame_us = sched_now_us();
+
+            plan_timing_init(&bt, baud, par, stop, response_timeout);
+            probe_timeout = response_timeout;
+            slowest = 0;
+
+            for (address=1; address <= 247; address++) {
+                modbus_set_slave(ctx, address);
+                if (scanProbe(ctx, &bt, PLAN_FC_INPUT, VOLTAGE, probe_timeout, &latency) == -1) continue;
+
+                if (latency > slowest) {
+                    slowest = latency;
+                    probe_timeout = 2 * slowest + 2 * plan_t35_us(&bt);
+                    if (probe_timeout > response_timeout) probe_timeout = response_timeout;
+                    log_message(debug_flag, "Probe timeout: %ldus", probe_timeout);
+                }
+
+                // Model from the holding register only one of them has
+                if (scanProbe(ctx, &bt, PLAN_FC_HOLDING, TIME_DISP, probe_timeout, &elapsed) == 1)
+                    model_found = MODEL_120;
+                else if (scanProbe(ctx, &bt, PLAN_FC_HOLDING, TIME_DISP_220, probe_timeout, &elapsed) == 1)
+                    model_found = MODEL_220;
+                else
+                    model_found = 0;
+
+                printf("%d,%d,%c,%d,%s,%ld\n", address, baud, par, stop,
+                       model_found == MODEL_120 ? "SDM120" : model_found == MODEL_220 ? "SDM220" : "unknown",
+                       latency);
+                fflush(stdout);
+                found++;
+            }
+
+            modbus_close(ctx);
+            modbus_free(ctx);
+        }
+    }
+    gettimeofday(&tvStop, NULL);
+    log_message(debug_flag, "Scan: %d meter(s) in %ldms", found, tv_diff(&tvStop, &tvStart) / 1000);
+
+    return found;
+}
+
+/*--------------------------------------------------------------------------
+    Holding registers read by a plan window (config values)
+----------------------------------------------------------------------------*/
+#define RTU_MAXHOLDING 8
+
+static __thread struct {
+    int address;
+    uint16_t value;
+} RTU_HoldingRegisters[RTU_MAXHOLDING];
+static __thread int RTU_HoldingCount = 0;
+
+void setHoldingRegister(int address, uint16_t value)
+{
+    int i;
+
+    for (i=0; i < RTU_HoldingCount; i++)
+        if (RTU_HoldingRegisters[i].address == address) break;
+    if (i == RTU_MAXHOLDING) return;
+    if (i == RTU_HoldingCount) RTU_HoldingCount++;
+    RTU_HoldingRegisters[i].address = address;
+    RTU_HoldingRegisters[i].value = value;
+}
+
+int getHoldingRegisters(int address, int nb, uint16_t *dest)
+{
+    int i, n;
+
+    for (n=0; n < nb; n++) {
+        for (i=0; i < RTU_HoldingCount && RTU_HoldingRegisters[i].address != address+n; i++);
+        if (i == RTU_HoldingCount) return -1;
+        dest[n] = RTU_HoldingRegisters[i].value;
+    }
+    return nb;
+}
+
+int getMeasureFloat(modbus_t *ctx, int address, int retries, int nb, float *value) {
 
     uint16_t tab_reg[nb * sizeof(uint16_t)];
     int rc = -1;
@@ -341,23 +1164,23 @@ float getMeasureFloat(modbus_t *ctx, int address, int retries, int nb) {
 
     if (debug_flag) log_message(debug_flag, "getMeasureFloat(), registry=%d [0x%04X]", address, address);
 
-    if (RTU_ReadRegistersAvailable[address/2]==1) {
-        return reform_uint16_2_float32(RTU_ReadRegistersBuffer[address], RTU_ReadRegistersBuffer[address+1]);
+    if (address/2 < RTU_MAXREG/2 && RTU_ReadRegistersAvailable[address/2]==1) {
+        *value = reform_uint16_2_float32(RTU_ReadRegistersBuffer[address], RTU_ReadRegistersBuffer[address+1]);
+        return 0;
     }
 
     while (j < retries && exit_loop == 0) {
       j++;
 
-      if (command_delay) {
-        log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
-        usleep(command_delay);
-      }
+      interFrameGap();
 
       log_message(debug_flag, "%d/%d. Register Address %d [%04X], bufsize=%d", j, retries, 30000+address+1, address, nb);
+      adaptTimeout(ctx, nb, j);
       gettimeofday(&tvStart, NULL); 
-      rc = modbus_read_input_registers(ctx, address, nb, tab_reg);
+      rc = busReadInput(ctx, address, nb, tab_reg);
       errno_save = errno;
       gettimeofday(&tvStop, NULL); 
+      recordTransaction(nb, rc, tv_diff(&tvStop, &tvStart));
 
       if (rc == -1) {
         if (trace_flag) fprintf(stderr, "%s: ERROR (%d) %s, %d/%d\n", programName, errno_save, modbus_strerror(errno_save), j, retries);
@@ -367,10 +1190,7 @@ float getMeasureFloat(modbus_t *ctx, int address, int retries, int nb) {
         log_message(debug_flag, "Flushing modbus buffer");
         log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
         */
-        if (command_delay) {
-          log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
-          usleep(command_delay);
-        }
+        interFrameGap();
       } else {
         unsigned long tmp = tv_diff(&tvStop, &tvStart);
         log_message(debug_flag, "Reading OK: %d register(s) in %ldus time", rc, tmp);
@@ -381,7 +1201,7 @@ float getMeasureFloat(modbus_t *ctx, int address, int retries, int nb) {
     }
 
     if (rc == -1) {
-      exit_error(ctx);
+      return -1;
     }
 
     if (debug_flag) {
@@ -402,111 +1222,114 @@ float getMeasureFloat(modbus_t *ctx, int address, int retries, int nb) {
     return value;
 */
 
-    return reform_uint16_2_float32(tab_reg[0], tab_reg[1]);
+    *value = reform_uint16_2_float32(tab_reg[0], tab_reg[1]);
+    return 0;
 
 }
 
-void readRegisters(modbus_t *ctx, int offset, int nregs, uint16_t RTU_ReadRegistersBuffer[], unsigned char RTU_ReadRegistersRequests[], int retries)
+int readRegisters(modbus_t *ctx, const struct read_plan *plan, int retries)
 {
     int rc = -1;
     int i;
-    int j = 0;
-    int exit_loop = 0;
+    int j;
+    int w;
+    int exit_loop;
     int errno_save=0;
     struct timeval tvStart, tvStop;
-    int startreg, endreg;
-    
-    // todo: Optimize reading
-    
-    startreg=0;
-    //log_message(debug_flag, "startreg=%d", startreg);
-    for (i=0; i<nregs/2; i++) {
-        if (RTU_ReadRegistersRequests[i] != 0) {
-                startreg=i;
-                break;
+    uint16_t tab_reg[PLAN_MAXREGS];
+
+    for (w=0; w < plan->nwindows; w++) {
+      const struct plan_window *win = &plan->window[w];
+      int base = win->function == PLAN_FC_INPUT ? 30000 : 40000;
+
+      log_message(debug_flag, "window %d/%d, FC%02X, start=0x%04X, bufsize=%d", w+1, plan->nwindows, win->function, win->start, win->count);
+
+      j = 0;
+      exit_loop = 0;
+      while (j < retries && exit_loop == 0) {
+        j++;
+
+        interFrameGap();
+
+        log_message(debug_flag, "%d/%d. Register Address %d [0x%04X], bufsize=%d", j, retries, base+win->start+1, win->start, win->count);
+        adaptTimeout(ctx, win->count, j);
+        gettimeofday(&tvStart, NULL); 
+        if (win->function == PLAN_FC_INPUT)
+          rc = busReadInput(ctx, win->start, win->count, &RTU_ReadRegistersBuffer[win->start]);
+        else
+          rc = busReadHolding(ctx, win->start, win->count, tab_reg);
+        errno_save = errno;
+        gettimeofday(&tvStop, NULL); 
+        recordTransaction(win->count, rc, tv_diff(&tvStop, &tvStart));
+
+        if (rc == -1) {
+          if (trace_flag) fprintf(stderr, "%s: ERROR (%d) %s, %d/%d\n", programName, errno_save, modbus_strerror(errno_save), j, retries);
+          log_message(debug_flag | ( j==retries ? DEBUG_SYSLOG : 0), "ERROR (%d) %s, %d/%d, Address %d [0x%04X]", errno_save, modbus_strerror(errno_save), j, retries, base+win->start+1, win->start);
+          log_message(debug_flag | ( j==retries ? DEBUG_SYSLOG : 0), "Response timeout gave up after %ldus", tv_diff(&tvStop, &tvStart));
+          /* libmodbus already flushes 
+          log_message(debug_flag, "Flushing modbus buffer");
+          log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
+          */
+          interFrameGap();
+        } else {
+          unsigned long tmp = tv_diff(&tvStop, &tvStart);
+          log_message(debug_flag, "Reading OK: %d register(s) in %ldus time", rc, tmp);
+          TotalModbusTime += tmp;
+          exit_loop = 1;
         }
-        //log_message(debug_flag, "%d, startreg=%d", i, startreg);
-    }
 
-    endreg=nregs/2-1;
-    //log_message(debug_flag, "endreg=%d", endreg);
-    for (i=nregs/2-1; i>=0; i--) {
-        if (RTU_ReadRegistersRequests[i] != 0) {
-                endreg=i;
-                break;
+      }
+
+      if (rc == -1) {
+        return -1;
+      }
+
+      if (win->function == PLAN_FC_INPUT) {
+        for (i=0; i < rc/2; i++) RTU_ReadRegistersAvailable[win->start/2+i]=1;
+        if (debug_flag) {
+          for (i=0; i < rc; i++)
+            log_message(debug_flag, "reg(%d/%d)[0x%04X]=%d [0x%04X]"
+                                    , i+1, rc, win->start+i
+                                    , RTU_ReadRegistersBuffer[win->start+i]
+                                    , RTU_ReadRegistersBuffer[win->start+i]);
+        }
+      } else {
+        for (i=0; i < rc; i++) {
+          setHoldingRegister(win->start+i, tab_reg[i]);
+          if (debug_flag) log_message(debug_flag, "reg(%d/%d)[0x%04X]=%d [0x%04X]"
+                                      , i+1, rc, win->start+i, tab_reg[i], tab_reg[i]);
         }
-        //log_message(debug_flag, "%d, endreg=%d", i, endreg);
+      }
     }
-    log_message(debug_flag, "nregs=%d, startreg=%d, endreg=%d, bufsize=%d", nregs, startreg, endreg, (1+endreg-startreg)*2);
-    
+
+    return 0;
+}
+
+int getConfigBCD(modbus_t *ctx, int address, int retries, int nb, int *value) {
+
+    uint16_t tab_reg[nb * sizeof(uint16_t)];
+    int rc = -1;
+    int i;
+    int j = 0;
+    int exit_loop = 0;
+    struct timeval tvStart, tvStop;
+
+    if (getHoldingRegisters(address, nb, tab_reg) == nb) {
+        *value = bcd2num(&tab_reg[0], nb);
+        return 0;
+    }
+
     while (j < retries && exit_loop == 0) {
       j++;
 
-      if (command_delay) {
-        log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
-        usleep(command_delay);
-      }
+      interFrameGap();
 
-      log_message(debug_flag, "%d/%d. Register Address %d [0x%04X], bufsize=%d", j, retries, 30000+startreg*2+1, startreg*2, (endreg-startreg+1)*2);
+      log_message(debug_flag, "%d/%d. Register Address %d [%04X]", j, retries, 400000+address+1, address);
+      adaptTimeout(ctx, nb, j);
       gettimeofday(&tvStart, NULL); 
-      rc = modbus_read_input_registers(ctx, offset+startreg*2, (endreg-startreg+1)*2, &RTU_ReadRegistersBuffer[startreg*2]);
-      errno_save = errno;
+      rc = busReadHolding(ctx, address, nb, tab_reg);
       gettimeofday(&tvStop, NULL); 
-
-      if (rc == -1) {
-        if (trace_flag) fprintf(stderr, "%s: ERROR (%d) %s, %d/%d\n", programName, errno_save, modbus_strerror(errno_save), j, retries);
-        log_message(debug_flag | ( j==retries ? DEBUG_SYSLOG : 0), "ERROR (%d) %s, %d/%d, Address %d [0x%04X]", errno_save, modbus_strerror(errno_save), j, retries, 30000+(startreg*2)+1, startreg);
-        log_message(debug_flag | ( j==retries ? DEBUG_SYSLOG : 0), "Response timeout gave up after %ldus", tv_diff(&tvStop, &tvStart));
-        /* libmodbus already flushes 
-        log_message(debug_flag, "Flushing modbus buffer");
-        log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
-        */
-        if (command_delay) {
-          log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
-          usleep(command_delay);
-        }
-      } else {
-        unsigned long tmp = tv_diff(&tvStop, &tvStart);
-        log_message(debug_flag, "Reading OK: %d register(s) in %ldus time", rc, tmp);
-        TotalModbusTime += tmp;
-        exit_loop = 1;
-      }
-
-    }
-
-    if (rc == -1) {
-      exit_error(ctx);
-    }
-
-    for (i=0; i < rc; i++) {
-        RTU_ReadRegistersAvailable[startreg+i]=1;
-        //if (debug_flag) log_message(debug_flag, "reg[0x%04X] is marked read", (startreg+i)*2);
-        if (debug_flag) log_message(debug_flag, "reg(%d/%d)[0x%04X]=%d [0x%04X]"
-                                    , i+1, rc, (startreg+i)*2
-                                    , RTU_ReadRegistersBuffer[startreg*2+i]
-                                    , RTU_ReadRegistersBuffer[startreg*2+i]);
-    }
-
- }
-
-int getConfigBCD(modbus_t *ctx, int address, int retries, int nb) {
-
-    uint16_t tab_reg[nb * sizeof(uint16_t)];
-    int rc = -1;
-    int i;
-    int j = 0;
-    int exit_loop = 0;
-
-    while (j < retries && exit_loop == 0) {
-      j++;
-
-      if (command_delay) {
-        log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
-        usleep(command_delay);
-      }
-
-      log_message(debug_flag, "%d/%d. Register Address %d [%04X]", j, retries, 400000+address+1, address);
-      rc = modbus_read_registers(ctx, address, nb, tab_reg);
+      recordTransaction(nb, rc, tv_diff(&tvStop, &tvStart));
 
       if (rc == -1) {
         log_message(debug_flag | ( j==retries ? DEBUG_SYSLOG : 0), "ERROR (%d) %s, %d/%d, Address %d [%04X]", errno, modbus_strerror(errno), j, retries, 30000+address+1, address);
@@ -514,17 +1337,14 @@ int getConfigBCD(modbus_t *ctx, int address, int retries, int nb) {
         log_message(debug_flag, "Flushing modbus buffer");
         log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
         */
-        if (command_delay) {
-          log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
-          usleep(command_delay);
-        }
+        interFrameGap();
       } else {
         exit_loop = 1;
       }
     }
 
     if (rc == -1) {
-      exit_error(ctx);
+      return -1;
     }
 
     if (debug_flag) {
@@ -533,9 +1353,9 @@ int getConfigBCD(modbus_t *ctx, int address, int retries, int nb) {
        }
     }
 
-    int value = bcd2num(&tab_reg[0], rc);
+    *value = bcd2num(&tab_reg[0], rc);
 
-    return value;
+    return 0;
 
 }
 
@@ -544,12 +1364,9 @@ void changeConfigHex(modbus_t *ctx, int address, int new_value, int restart)
     uint16_t tab_reg[1];
     tab_reg[0] = new_value;
 
-    if (command_delay) {
-      log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
-      usleep(command_delay);
-    }
+    interFrameGap();
 
-    int n = modbus_write_registers(ctx, address, 1, tab_reg);
+    int n = busWrite(ctx, address, 1, tab_reg);
     if (n != -1) {
         printf("New value %d for address 0x%X\n", new_value, address);
         if (restart == RESTART_TRUE) printf("You have to restart the meter for apply changes\n");
@@ -572,12 +1389,9 @@ void changeConfigFloat(modbus_t *ctx, int address, int new_value, int restart, i
     tab_reg[0] = tmp2;
     tab_reg[1] = tmp1;
 
-    if (command_delay) {
-      log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
-      usleep(command_delay);
-    }
+    interFrameGap();
 
-    int n = modbus_write_registers(ctx, address, nb, tab_reg);
+    int n = busWrite(ctx, address, nb, tab_reg);
     if (n != -1) {
         printf("New value %d for address 0x%X\n", new_value, address);
         if (restart == RESTART_TRUE) printf("You have to restart the meter for apply changes\n");
@@ -595,12 +1409,9 @@ void changeConfigBCD(modbus_t *ctx, int address, int new_value, int restart, int
     uint16_t u_new_value = int2bcd(new_value);
     tab_reg[0] = u_new_value;
 
-    if (command_delay) {
-      log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
-      usleep(command_delay);
-    }
+    interFrameGap();
 
-    int n = modbus_write_registers(ctx, address, nb, tab_reg);
+    int n = busWrite(ctx, address, nb, tab_reg);
     if (n != -1) {
         printf("New value %d for address 0x%X\n", u_new_value, address);
         if (restart == RESTART_TRUE) printf("You have to restart the meter for apply changes\n");
@@ -656,233 +1467,1216 @@ void *getPIDcmd(long unsigned int PID)
     return COMMAND;
 }
 
-int main(int argc, char* argv[])
+/*--------------------------------------------------------------------------
+    readMeter
+    Fill the register caches from one meter following plan.
+----------------------------------------------------------------------------*/
+int readMeter(modbus_t *ctx, int address, const struct read_plan *plan)
 {
-    static int device_address[10] = {1};
-    int idevices = -1;
-    int ndevices = 1;
-    
-    
-    int model          = MODEL_120;
-    int new_address    = 0;
-    int power_flag     = 0;
-    int volt_flag      = 0;
-    int current_flag   = 0;
-    int pangle_flag    = 0;
-    int freq_flag      = 0;
-    int pf_flag        = 0;
-    int apower_flag    = 0;
-    int rapower_flag   = 0;
-    int export_flag    = 0;
-    int import_flag    = 0;
-    int total_flag     = 0;
-    int rexport_flag   = 0;
-    int rimport_flag   = 0;
-    int rtotal_flag    = 0;
-    int new_baud_rate  = 0;
-    int new_parity_stop= -1;
-    int compact_flag   = 0;
-    int time_disp_flag = 0;
-    int rotation_time_flag = 0;
-    int rotation_time  = 0; 
-    int measurement_mode_flag = 0;
-    int measurement_mode = 0; 
-    int count_param    = 0;
-    int num_retries    = 1;
-#if LIBMODBUS_VERSION_MAJOR >= 3 && LIBMODBUS_VERSION_MINOR >= 1 && LIBMODBUS_VERSION_MICRO >= 2
-    uint32_t resp_timeout = 2;
-    uint32_t byte_timeout = -1;    
-#else
-    time_t resp_timeout = 2;
-    time_t byte_timeout = -1;
-#endif
-    char *szttyDevice  = NULL;
+    log_message(debug_flag, "Connecting to device id: %d", address);
+    lineSettle();
 
-    int c;
-    int speed          = 0;
-    int bits           = 0;
-    int read_count     = 0;
+    modbus_set_slave(ctx, address);
+    current_address = address;
+    memset(RTU_ReadRegistersAvailable, 0, sizeof(RTU_ReadRegistersAvailable));
+    RTU_HoldingCount = 0;
 
-    const char *EVEN_parity = "E";
-    const char *NONE_parity = "N";
-    const char *ODD_parity  = "O";
-    char *c_parity     = NULL;
-    
-    int baud_rate      = 0;
-    int stop_bits      = 0;
-    char parity        = E_PARITY;
-    
-    programName        = argv[0];
+    //log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx)); // Already flushed by connect 
 
-    if (argc == 1) {
-        usage(programName);
-        exit(EXIT_FAILURE);
+    log_message(debug_flag, "readRegisters(ctx, plan, %d), %d window(s)", num_retries, plan->nwindows);
+    if (readRegisters(ctx, plan, num_retries) == -1) {
+        snap_fail(snap, address);
+        return -1;
     }
+    return 0;
+}
 
-    srand(getpid()^time(NULL));      // Init random numbers
+/* Snapshot values, SNAP_x order */
+static const struct {
+    int   reg;
+    float scale;
+} snap_regs[SNAP_TIMEDISP] = {
+    {VOLTAGE, 1}, {CURRENT, 1}, {POWER, 1}, {APOWER, 1}, {RAPOWER, 1},
+    {PFACTOR, 1}, {PANGLE, 1}, {FREQUENCY, 1},
+    {IAENERGY, 1000}, {EAENERGY, 1000}, {TAENERGY, 1000},
+    {IRAENERGY, 1000}, {ERAENERGY, 1000}, {TRENERGY, 1000}
+};
 
-    PID = getpid();
-    getCmdLine();
+/*--------------------------------------------------------------------------
+    publishSnapshot
+    --shm: requested values of a meter, from the register caches.
+----------------------------------------------------------------------------*/
+void publishSnapshot(int address, const unsigned char requests[], int holding)
+{
+    float value[SNAP_VALUES];
+    uint32_t fields = 0;
+    int i, v;
+
+    if (snap == NULL) return;
+    for (i=0; i < SNAP_TIMEDISP; i++) {
+        // No retry: cache only
+        if (!requests[snap_regs[i].reg/2] || getMeasureFloat(NULL, snap_regs[i].reg, 0, 2, &value[i]) == -1) continue;
+        value[i] *= snap_regs[i].scale;
+        fields |= 1U << i;
+    }
+    if (holding && getConfigBCD(NULL, holding, 0, 1, &v) == 0) {
+        value[SNAP_TIMEDISP] = v;
+        fields |= 1U << SNAP_TIMEDISP;
+    }
+    snap_publish(snap, address, value, fields, NULL);
+}
 
-    PPID = getppid();
-    PARENTCOMMAND = getPIDcmd(PPID); 
+/*--------------------------------------------------------------------------
+    brokerRead
+    --via-broker: fill the register caches from the reply of the broker.
+    broker_absent is set when no broker listens on the socket.
+----------------------------------------------------------------------------*/
+int brokerRead(int address, const unsigned char requests[], int time_disp)
+{
+    struct broker_request req;
+    struct broker_reply reply;
+    int i;
 
-    opterr = 0;
+    memset(&req, 0, sizeof(req));
+    req.version = BROKER_VERSION;
+    req.address = address;
+    req.holding = time_disp ? (model == MODEL_120 ? TIME_DISP : TIME_DISP_220) : 0;
+    memcpy(req.slots, requests, sizeof(req.slots));
 
-    while ((c = getopt (argc, argv, "a:Ab:BcCd:D:efgij:lmM:nN:opP:qr:R:s:S:tTvw:W:xy:z:12")) != -1) {
-        switch (c)
-        {
-            case 'a':
-                device_address[++idevices] = atoi(optarg);
-                ndevices=idevices+1;
-                if (!(0 < device_address[ndevices-1] && device_address[ndevices-1] <= 247)) {
-                    fprintf (stderr, "%s: Address must be between 1 and 247.\n", programName);
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case 'v':
-                volt_flag = 1;
-                RTU_ReadRegistersRequests[VOLTAGE/2]=1;
-                count_param++;
-                break;
-            case 'p':
-                power_flag = 1;
-                RTU_ReadRegistersRequests[POWER/2]=1;
-                count_param++;
-                break;
-            case 'c':
-                current_flag = 1;
-                RTU_ReadRegistersRequests[CURRENT/2]=1;
-                count_param++;
-                break;
-            case 'e':
-                export_flag = 1;
-                RTU_ReadRegistersRequests[EAENERGY/2]=1;                
-                count_param++;
-                break;
-            case 'i':
-                import_flag = 1;
-                RTU_ReadRegistersRequests[IAENERGY/2]=1;                
-                count_param++;
-                break;
-            case 't':
-                total_flag = 1;
-//                RTU_ReadRegistersRequests[TAENERGY/2]=1;                
-                count_param++;
-                break;
-            case 'A':
-                rimport_flag = 1;
-                RTU_ReadRegistersRequests[IRAENERGY/2]=1;                
-                count_param++;
-                break;
-            case 'B':
-                rexport_flag = 1;
-                RTU_ReadRegistersRequests[ERAENERGY/2]=1;                
-                count_param++;
-                break;
-            case 'C':
-                rtotal_flag = 1;
-//                RTU_ReadRegistersRequests[TRENERGY/2]=1;                
-                count_param++;
-                break;
-            case 'f':
-                freq_flag = 1;
-                RTU_ReadRegistersRequests[FREQUENCY/2]=1;
-                count_param++;
-                break;
-            case 'g':
-                pf_flag = 1;
-                RTU_ReadRegistersRequests[PFACTOR/2]=1;
-                count_param++;
-                break;
-            case 'l':
-                apower_flag = 1;
-                RTU_ReadRegistersRequests[APOWER/2]=1;
-                count_param++;
-                break;
-            case 'n':
-                rapower_flag = 1;
-                RTU_ReadRegistersRequests[RAPOWER/2]=1;
-                count_param++;
-                break;
-            case 'o':
-                pangle_flag = 1;
-                RTU_ReadRegistersRequests[PANGLE/2]=1;
-                count_param++;
-                break;
-            case 'd':
-                switch (*optarg) {
-                    case '0':
-                    case '1':
-                    case '2':
-                    case '3':
-                        debug_flag = atoi(optarg) & DEBUG_STDERR;
-                        debug_mask = atoi(optarg);
-                        break;
-                    default:
-                         fprintf (stderr, "%s: Debug value must be one of 0,1,2,3.\n", programName);
-                         exit(EXIT_FAILURE);
-                }
-                break;
-            case 'x':
-                trace_flag = 1;
-                break;
-            case 'b':
-                speed = atoi(optarg);
-                if (speed == 1200 || speed == 2400 || speed == 4800 || speed == 9600) {
-                    baud_rate = speed;
-                } else {
-                    fprintf (stderr, "%s: Baud Rate must be one of 1200, 2400, 4800, 9600\n", programName);
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case 'P':
-                c_parity = strdup(optarg);
-                if (strcmp(c_parity,EVEN_parity) == 0) {
-                    parity = E_PARITY;
-                } else if (strcmp(c_parity,NONE_parity) == 0) {
-                    parity = N_PARITY;
-                } else if (strcmp(c_parity,ODD_parity) == 0) {
-                    parity = O_PARITY;
-                } else {
-                    fprintf (stderr, "%s: Parity must be one of E, N, O\n", programName);
-                    exit(EXIT_FAILURE);
-                }
-                free(c_parity);
-                break;
-            case 'S':
-                bits = atoi(optarg);
-                if (bits == 1 || bits == 2) {
-                    stop_bits = bits;
-                } else {
-                    fprintf (stderr, "%s: Stop bits can be one of 1, 2\n", programName);
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case 'r':
-                speed = atoi(optarg);
-                switch (speed) {
-                    case 1200:
-                        new_baud_rate = BR1200;
-                        break;
-                    case 2400:
-                        new_baud_rate = BR2400;
-                        break;
-                    case 4800:
-                        new_baud_rate = BR4800;
-                        break;
-                    case 9600:
-                        new_baud_rate = BR9600;
-                        break;
-                    default:
-                        fprintf (stderr, "%s: Baud Rate must be one of 1200, 2400, 4800, 9600\n", programName);
-                        exit(EXIT_FAILURE);
-                }
-                break;
-            case 'N':
-                new_parity_stop = atoi(optarg);
-                if (!(0 <= new_parity_stop && new_parity_stop <= 3)) {
-                    fprintf (stderr, "%s: New parity/stop (%d) out of range, 0-3.\n", programName, new_parity_stop);
+    if (broker_query(broker_socket, &req, &reply, (yLockWait + BROKER_WAIT) * 1000) == -1) {
+        broker_absent = (errno == ENOENT || errno == ECONNREFUSED);
+        log_message(debug_flag | (broker_absent ? 0 : DEBUG_SYSLOG), "Broker %s: (%d) %s", broker_socket, errno, strerror(errno));
+        return -1;
+    }
+    log_message(debug_flag, "Meter %d read by the broker, %d request(s) merged, status %d", address, reply.merged, reply.status);
+    if (reply.status != 0) return -1;
+
+    RTU_HoldingCount = 0;
+    for (i=0; i < RTU_MAXREG/2; i++) {
+        // Whatever is missing would be read from the bus
+        if (requests[i] && !reply.available[i]) return -1;
+        RTU_ReadRegistersAvailable[i] = reply.available[i];
+    }
+    memcpy(RTU_ReadRegistersBuffer, reply.regs, sizeof(RTU_ReadRegistersBuffer));
+    if (req.holding) setHoldingRegister(req.holding, reply.holding_value);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    cacheRead
+    --max-age: fill the register caches from the blocks of a recent run.
+    All windows of plan and when the oldest was read, or -1.
+----------------------------------------------------------------------------*/
+int cacheRead(int address, const struct read_plan *plan, int64_t *time_us)
+{
+    uint16_t tab_reg[PLAN_MAXREGS];
+    int64_t read_us;
+    int w, i;
+
+    if (cache_file == NULL) return -1;
+    *time_us = INT64_MAX;
+    memset(RTU_ReadRegistersAvailable, 0, sizeof(RTU_ReadRegistersAvailable));
+    RTU_HoldingCount = 0;
+
+    for (w=0; w < plan->nwindows; w++) {
+        const struct plan_window *win = &plan->window[w];
+
+        if (rcache_lookup(address, win->function, win->start, win->count, max_age * 1000LL, tab_reg, &read_us) == -1) return -1;
+        if (read_us < *time_us) *time_us = read_us;
+        if (win->function == PLAN_FC_INPUT) {
+            memcpy(&RTU_ReadRegistersBuffer[win->start], tab_reg, win->count * sizeof(uint16_t));
+            for (i=0; i < win->count/2; i++) RTU_ReadRegistersAvailable[win->start/2+i] = 1;
+        } else {
+            for (i=0; i < win->count; i++) setHoldingRegister(win->start+i, tab_reg[i]);
+        }
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    cacheStore
+    --max-age: keep the windows of plan just read, for the next runs.
+----------------------------------------------------------------------------*/
+void cacheStore(int address, const struct read_plan *plan)
+{
+    uint16_t tab_reg[PLAN_MAXREGS];
+    int w, i;
+
+    if (cache_file == NULL) return;
+    for (w=0; w < plan->nwindows; w++) {
+        const struct plan_window *win = &plan->window[w];
+
+        if (win->function == PLAN_FC_INPUT) {
+            // The broker may have read a different set of windows
+            for (i=0; i < win->count/2 && RTU_ReadRegistersAvailable[win->start/2+i]; i++);
+            if (i < win->count/2) continue;
+            rcache_store(address, win->function, win->start, win->count, &RTU_ReadRegistersBuffer[win->start]);
+        } else if (getHoldingRegisters(win->start, win->count, tab_reg) == win->count) {
+            rcache_store(address, win->function, win->start, win->count, tab_reg);
+        }
+    }
+}
+
+/*--------------------------------------------------------------------------
+    saveCache
+----------------------------------------------------------------------------*/
+void saveCache()
+{
+    if (cache_file == NULL) return;
+    if (rcache_save(cache_file) == -1)
+        log_message(debug_flag | DEBUG_SYSLOG, "Can't save cache %s: (%d) %s", cache_file, errno, strerror(errno));
+    free(cache_file);
+    cache_file = NULL;
+}
+
+/*--------------------------------------------------------------------------
+    storeSample
+    --store: append the values in fields, as read, to the file of the
+    meter and day. A file that fails is logged once and retried the next
+    day.
+----------------------------------------------------------------------------*/
+void storeSample(int address, int64_t time_us, const float raw[], uint32_t fields)
+{
+    time_t t = time_us / 1000000;
+    struct tm tm;
+    int32_t day;
+    char *path;
+    int i;
+
+    if (store_dir == NULL || address <= 0 || address >= SNAP_METERS) return;
+    localtime_r(&t, &tm);
+    day = (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+
+    if (store_files[address] != NULL && store_day[address] != day) {
+        ts_close(store_files[address]);
+        store_files[address] = NULL;
+    }
+    if (store_files[address] == NULL) {
+        if (store_day[address] == -day) return;
+        path = getMemPtr(strlen(store_dir) + strlen(sample_bus) + 32);
+        sprintf(path, "%s/%s.%d.%d.sdts", store_dir, sample_bus, address, day);
+        store_files[address] = ts_open(path, sample_bus, address, day);
+        if (store_files[address] == NULL) {
+            log_message(debug_flag | DEBUG_SYSLOG, "Can't open store %s: (%d) %s", path, errno, strerror(errno));
+            store_day[address] = -day;
+            free(path);
+            return;
+        }
+        free(path);
+        store_day[address] = day;
+    }
+
+    for (i=0; i < SNAP_VALUES; i++) {
+        if (!(fields & (1U << i))) continue;
+        if (ts_append(store_files[address], i, time_us / 1000, raw[i]) == -1) {
+            log_message(debug_flag | DEBUG_SYSLOG, "Can't store meter %d readings: (%d) %s", address, errno, strerror(errno));
+            ts_close(store_files[address]);
+            store_files[address] = NULL;
+            store_day[address] = -day;
+            return;
+        }
+    }
+}
+
+/*--------------------------------------------------------------------------
+    closeStore
+----------------------------------------------------------------------------*/
+void closeStore()
+{
+    int i;
+
+    for (i=0; i < SNAP_METERS; i++) {
+        ts_close(store_files[i]);
+        store_files[i] = NULL;
+    }
+}
+
+/*--------------------------------------------------------------------------
+    rollupSample
+    --rollup: account the values in every window of the meter, output
+    the windows the sample closes.
+----------------------------------------------------------------------------*/
+void rollupSample(int address, int64_t time_us, const float value[], uint32_t fields)
+{
+    struct rollup closed;
+    int w;
+
+    if (address <= 0 || address >= SNAP_METERS) return;
+    if (rollups[address] == NULL) {
+        rollups[address] = getMemPtr(nrollups * sizeof(struct rollup));
+        for (w=0; w < nrollups; w++) rollup_init(&rollups[address][w], rollup_windows[w]);
+    }
+    for (w=0; w < nrollups; w++)
+        if (rollup_add(&rollups[address][w], time_us, value, fields, &closed))
+            out_rollup(sample_buf, output_style, sample_bus, address, &closed, output_columns);
+}
+
+/*--------------------------------------------------------------------------
+    freeRollups
+    Windows still open are dropped, they are partial.
+----------------------------------------------------------------------------*/
+void freeRollups()
+{
+    int i;
+
+    for (i=0; i < SNAP_METERS; i++) {
+        free(rollups[i]);
+        rollups[i] = NULL;
+    }
+}
+
+/*--------------------------------------------------------------------------
+    getIntegFile
+    --integrate counters, next to the serial port lock file.
+----------------------------------------------------------------------------*/
+char *getIntegFile()
+{
+    static __thread char *integFile = NULL;
+
+    if (integFile == NULL && devLCKfile != NULL) {
+        integFile = getMemPtr(strlen(devLCKfile)+7);
+        sprintf(integFile, "%s.integ", devLCKfile);
+    }
+    return integFile;
+}
+
+/*--------------------------------------------------------------------------
+    integrateSample
+    --integrate: fine import and export energy of the meter in fine_mwh[]
+    and, float32 rounded, in value[], the fields then published.
+----------------------------------------------------------------------------*/
+uint32_t integrateSample(int address, int64_t mono_us, float value[], uint32_t fields, int64_t fine_mwh[2])
+{
+    if (!integrate_flag) return fields;
+    if (integs == NULL) {
+        integs = getMemPtr(sizeof(*integs));
+        if (getIntegFile() == NULL || integ_load(integs, getIntegFile()) == -1)
+            memset(integs, 0, sizeof(*integs));
+        else
+            log_message(debug_flag, "Energy counters loaded from %s", getIntegFile());
+    }
+    return integ_sample(integs, address, mono_us, value, fields, fine_mwh);
+}
+
+/*--------------------------------------------------------------------------
+    saveIntegs
+    After every poll, a restart goes on from the counters published.
+----------------------------------------------------------------------------*/
+void saveIntegs()
+{
+    if (integs != NULL && getIntegFile() != NULL && integ_save(integs, getIntegFile()) != 0)
+        log_message(debug_flag | DEBUG_SYSLOG, "Can't save energy counters to %s (%d) %s", getIntegFile(), errno, strerror(errno));
+}
+
+/*--------------------------------------------------------------------------
+    freeIntegs
+----------------------------------------------------------------------------*/
+void freeIntegs()
+{
+    saveIntegs();
+    free(integs);
+    integs = NULL;
+}
+
+/*--------------------------------------------------------------------------
+    deadbandSample
+    --deadband, --heartbeat: the values of the meter to print.
+----------------------------------------------------------------------------*/
+uint32_t deadbandSample(int address, int64_t time_us, const float value[], uint32_t fields)
+{
+    if (!deadband_flag || address <= 0 || address >= SNAP_METERS) return fields;
+    if (reported[address] == NULL) {
+        reported[address] = getMemPtr(sizeof(struct deadband_meter));
+        memset(reported[address], 0, sizeof(struct deadband_meter));
+    }
+    return deadband_filter(&deadband, reported[address], time_us, value, fields);
+}
+
+/*--------------------------------------------------------------------------
+    freeReported
+----------------------------------------------------------------------------*/
+void freeReported()
+{
+    int i;
+
+    for (i=0; i < SNAP_METERS; i++) {
+        free(reported[i]);
+        reported[i] = NULL;
+    }
+}
+
+/*--------------------------------------------------------------------------
+    requestFields
+    SNAP_x bits of the values read for requests[] slots and time_disp.
+----------------------------------------------------------------------------*/
+uint32_t requestFields(const unsigned char requests[], int time_disp)
+{
+    uint32_t fields = 0;
+    int i;
+
+    for (i=0; i < SNAP_TIMEDISP; i++)
+        if (requests[snap_regs[i].reg/2]) fields |= 1U << i;
+    if (time_disp) fields |= 1U << SNAP_TIMEDISP;
+    return fields;
+}
+
+/*--------------------------------------------------------------------------
+    pollDevice
+    Read the requested values (requests[] slots, time_disp) from one meter
+    following plan, or through the broker if ctx is NULL, then append them
+    to sample_buf in output_style (the windows closed with --rollup), to
+    the --shm snapshot and to the --store file. Energy counters go through
+    --energy-guard, then --integrate. --deadband leaves out of the output
+    the values that did not move.
+    With --max-age a meter fresh in the cache is not read at all.
+    Returns 0 on success, -1 on bus error (nothing appended).
+----------------------------------------------------------------------------*/
+int pollDevice(modbus_t *ctx, int address, const struct read_plan *plan, const unsigned char requests[], int time_disp)
+{
+    float value[SNAP_VALUES];
+    float raw[SNAP_VALUES];
+    double exact[SNAP_VALUES];
+    int64_t fine_mwh[2] = { 0, 0 };
+    uint32_t fields = requestFields(requests, time_disp);
+    struct timespec ts;
+    int64_t time_us, mono_us, cached_us;
+    uint32_t corrected = 0, shown;
+    int i, time_disp_value = 0;
+
+    if (cacheRead(address, plan, &cached_us) == 0) {
+        log_message(debug_flag, "Meter %d read less than %ldms ago, from %s", address, max_age, cache_file);
+    } else {
+        if (ctx == NULL) {
+            if (broker_socket == NULL || brokerRead(address, requests, time_disp) == -1) return -1;
+        } else if (readMeter(ctx, address, plan) == -1) {
+            return -1;
+        }
+        cached_us = 0;
+        cacheStore(address, plan);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    mono_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    if (cached_us) {
+        // Read by an earlier run, monotonic time as long ago
+        mono_us -= time_us - cached_us;
+        time_us = cached_us;
+    }
+
+    for (i=0; i < SNAP_TIMEDISP; i++) {
+        if (!(fields & (1U << i))) continue;
+        if (getMeasureFloat(ctx, snap_regs[i].reg, num_retries, 2, &raw[i]) == -1) return -1;
+    }
+    if (guard != NULL && (corrected = eguard_apply(guard, address, time_us, raw, fields)) != 0) {
+        log_message(debug_flag | DEBUG_SYSLOG, "Meter %d energy counter went back, offset raised", address);
+        saveGuard();
+    }
+    for (i=0; i < SNAP_TIMEDISP; i++)
+        if (fields & (1U << i)) value[i] = raw[i] * snap_regs[i].scale;
+    if (time_disp == 1) {
+        if (getConfigBCD(ctx, model == MODEL_120 ? TIME_DISP : TIME_DISP_220,
+                         num_retries, 1, &time_disp_value) == -1) return -1;
+        value[SNAP_TIMEDISP] = raw[SNAP_TIMEDISP] = time_disp_value;
+    }
+
+    fields = integrateSample(address, mono_us, value, fields, fine_mwh);
+    for (i=0; i < SNAP_VALUES; i++) exact[i] = value[i];
+    for (i=SNAP_IAENERGY; i <= SNAP_EAENERGY; i++) {
+        if (!integrate_flag || !(fields & (1U << i))) continue;
+        raw[i] = value[i] / snap_regs[i].scale;
+        exact[i] = fine_mwh[i - SNAP_IAENERGY] / 1000.0;
+    }
+    if (snap != NULL && !cached_us)
+        snap_publish(snap, address, value, fields & ((1U << SNAP_VALUES) - 1), integrate_flag ? fine_mwh : NULL);
+
+    if (corrected) fields |= OUT_CORRECTED;
+    shown = deadbandSample(address, time_us, value, fields);
+    if (nrollups > 0)
+        rollupSample(address, time_us, value, fields);
+    else if (!(shown & ((1U << SNAP_VALUES) - 1)))
+        log_message(debug_flag, "Meter %d: no value moved past its deadband", address);
+    else if (output_style == OUT_BINARY)
+        out_record(sample_buf, sample_busidx, address, mono_us, time_us, raw, shown);
+    else
+        out_sample(sample_buf, output_style, sample_bus, address, time_us, exact, shown, output_columns);
+    storeSample(address, time_us, raw, fields);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    busConnect
+    RTU context on a serial device, with bus_timing line settings.
+    Returns NULL (logged) on failure.
+----------------------------------------------------------------------------*/
+modbus_t *busConnect(const char *device)
+{
+    modbus_t *ctx;
+
+    ctx = modbus_new_rtu(device, bus_timing.baud, bus_timing.parity, 8, bus_timing.stop_bits);
+    if (ctx == NULL) {
+        log_message(debug_flag | DEBUG_SYSLOG, "Unable to create the libmodbus context\n");
+        return NULL;
+    } else {
+        log_message(debug_flag, "Libmodbus context open (%d%c%d)",
+                bus_timing.baud, bus_timing.parity, bus_timing.stop_bits);
+    }
+
+#if LIBMODBUS_VERSION_MAJOR >= 3 && LIBMODBUS_VERSION_MINOR >= 1 && LIBMODBUS_VERSION_MICRO >= 2
+
+    // Considering to get those values from command line
+    if (byte_timeout_us == -1) {
+        modbus_set_byte_timeout(ctx, -1, 0);
+        log_message(debug_flag, "Byte timeout disabled.");
+    } else {
+        modbus_set_byte_timeout(ctx, 0, byte_timeout_us);
+        log_message(debug_flag, "New byte timeout: %ds, %ldus", 0, byte_timeout_us);
+    }
+
+#else
+
+    struct timeval timeout;
+
+    if (byte_timeout_us == -1) {
+        timeout.tv_sec = -1;
+        timeout.tv_usec = 0;
+        modbus_set_byte_timeout(ctx, &timeout);
+        log_message(debug_flag, "Byte timeout disabled.");
+    } else {
+        timeout.tv_sec = 0;
+        timeout.tv_usec = byte_timeout_us;
+        modbus_set_byte_timeout(ctx, &timeout);
+        log_message(debug_flag, "New byte timeout: %ds, %dus", timeout.tv_sec, timeout.tv_usec);
+    }
+
+#endif
+
+    //modbus_set_error_recovery(ctx, MODBUS_ERROR_RECOVERY_LINK | MODBUS_ERROR_RECOVERY_PROTOCOL);
+    //modbus_set_error_recovery(ctx, MODBUS_ERROR_RECOVERY_PROTOCOL);
+    modbus_set_error_recovery(ctx, MODBUS_ERROR_RECOVERY_NONE);
+    
+    if (trace_flag == 1) {
+        modbus_set_debug(ctx, 1);
+    }
+
+    if (native_flag) {
+        if (rtu_open(&rtu_port, device, bus_timing.baud, bus_timing.parity, bus_timing.stop_bits) == -1) {
+            log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Connection failed: (%d) %s\n", errno, strerror(errno));
+            modbus_free(ctx);
+            return NULL;
+        }
+        log_message(debug_flag, "Native RTU engine on %s", device);
+    } else if (modbus_connect(ctx) == -1) {
+        log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Connection failed: (%d) %s\n", errno, modbus_strerror(errno));
+        modbus_free(ctx);
+        return NULL;
+    }
+
+    setResponseTimeout(ctx, response_timeout);
+    log_message(debug_flag, "New response timeout: %ldus", response_timeout);
+    last_frame_us = sched_now_us();
+
+    return ctx;
+}
+
+/*--------------------------------------------------------------------------
+    busStatus
+    --bus-status: holder and per class use of one serial device.
+----------------------------------------------------------------------------*/
+int busStatus(const char *device)
+{
+    struct rs485_occupancy occ;
+    struct timeval tv;
+    double since;
+    int i;
+
+    if (rs485_occupancy(device, &occ) == -1) {
+        printf("%s: no bus occupancy record (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    gettimeofday(&tv, NULL);
+    since = (tv.tv_sec * 1000000LL + tv.tv_usec - occ.since_us) / 1e6;
+
+    if (occ.holder == 0)
+        printf("%s: free for %.3fs, %llu handoffs\n", device, since, (unsigned long long)occ.handoffs);
+    else
+        printf("%s: held by %u (%s, %s%s) for %.3fs, %llu handoffs\n", device, occ.holder,
+               occ.holder_command, rs485_class_name(occ.holder_class),
+               kill(occ.holder, 0) == -1 && errno == ESRCH ? ", gone" : "",
+               since, (unsigned long long)occ.handoffs);
+    for (i=0; i < RS485_CLASSES; i++) {
+        if (occ.acquired[i] == 0) continue;
+        printf("\t%-7s %10llu locks  bus %12.3fs  mean wait %9.3fms\n", rs485_class_name(i),
+               (unsigned long long)occ.acquired[i], occ.busy_us[i] / 1e6,
+               occ.wait_us[i] / 1e3 / occ.acquired[i]);
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    busRelock
+    Daemon mode: take the bus back after rs485_yield. Whatever the other
+    clients left in the input buffer is dropped.
+----------------------------------------------------------------------------*/
+void busRelock(modbus_t *ctx)
+{
+    while (!daemon_stop && rs485_lock(serBus, yLockWait > 0 ? yLockWait : BUS_RELOCK_WAIT) == -1) {
+        if (errno == ETIMEDOUT) {
+            log_message(debug_flag | DEBUG_SYSLOG, "Bus %s still locked by %lu, waiting", devLCKfile, rs485_owner(serBus));
+        } else {
+            log_message(debug_flag | DEBUG_SYSLOG, "Problem locking serial device, lock file: %s. (%d) %s", devLCKfile, errno, strerror(errno));
+            sleep(1);
+        }
+    }
+    if (native_flag)
+        tcflush(rtu_port.fd, TCIFLUSH);
+    else
+        modbus_flush(ctx);
+    last_frame_us = sched_now_us();
+}
+
+/*--------------------------------------------------------------------------
+    daemon_signal
+----------------------------------------------------------------------------*/
+void daemon_signal(int sig)
+{
+    daemon_stop = 1;
+}
+
+/*--------------------------------------------------------------------------
+    pollLoop
+    Daemon mode: keep the RTU context open and the serial port locked,
+    poll the meters as poll_sched rate classes say until SIGTERM/SIGINT.
+    A meter failing does not stop the loop, it is reported NOK.
+    The bus is handed to waiting clients between polls (rs485_yield) and
+    taken back before the next one.
+    Each poll output is built in memory and written to stdout at once, so
+    records of several buses never mix.
+----------------------------------------------------------------------------*/
+void pollLoop(modbus_t *ctx)
+{
+    struct timespec ts;
+    struct read_plan plan;
+    unsigned char slots[RTU_MAXREG/2];
+    int picked[SCHED_MAXJOBS];
+    int time_disp;
+    int address, yielded;
+    long long now, next, saved;
+    unsigned long polls = 0;
+    struct out_buf record;
+
+    memset(&record, 0, sizeof(record));
+    sample_buf = &record;
+
+    log_message(debug_flag | DEBUG_SYSLOG, "Polling %d job(s), bus utilization %.1f%%",
+                poll_sched.njobs, poll_sched.utilization * 100);
+
+    saved = sched_now_us();
+    sched_start(&poll_sched, saved);
+    while (!daemon_stop) {
+
+        now = sched_now_us();
+        address = sched_pick(&poll_sched, now, picked, slots, &time_disp);
+
+        if (address == 0) {
+            // Nothing released, sleep until next release
+            next = sched_next_release(&poll_sched);
+            yielded = serBus != NULL && rs485_yield(serBus, next - now) == 1;
+            ts.tv_sec  = next / 1000000;
+            ts.tv_nsec = (next % 1000000) * 1000;
+            while (!daemon_stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+            if (yielded) busRelock(ctx);
+            continue;
+        }
+
+        plan_clear(&plan);
+        plan_build(&plan, &bus_timing, PLAN_FC_INPUT, slots, RTU_MAXREG/2);
+        if (time_disp) plan_add(&plan, &bus_timing, PLAN_FC_HOLDING, model == MODEL_120 ? TIME_DISP : TIME_DISP_220, 1);
+
+        if (pollDevice(ctx, address, &plan, slots, time_disp) == -1) {
+            log_message(debug_flag | DEBUG_SYSLOG, "Meter %d: NOK", address);
+            out_status(&record, output_style, 0);
+        } else if (record.len > 0) {
+            // Nothing past the --deadband: no output at all
+            out_status(&record, output_style, 1);
+        }
+        writeOutput(&record);
+        saveIntegs();
+        polls++;
+
+        now = sched_now_us();
+        sched_done(&poll_sched, picked, now);
+        log_message(debug_flag, "Poll %lu, Total Modbus Time: %ldus", polls, TotalModbusTime);
+
+        // Better class waiting or over budget: let it in right now
+        if (serBus != NULL && rs485_yield(serBus, 0) == 1) busRelock(ctx);
+
+        if (now - saved >= MSTAT_SAVEPERIOD * 1000000LL) {
+            saveMeterStat();
+            saveGuard();
+            saved = now;
+        }
+    }
+
+    log_message(debug_flag | DEBUG_SYSLOG, "Polling stopped after %lu poll(s)", polls);
+    closeStore();
+    freeRollups();
+    freeIntegs();
+    freeReported();
+    sample_buf = NULL;
+    out_free(&record);
+}
+
+/*--------------------------------------------------------------------------
+    brokerReadBus
+    Broker side of a request, already merged with the others for the meter.
+----------------------------------------------------------------------------*/
+int brokerReadBus(const struct broker_request *req, struct broker_reply *reply)
+{
+    struct read_plan plan;
+    uint16_t value;
+
+    if (!rs485_locked(serBus)) busRelock(broker_ctx);
+
+    plan_clear(&plan);
+    plan_build(&plan, &bus_timing, PLAN_FC_INPUT, req->slots, RTU_MAXREG/2);
+    if (req->holding) plan_add(&plan, &bus_timing, PLAN_FC_HOLDING, req->holding, 1);
+
+    if (readMeter(broker_ctx, req->address, &plan) == -1) {
+        log_message(debug_flag | DEBUG_SYSLOG, "Meter %d: NOK", req->address);
+        return -1;
+    }
+    publishSnapshot(req->address, req->slots, req->holding);
+    memcpy(reply->available, RTU_ReadRegistersAvailable, sizeof(reply->available));
+    memcpy(reply->regs, RTU_ReadRegistersBuffer, sizeof(reply->regs));
+    if (req->holding && getHoldingRegisters(req->holding, 1, &value) == 1) reply->holding_value = value;
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    brokerIdle
+    No request for a while, let other clients of the bus in.
+----------------------------------------------------------------------------*/
+void brokerIdle(void)
+{
+    rs485_yield(serBus, BROKER_LINGER_MS * 1000L);
+}
+
+/*--------------------------------------------------------------------------
+    brokerLoop
+    --broker: serve reads on LCK..<tty>.sock until SIGTERM/SIGINT. The bus
+    is released while no client asks for it. -1 if it can't listen.
+----------------------------------------------------------------------------*/
+int brokerLoop(modbus_t *ctx)
+{
+    struct broker_stats stats;
+    int lfd;
+
+    if ((lfd = broker_listen(broker_socket)) == -1) {
+        log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Can't listen on %s: (%d) %s", broker_socket, errno, strerror(errno));
+        return -1;
+    }
+    log_message(debug_flag | DEBUG_SYSLOG, "Broker listening on %s", broker_socket);
+
+    memset(&stats, 0, sizeof(stats));
+    broker_ctx = ctx;
+    if (broker_serve(lfd, brokerReadBus, brokerIdle, &daemon_stop, &stats) == -1)
+        log_message(debug_flag | DEBUG_SYSLOG, "Broker: (%d) %s", errno, strerror(errno));
+    close(lfd);
+    unlink(broker_socket);
+
+    log_message(debug_flag | DEBUG_SYSLOG, "Broker stopped: %lu request(s) in %lu transaction(s), %lu failed",
+                stats.requests, stats.transactions, stats.failed);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    daemonSignals
+----------------------------------------------------------------------------*/
+void daemonSignals()
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+}
+
+/*--------------------------------------------------------------------------
+    clearBusLocks
+    atexit: a bus thread exiting the process leaves the others' locks.
+----------------------------------------------------------------------------*/
+void clearBusLocks(void)
+{
+    int i;
+
+    pthread_mutex_lock(&buses_mutex);
+    for (i=0; i < nbuses; i++) {
+        if (buses[i].lock == NULL) continue;
+        rs485_close(buses[i].lock);
+        buses[i].lock = NULL;
+    }
+    pthread_mutex_unlock(&buses_mutex);
+}
+
+/*--------------------------------------------------------------------------
+    busName
+    Device name without its directory, the bus tag of the samples.
+----------------------------------------------------------------------------*/
+const char *busName(const char *device)
+{
+    const char *tty = strrchr(device, '/');
+
+    return tty != NULL ? tty + 1 : device;
+}
+
+/*--------------------------------------------------------------------------
+    busThread
+    One bus of a multi bus daemon: lock its port, poll until stopped.
+----------------------------------------------------------------------------*/
+void *busThread(void *arg)
+{
+    struct bus *bus = arg;
+    modbus_t *ctx;
+
+    sample_bus = busName(bus->device);
+    sample_busidx = bus - buses;
+    LockSer(bus->device, PID, debug_flag);
+    pthread_mutex_lock(&buses_mutex);
+    bus->lock = serBus;
+    pthread_mutex_unlock(&buses_mutex);
+    openSnapshot(bus->device);
+    openGuard(bus->device);
+
+    mstat_init(&bus_timing);
+    if (getStatFile() != NULL && mstat_load(getStatFile()) == 0)
+        log_message(debug_flag, "Meter latency loaded from %s", getStatFile());
+
+    // Already checked by main
+    buildSchedule(bus->address, bus->naddress);
+    sched_admit(&poll_sched, &bus_timing);
+
+    if ((ctx = busConnect(bus->device)) != NULL) {
+        log_message(debug_flag | DEBUG_SYSLOG, "Bus %s: %d meter(s)", bus->device, bus->naddress);
+        pollLoop(ctx);
+        busClose(ctx);
+        modbus_free(ctx);
+    }
+    saveMeterStat();
+    closeSnapshot();
+    closeGuard();
+
+    pthread_mutex_lock(&buses_mutex);
+    if (bus->lock != NULL) ClrSerLock(PID);
+    bus->lock = NULL;
+    free(devLCKfile);
+    // Last bus gone, wake up main
+    if (--buses_running == 0) kill(getpid(), SIGTERM);
+    pthread_mutex_unlock(&buses_mutex);
+
+    return NULL;
+}
+
+/*--------------------------------------------------------------------------
+    pollBuses
+    Multi bus daemon: one thread per bus, main waits for SIGTERM/SIGINT
+    and wakes the threads up with SIGUSR1 to stop them.
+----------------------------------------------------------------------------*/
+int pollBuses()
+{
+    struct sigaction sa;
+    sigset_t set;
+    int i, sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);      // Inherited by bus threads
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGUSR1, &sa, NULL);
+    atexit(clearBusLocks);
+
+    buses_running = nbuses;
+    for (i=0; i < nbuses; i++) {
+        if (pthread_create(&buses[i].thread, NULL, busThread, &buses[i]) != 0) {
+            log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Can't start bus %s thread", buses[i].device);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sigwait(&set, &sig);
+    log_message(debug_flag, "Signal %d, stopping %d bus(es)", sig, nbuses);
+    daemon_stop = 1;
+    for (i=0; i < nbuses; i++) pthread_kill(buses[i].thread, SIGUSR1);
+    for (i=0; i < nbuses; i++) pthread_join(buses[i].thread, NULL);
+
+    return 0;
+}
+
+/* --metrics families of the snapshot values, SNAP_x order, NULL = not exported */
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} metric_values[SNAP_VALUES] = {
+    {"sdm120c_voltage_volts",                 "gauge",   "Voltage"},
+    {"sdm120c_current_amperes",               "gauge",   "Current"},
+    {"sdm120c_power_watts",                   "gauge",   "Active power"},
+    {"sdm120c_apparent_power_voltamperes",    "gauge",   "Apparent power"},
+    {"sdm120c_reactive_power_var",            "gauge",   "Reactive power"},
+    {"sdm120c_power_factor",                  "gauge",   "Power factor"},
+    {"sdm120c_phase_angle_degrees",           "gauge",   "Phase angle"},
+    {"sdm120c_frequency_hertz",               "gauge",   "Frequency"},
+    {"sdm120c_import_energy_watthours",       "counter", "Import active energy"},
+    {"sdm120c_export_energy_watthours",       "counter", "Export active energy"},
+    {"sdm120c_total_energy_watthours",        "gauge",   "Total active energy, as the meter measurement mode"},
+    {"sdm120c_import_reactive_energy_varhours", "counter", "Import reactive energy"},
+    {"sdm120c_export_reactive_energy_varhours", "counter", "Export reactive energy"},
+    {"sdm120c_total_reactive_energy_varhours", "gauge",  "Total reactive energy"},
+    {NULL, NULL, NULL}
+};
+
+/*--------------------------------------------------------------------------
+    metricFamily
+----------------------------------------------------------------------------*/
+static void metricFamily(struct out_buf *page, const char *name, const char *type, const char *help)
+{
+    out_printf(page, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+/*--------------------------------------------------------------------------
+    renderMetrics
+    --metrics page: the latest values of every meter polled, and bus and
+    lock statistics of every bus, all from memory and the .occ record.
+    Runs in the metrics thread.
+----------------------------------------------------------------------------*/
+void renderMetrics(struct out_buf *page)
+{
+    static struct snap_record recs[MAX_BUSES][SNAP_METERS];
+    static int addrs[MAX_BUSES][SNAP_METERS];
+    static int nrecs[MAX_BUSES];
+    struct rs485_occupancy occ[MAX_BUSES];
+    int have_occ[MAX_BUSES];
+    const char *name;
+    int b, i, k, c;
+
+    // Consistent copies of the records, the bus threads go on meanwhile
+    pthread_mutex_lock(&buses_mutex);
+    for (b=0; b < nbuses; b++) {
+        nrecs[b] = 0;
+        for (i=1; buses[b].snap != NULL && i < SNAP_METERS; i++)
+            if (snap_read(buses[b].snap, i, &recs[b][nrecs[b]]) == 0) addrs[b][nrecs[b]++] = i;
+    }
+    pthread_mutex_unlock(&buses_mutex);
+    for (b=0; b < nbuses; b++) have_occ[b] = rs485_occupancy(buses[b].device, &occ[b]) == 0;
+
+    for (k=0; k < SNAP_VALUES; k++) {
+        if (metric_values[k].name == NULL) continue;
+        metricFamily(page, metric_values[k].name, metric_values[k].type, metric_values[k].help);
+        for (b=0; b < nbuses; b++) {
+            name = busName(buses[b].device);
+            for (i=0; i < nrecs[b]; i++) {
+                if (!(recs[b][i].fields & (1U << k))) continue;
+                out_printf(page, recs[b][i].fine & (1U << k) ? "%s%s{bus=\"%s\",meter=\"%u\"} %.3f\n" : "%s%s{bus=\"%s\",meter=\"%u\"} %.7g\n",
+                           metric_values[k].name, metric_values[k].type[0] == 'c' ? "_total" : "", name, addrs[b][i],
+                           snap_value(&recs[b][i], k));
+            }
+        }
+    }
+
+    metricFamily(page, "sdm120c_meter_polls", "counter", "Polls answered by the meter");
+    for (b=0; b < nbuses; b++)
+        for (i=0; i < nrecs[b]; i++)
+            out_printf(page, "sdm120c_meter_polls_total{bus=\"%s\",meter=\"%u\"} %u\n",
+                       busName(buses[b].device), addrs[b][i], recs[b][i].polls);
+    metricFamily(page, "sdm120c_meter_poll_failures", "counter", "Polls the meter did not answer");
+    for (b=0; b < nbuses; b++)
+        for (i=0; i < nrecs[b]; i++)
+            out_printf(page, "sdm120c_meter_poll_failures_total{bus=\"%s\",meter=\"%u\"} %u\n",
+                       busName(buses[b].device), addrs[b][i], recs[b][i].fails);
+    metricFamily(page, "sdm120c_meter_last_read_timestamp_seconds", "gauge", "Time of the last answered poll");
+    for (b=0; b < nbuses; b++)
+        for (i=0; i < nrecs[b]; i++)
+            if (recs[b][i].polls)
+                out_printf(page, "sdm120c_meter_last_read_timestamp_seconds{bus=\"%s\",meter=\"%u\"} %.6f\n",
+                           busName(buses[b].device), addrs[b][i], recs[b][i].time_us / 1e6);
+
+    metricFamily(page, "sdm120c_bus_transactions", "counter", "Modbus transactions of this process");
+    for (b=0; b < nbuses; b++)
+        out_printf(page, "sdm120c_bus_transactions_total{bus=\"%s\"} %llu\n", busName(buses[b].device),
+                   (unsigned long long)__atomic_load_n(&buses[b].transactions, __ATOMIC_RELAXED));
+    metricFamily(page, "sdm120c_bus_transaction_failures", "counter", "Modbus transactions without a valid answer");
+    for (b=0; b < nbuses; b++)
+        out_printf(page, "sdm120c_bus_transaction_failures_total{bus=\"%s\"} %llu\n", busName(buses[b].device),
+                   (unsigned long long)__atomic_load_n(&buses[b].failures, __ATOMIC_RELAXED));
+    metricFamily(page, "sdm120c_bus_transaction_seconds", "counter", "Time spent in Modbus transactions");
+    for (b=0; b < nbuses; b++)
+        out_printf(page, "sdm120c_bus_transaction_seconds_total{bus=\"%s\"} %.6f\n", busName(buses[b].device),
+                   __atomic_load_n(&buses[b].busy_us, __ATOMIC_RELAXED) / 1e6);
+
+    // Every client of the bus, from the occupancy record
+    metricFamily(page, "sdm120c_lock_acquired", "counter", "Bus lock acquisitions by priority class");
+    for (b=0; b < nbuses; b++)
+        for (c=0; have_occ[b] && c < RS485_CLASSES; c++)
+            out_printf(page, "sdm120c_lock_acquired_total{bus=\"%s\",class=\"%s\"} %llu\n", busName(buses[b].device),
+                       rs485_class_name(c), (unsigned long long)occ[b].acquired[c]);
+    metricFamily(page, "sdm120c_lock_held_seconds", "counter", "Bus lock hold time by priority class");
+    for (b=0; b < nbuses; b++)
+        for (c=0; have_occ[b] && c < RS485_CLASSES; c++)
+            out_printf(page, "sdm120c_lock_held_seconds_total{bus=\"%s\",class=\"%s\"} %.6f\n", busName(buses[b].device),
+                       rs485_class_name(c), occ[b].busy_us[c] / 1e6);
+    metricFamily(page, "sdm120c_lock_wait_seconds", "counter", "Bus lock queueing time by priority class");
+    for (b=0; b < nbuses; b++)
+        for (c=0; have_occ[b] && c < RS485_CLASSES; c++)
+            out_printf(page, "sdm120c_lock_wait_seconds_total{bus=\"%s\",class=\"%s\"} %.6f\n", busName(buses[b].device),
+                       rs485_class_name(c), occ[b].wait_us[c] / 1e6);
+    metricFamily(page, "sdm120c_lock_handoffs", "counter", "Bus lock changes of holder");
+    for (b=0; b < nbuses; b++)
+        if (have_occ[b])
+            out_printf(page, "sdm120c_lock_handoffs_total{bus=\"%s\"} %llu\n", busName(buses[b].device),
+                       (unsigned long long)occ[b].handoffs);
+    metricFamily(page, "sdm120c_lock_holder_pid", "gauge", "Process holding the bus lock, 0 if free");
+    for (b=0; b < nbuses; b++)
+        if (have_occ[b])
+            out_printf(page, "sdm120c_lock_holder_pid{bus=\"%s\"} %u\n", busName(buses[b].device), occ[b].holder);
+    out_printf(page, "# EOF\n");
+}
+
+int main(int argc, char* argv[])
+{
+    static int device_address[10] = {1};
+    int idevices = -1;
+    int ndevices = 1;
+    
+    
+    int new_address    = 0;
+    int new_baud_rate  = 0;
+    int new_parity_stop= -1;
+    int rotation_time_flag = 0;
+    int rotation_time  = 0; 
+    int measurement_mode_flag = 0;
+    int measurement_mode = 0; 
+    int count_param    = 0;
+    int plan_flag      = 0;
+    int busstatus_flag = 0;
+#if LIBMODBUS_VERSION_MAJOR >= 3 && LIBMODBUS_VERSION_MINOR >= 1 && LIBMODBUS_VERSION_MICRO >= 2
+    uint32_t resp_timeout = 2;
+    uint32_t byte_timeout = -1;    
+#else
+    time_t resp_timeout = 2;
+    time_t byte_timeout = -1;
+#endif
+    char *szttyDevice  = NULL;
+
+    int c;
+    int i, j, b;
+    int speed          = 0;
+    int bits           = 0;
+
+    const char *EVEN_parity = "E";
+    const char *NONE_parity = "N";
+    const char *ODD_parity  = "O";
+    char *c_parity     = NULL;
+    char *p;
+    
+    int baud_rate      = 0;
+    int stop_bits      = 0;
+    char parity        = E_PARITY;
+    
+    programName        = argv[0];
+
+    if (argc == 1) {
+        usage(programName);
+        exit(EXIT_FAILURE);
+    }
+
+    srand(getpid()^time(NULL));      // Init random numbers
+
+    PID = getpid();
+    getCmdLine();
+
+    PPID = getppid();
+    PARENTCOMMAND = getPIDcmd(PPID); 
+
+    opterr = 0;
+
+    while ((c = getopt_long (argc, argv, "a:Ab:BcCd:D:efgiI:j:lmM:nN:opP:qr:R:s:S:tTvw:W:xy:z:12", long_options, NULL)) != -1) {
+        switch (c)
+        {
+            case 'a':
+                if (idevices+1 >= (int)(sizeof(device_address)/sizeof(device_address[0]))) {
+                    fprintf (stderr, "%s: Too many meters, max %d.\n", programName, (int)(sizeof(device_address)/sizeof(device_address[0])));
+                    exit(EXIT_FAILURE);
+                }
+                device_address[++idevices] = atoi(optarg);
+                ndevices=idevices+1;
+                if (!(0 < device_address[ndevices-1] && device_address[ndevices-1] <= 247)) {
+                    fprintf (stderr, "%s: Address must be between 1 and 247.\n", programName);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'v':
+                volt_flag = 1;
+                RTU_ReadRegistersRequests[VOLTAGE/2]=1;
+                count_param++;
+                break;
+            case 'p':
+                power_flag = 1;
+                RTU_ReadRegistersRequests[POWER/2]=1;
+                count_param++;
+                break;
+            case 'c':
+                current_flag = 1;
+                RTU_ReadRegistersRequests[CURRENT/2]=1;
+                count_param++;
+                break;
+            case 'e':
+                export_flag = 1;
+                RTU_ReadRegistersRequests[EAENERGY/2]=1;                
+                count_param++;
+                break;
+            case 'i':
+                import_flag = 1;
+                RTU_ReadRegistersRequests[IAENERGY/2]=1;                
+                count_param++;
+                break;
+            case 't':
+                total_flag = 1;
+                RTU_ReadRegistersRequests[TAENERGY/2]=1;
+                count_param++;
+                break;
+            case 'A':
+                rimport_flag = 1;
+                RTU_ReadRegistersRequests[IRAENERGY/2]=1;                
+                count_param++;
+                break;
+            case 'B':
+                rexport_flag = 1;
+                RTU_ReadRegistersRequests[ERAENERGY/2]=1;                
+                count_param++;
+                break;
+            case 'C':
+                rtotal_flag = 1;
+                RTU_ReadRegistersRequests[TRENERGY/2]=1;
+                count_param++;
+                break;
+            case 'f':
+                freq_flag = 1;
+                RTU_ReadRegistersRequests[FREQUENCY/2]=1;
+                count_param++;
+                break;
+            case 'g':
+                pf_flag = 1;
+                RTU_ReadRegistersRequests[PFACTOR/2]=1;
+                count_param++;
+                break;
+            case 'l':
+                apower_flag = 1;
+                RTU_ReadRegistersRequests[APOWER/2]=1;
+                count_param++;
+                break;
+            case 'n':
+                rapower_flag = 1;
+                RTU_ReadRegistersRequests[RAPOWER/2]=1;
+                count_param++;
+                break;
+            case 'o':
+                pangle_flag = 1;
+                RTU_ReadRegistersRequests[PANGLE/2]=1;
+                count_param++;
+                break;
+            case 'd':
+                switch (*optarg) {
+                    case '0':
+                    case '1':
+                    case '2':
+                    case '3':
+                        debug_flag = atoi(optarg) & DEBUG_STDERR;
+                        debug_mask = atoi(optarg);
+                        break;
+                    default:
+                         fprintf (stderr, "%s: Debug value must be one of 0,1,2,3.\n", programName);
+                         exit(EXIT_FAILURE);
+                }
+                break;
+            case 'x':
+                trace_flag = 1;
+                break;
+            case 'b':
+                // Comma separated list, more than one only with --scan
+                c_parity = strdup(optarg);
+                scan_nbauds = 0;
+                for (p = strtok(c_parity, ","); p != NULL; p = strtok(NULL, ",")) {
+                    speed = atoi(p);
+                    if (!(speed == 1200 || speed == 2400 || speed == 4800 || speed == 9600)) {
+                        fprintf (stderr, "%s: Baud Rate must be one of 1200, 2400, 4800, 9600\n", programName);
+                        exit(EXIT_FAILURE);
+                    }
+                    if (scan_nbauds < (int)(sizeof(scan_bauds)/sizeof(scan_bauds[0])))
+                        scan_bauds[scan_nbauds++] = speed;
+                }
+                baud_rate = scan_bauds[0];
+                free(c_parity);
+                break;
+            case 'P':
+                c_parity = strdup(optarg);
+                scan_nparities = 0;
+                for (p = strtok(c_parity, ","); p != NULL; p = strtok(NULL, ",")) {
+                    if (strcmp(p,EVEN_parity) == 0) {
+                        parity = E_PARITY;
+                    } else if (strcmp(p,NONE_parity) == 0) {
+                        parity = N_PARITY;
+                    } else if (strcmp(p,ODD_parity) == 0) {
+                        parity = O_PARITY;
+                    } else {
+                        fprintf (stderr, "%s: Parity must be one of E, N, O\n", programName);
+                        exit(EXIT_FAILURE);
+                    }
+                    if (scan_nparities < (int)sizeof(scan_parities))
+                        scan_parities[scan_nparities++] = parity;
+                }
+                parity = scan_parities[0];
+                free(c_parity);
+                break;
+            case 'S':
+                bits = atoi(optarg);
+                if (bits == 1 || bits == 2) {
+                    stop_bits = bits;
+                    scan_stop_bits = bits;
+                } else {
+                    fprintf (stderr, "%s: Stop bits can be one of 1, 2\n", programName);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                speed = atoi(optarg);
+                switch (speed) {
+                    case 1200:
+                        new_baud_rate = BR1200;
+                        break;
+                    case 2400:
+                        new_baud_rate = BR2400;
+                        break;
+                    case 4800:
+                        new_baud_rate = BR4800;
+                        break;
+                    case 9600:
+                        new_baud_rate = BR9600;
+                        break;
+                    default:
+                        fprintf (stderr, "%s: Baud Rate must be one of 1200, 2400, 4800, 9600\n", programName);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+            case 'N':
+                new_parity_stop = atoi(optarg);
+                if (!(0 <= new_parity_stop && new_parity_stop <= 3)) {
+                    fprintf (stderr, "%s: New parity/stop (%d) out of range, 0-3.\n", programName, new_parity_stop);
                     exit(EXIT_FAILURE);
                 }
                 break;
@@ -933,6 +2727,13 @@ int main(int argc, char* argv[])
                     exit(EXIT_FAILURE);
                 }
                 break;
+            case 'I':
+                poll_interval = atoi(optarg);
+                if (poll_interval < 1 || poll_interval > 86400) {
+                    fprintf(stderr, "%s: -I Poll interval (%d) out of range, 1-86400.\n",programName,poll_interval);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'j':
                 resp_timeout = atoi(optarg);
                 if (resp_timeout < 1 || resp_timeout > 500) {
@@ -940,29 +2741,146 @@ int main(int argc, char* argv[])
                     exit(EXIT_FAILURE);
                 }
                 break;
-            case 'y':
-                byte_timeout = atoi(optarg);
-                if (byte_timeout < 1 || byte_timeout > 500) {
-                    fprintf(stderr, "%s: -y Byte timeout (%lu) out of range, 1-500.\n",programName,(long unsigned)byte_timeout);
+            case 'y':
+                byte_timeout = atoi(optarg);
+                if (byte_timeout < 1 || byte_timeout > 500) {
+                    fprintf(stderr, "%s: -y Byte timeout (%lu) out of range, 1-500.\n",programName,(long unsigned)byte_timeout);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                yLockWait = atoi(optarg);
+                if (yLockWait < 1 || yLockWait > 30) {
+                    fprintf(stderr, "%s: -w Lock Wait seconds (%d) out of range, 1-30.\n",programName,yLockWait);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'W':
+                settle_time = atoi(optarg);
+                break;
+            case 'D':
+                command_delay = atoi(optarg);
+                break;
+            case 'T':
+                time_disp_flag = 1;
+                count_param++;
+                break;
+            case OPT_PLAN:
+                plan_flag = 1;
+                break;
+            case OPT_NATIVE:
+                native_flag = 1;
+                break;
+            case OPT_PRIORITY:
+                for (yLockPrio = RS485_PRIO_HIGH; yLockPrio < RS485_PRIO_OVER; yLockPrio++)
+                    if (strcmp(optarg, rs485_class_name(yLockPrio)) == 0) break;
+                if (yLockPrio == RS485_PRIO_OVER) {
+                    fprintf(stderr, "%s: --priority %s invalid, use high, normal or low.\n", programName, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_BUDGET:
+                yLockBudget = atoi(optarg);
+                if (yLockBudget < 1 || yLockBudget > 100) {
+                    fprintf(stderr, "%s: --bus-budget percent (%d) out of range, 1-100.\n", programName, yLockBudget);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_BUSSTATUS:
+                busstatus_flag = 1;
+                break;
+            case OPT_BROKER:
+                broker_flag = 1;
+                break;
+            case OPT_VIABROKER:
+                via_broker_flag = 1;
+                break;
+            case OPT_SHM:
+                shm_flag = 1;
+                break;
+            case OPT_METRICS:
+                metrics_spec = optarg;
+                break;
+            case OPT_STORE:
+                store_dir = optarg;
+                break;
+            case OPT_SPOOL:
+                spool_path = optarg;
+                break;
+            case OPT_SPOOLSIZE:
+                spool_kb = atol(optarg);
+                if (spool_kb < 4 || spool_kb > 1048576) {
+                    fprintf(stderr, "%s: --spool-size %s invalid, use 4-1048576 KiB\n", programName, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_SINK:
+                if ((sink = sink_new(optarg)) == NULL) {
+                    fprintf(stderr, "%s: --sink %s invalid, use -, tcp://host:port or mqtt://host[:port][/prefix]\n", programName, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_DEADBAND:
+                if (deadband_parse(&deadband, optarg) == -1) {
+                    fprintf(stderr, "%s: --deadband %s invalid, use options=threshold[%%], options among vcplngofieatABC.\n", programName, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                deadband_flag = 1;
+                break;
+            case OPT_HEARTBEAT:
+                deadband.heartbeat_s = atol(optarg);
+                if (deadband.heartbeat_s <= 0) {
+                    fprintf(stderr, "%s: --heartbeat %s invalid, use seconds\n", programName, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                deadband_flag = 1;
+                break;
+            case OPT_INTEGRATE:
+                integrate_flag = 1;
+                break;
+            case OPT_EGUARD:
+                guard_dir = optarg;
+                break;
+            case OPT_ROLLUP: {
+                char *spec = strdup(optarg), *tok, *save = NULL;
+
+                for (tok = strtok_r(spec, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+                    if (nrollups == ROLLUP_WINDOWS || (rollup_windows[nrollups++] = rollup_window(tok)) == -1) {
+                        fprintf(stderr, "%s: --rollup %s invalid, up to %d windows dividing a day, i.e. 1m,15m,1h\n",
+                                programName, optarg, ROLLUP_WINDOWS);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                free(spec);
+                break;
+            }
+            case OPT_FORMAT:
+                if ((output_style = out_style(optarg)) == -1) {
+                    fprintf(stderr, "%s: --format %s invalid, use json, csv, influx or binary.\n", programName, optarg);
                     exit(EXIT_FAILURE);
                 }
                 break;
-            case 'w':
-                yLockWait = atoi(optarg);
-                if (yLockWait < 1 || yLockWait > 30) {
-                    fprintf(stderr, "%s: -w Lock Wait seconds (%d) out of range, 1-30.\n",programName,yLockWait);
+            case OPT_MAXAGE:
+                max_age = atol(optarg);
+                if (max_age < 0) {
+                    fprintf(stderr, "%s: --max-age ms (%ld) must be 0 or more.\n", programName, max_age);
                     exit(EXIT_FAILURE);
                 }
                 break;
-            case 'W':
-                settle_time = atoi(optarg);
+            case OPT_SCAN:
+                scan_flag = 1;
                 break;
-            case 'D':
-                command_delay = atoi(optarg);
+            case OPT_CALIBRATE:
+                calibrate_flag = 1;
                 break;
-            case 'T':
-                time_disp_flag = 1;
-                count_param++;
+            case OPT_ADAPTIVE:
+                adaptive_flag = 1;
+                break;
+            case OPT_RATE:
+                if (parseRate(optarg) == -1) {
+                    fprintf(stderr, "%s: --rate %s invalid, use [address:]options=milliseconds (100-86400000), options among vcplngofieatABC.\n", programName, optarg);
+                    exit(EXIT_FAILURE);
+                }
                 break;
             case '?':
                 if (isprint (optopt)) {
@@ -983,22 +2901,158 @@ int main(int argc, char* argv[])
 
     log_message(debug_flag, "cmdline=\"%s\"", cmdline);
         
-    if (optind < argc) {               /* get serial device name */
-        szttyDevice = argv[optind];
-     } else {
+    for (; optind < argc; optind++) {  /* get serial device names, device[@address,..] */
+        struct bus *bus = &buses[nbuses];
+
+        if (nbuses >= MAX_BUSES) {
+            fprintf(stderr, "%s: Too many serial devices, max %d.\n", programName, MAX_BUSES);
+            exit(EXIT_FAILURE);
+        }
+        bus->device = strdup(argv[optind]);
+        if ((p = strchr(bus->device, '@')) != NULL) {
+            *p++ = '\0';
+            for (p = strtok(p, ","); p != NULL; p = strtok(NULL, ",")) {
+                if (bus->naddress >= (int)(sizeof(bus->address)/sizeof(bus->address[0]))) {
+                    fprintf (stderr, "%s: Too many meters on %s, max %d.\n", programName, bus->device, (int)(sizeof(bus->address)/sizeof(bus->address[0])));
+                    exit(EXIT_FAILURE);
+                }
+                bus->address[bus->naddress] = atoi(p);
+                if (!(0 < bus->address[bus->naddress] && bus->address[bus->naddress] <= 247)) {
+                    fprintf (stderr, "%s: Address must be between 1 and 247.\n", programName);
+                    exit(EXIT_FAILURE);
+                }
+                bus->naddress++;
+            }
+        } else {
+            memcpy(bus->address, device_address, sizeof(bus->address));
+            bus->naddress = ndevices;
+        }
+        nbuses++;
+    }
+
+    if (nbuses == 0) {
         log_message(debug_flag, "optind = %d, argc = %d", optind, argc);
         usage(programName);
         fprintf(stderr, "%s: No serial device specified\n", programName);
         exit(EXIT_FAILURE);
     }
+    szttyDevice = buses[0].device;
+    memcpy(device_address, buses[0].address, sizeof(device_address));
+    ndevices = buses[0].naddress;
+
+    if (busstatus_flag) {
+        int rc = 0;
+        for (i=0; i < nbuses; i++)
+            if (busStatus(buses[i].device) == -1) rc = EXIT_FAILURE;
+        return rc;
+    }
+
+    if (nbuses > 1 && (poll_interval == 0 || scan_flag || calibrate_flag)) {
+        fprintf(stderr, "%s: Several serial devices only in daemon mode (-I)\n", programName);
+        exit(EXIT_FAILURE);
+    }
 
     if (compact_flag == 1 && metern_flag == 1) {
         fprintf(stderr, "%s: Parameter -m and -q are mutually exclusive\n", programName);
         usage(programName);
         exit(EXIT_FAILURE);
     }
+    if (output_style != OUT_VERBOSE && (compact_flag == 1 || metern_flag == 1)) {
+        fprintf(stderr, "%s: Parameter --format can't be used with -m or -q\n", programName);
+        usage(programName);
+        exit(EXIT_FAILURE);
+    }
+    if (metern_flag == 1) output_style = OUT_METERN;
+    else if (compact_flag == 1) output_style = OUT_COMPACT;
 
-    LockSer(szttyDevice, PID, debug_flag);
+    if (poll_interval > 0 && (new_address > 0 || new_baud_rate > 0 || new_parity_stop >= 0 ||
+                              rotation_time_flag > 0 || measurement_mode_flag > 0)) {
+        fprintf(stderr, "%s: Parameter -I can't be used to write settings\n", programName);
+        usage(programName);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!scan_flag && (scan_nbauds > 1 || scan_nparities > 1)) {
+        fprintf(stderr, "%s: Lists of baud rates or parities only with --scan\n", programName);
+        exit(EXIT_FAILURE);
+    }
+
+    if (yLockBudget > 0 && poll_interval == 0) {
+        fprintf(stderr, "%s: --bus-budget only in daemon mode (-I)\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (yLockPrio < 0) yLockPrio = poll_interval > 0 ? RS485_PRIO_LOW : RS485_PRIO_NORMAL;
+
+    if (broker_flag && (poll_interval > 0 || scan_flag || calibrate_flag || via_broker_flag ||
+                        new_address > 0 || new_baud_rate > 0 || new_parity_stop >= 0 ||
+                        rotation_time_flag > 0 || measurement_mode_flag > 0)) {
+        fprintf(stderr, "%s: Parameter --broker only with connection and fine tuning parameters\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (via_broker_flag && poll_interval > 0) {
+        fprintf(stderr, "%s: Parameter --via-broker can't be used with -I\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (broker_flag || via_broker_flag) broker_socket = rs485_sidefile(szttyDevice, ".sock");
+
+    if (max_age >= 0 && (poll_interval > 0 || broker_flag || scan_flag || calibrate_flag ||
+                         new_address > 0 || new_baud_rate > 0 || new_parity_stop >= 0 ||
+                         rotation_time_flag > 0 || measurement_mode_flag > 0)) {
+        fprintf(stderr, "%s: Parameter --max-age only with one shot reads\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (max_age >= 0) cache_file = rs485_sidefile(szttyDevice, ".cache");
+
+    if (metrics_spec != NULL && poll_interval == 0 && !broker_flag) {
+        fprintf(stderr, "%s: Parameter --metrics only with -I or --broker\n", programName);
+        exit(EXIT_FAILURE);
+    }
+
+    if (nrollups > 0 && (poll_interval == 0 || output_style < OUT_JSON || output_style > OUT_INFLUX)) {
+        fprintf(stderr, "%s: Parameter --rollup only with -I and --format json, csv or influx\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (guard_dir != NULL && (broker_flag || scan_flag || calibrate_flag ||
+                              new_address > 0 || new_baud_rate > 0 || new_parity_stop >= 0 ||
+                              rotation_time_flag > 0 || measurement_mode_flag > 0)) {
+        fprintf(stderr, "%s: Parameter --energy-guard only with reads\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (guard_dir != NULL && access(guard_dir, W_OK) == -1) {
+        fprintf(stderr, "%s: --energy-guard %s: %s\n", programName, guard_dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (deadband_flag && (poll_interval == 0 || output_style == OUT_COMPACT || nrollups > 0)) {
+        fprintf(stderr, "%s: Parameters --deadband and --heartbeat only with -I, not with -q or --rollup\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if ((spool_path != NULL || sink != NULL) && (poll_interval == 0 || broker_flag)) {
+        fprintf(stderr, "%s: Parameters --spool and --sink only with -I\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (sink != NULL && sink->json && output_style != OUT_JSON) {
+        fprintf(stderr, "%s: --sink %s needs --format json\n", programName, sink->spec);
+        exit(EXIT_FAILURE);
+    }
+    if (integrate_flag && poll_interval == 0) {
+        fprintf(stderr, "%s: Parameter --integrate only with -I\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (store_dir != NULL && poll_interval == 0) {
+        fprintf(stderr, "%s: Parameter --store only with -I\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (store_dir != NULL && access(store_dir, W_OK) == -1) {
+        fprintf(stderr, "%s: --store %s: %s\n", programName, store_dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (output_style > OUT_METERN && (broker_flag || scan_flag || calibrate_flag ||
+                                      new_address > 0 || new_baud_rate > 0 || new_parity_stop >= 0 ||
+                                      rotation_time_flag > 0 || measurement_mode_flag > 0)) {
+        fprintf(stderr, "%s: Parameter --format only with reads\n", programName);
+        exit(EXIT_FAILURE);
+    }
 
     modbus_t *ctx;
     
@@ -1007,11 +3061,13 @@ int main(int argc, char* argv[])
 
     // Response timeout
     resp_timeout *= 100000;    
+    response_timeout = resp_timeout;
     log_message(debug_flag, "resp_timeout=%ldus", resp_timeout);
     
     // Byte timeout
     if (byte_timeout != -1) {
         byte_timeout *= 1000;    
+        byte_timeout_us = byte_timeout;
         log_message(debug_flag, "byte_timeout=%ldus", byte_timeout);
     }
     
@@ -1039,434 +3095,378 @@ int main(int argc, char* argv[])
             stop_bits=2;     // Default if parity == N        
     }
 
-    //--- Modbus Setup start ---
-    
-    ctx = modbus_new_rtu(szttyDevice, baud_rate, parity, 8, stop_bits);
-    if (ctx == NULL) {
-        log_message(debug_flag | DEBUG_SYSLOG, "Unable to create the libmodbus context\n");
-        ClrSerLock(PID);
+    if (new_address == 0 && new_baud_rate == 0 && new_parity_stop < 0 &&
+        rotation_time_flag == 0 && measurement_mode_flag == 0 &&
+        power_flag   == 0 &&
+        apower_flag  == 0 &&
+        rapower_flag == 0 &&
+        volt_flag    == 0 &&
+        current_flag == 0 &&
+        pf_flag      == 0 &&
+        pangle_flag  == 0 &&
+        freq_flag    == 0 &&
+        export_flag  == 0 &&
+        import_flag  == 0 &&
+        total_flag   == 0 &&
+        rexport_flag == 0 &&
+        rimport_flag == 0 &&
+        rtotal_flag  == 0 &&
+        time_disp_flag == 0
+       ) {
+        // if no parameter, retrieve all values
+        power_flag   = 1;
+        apower_flag  = 1;
+        rapower_flag = 1;
+        volt_flag    = 1;
+        current_flag = 1;
+        pangle_flag  = 1;
+        freq_flag    = 1;
+        pf_flag      = 1;
+        export_flag  = 1;
+        import_flag  = 1;
+        total_flag   = 1;
+        rexport_flag  = 1;
+        rimport_flag  = 1;
+        rtotal_flag   = 1;
+        count_param  = power_flag + apower_flag + rapower_flag + volt_flag + 
+                       current_flag + pangle_flag + freq_flag + pf_flag + 
+                       export_flag + import_flag + total_flag +
+                       rexport_flag + rimport_flag + rtotal_flag;
+        RTU_ReadRegistersRequests[VOLTAGE/2]=1;
+        RTU_ReadRegistersRequests[CURRENT/2]=1;
+        RTU_ReadRegistersRequests[POWER/2]=1;
+        RTU_ReadRegistersRequests[APOWER/2]=1;
+        RTU_ReadRegistersRequests[RAPOWER/2]=1;
+        RTU_ReadRegistersRequests[PFACTOR/2]=1;
+        RTU_ReadRegistersRequests[PANGLE/2]=1;
+        RTU_ReadRegistersRequests[FREQUENCY/2]=1;
+        RTU_ReadRegistersRequests[IAENERGY/2]=1;
+        RTU_ReadRegistersRequests[EAENERGY/2]=1;
+        RTU_ReadRegistersRequests[TAENERGY/2]=1;
+        RTU_ReadRegistersRequests[IRAENERGY/2]=1;
+        RTU_ReadRegistersRequests[ERAENERGY/2]=1;
+        RTU_ReadRegistersRequests[TRENERGY/2]=1;
+    }
+
+    if (nrates > 0 && poll_interval == 0) {
+        fprintf(stderr, "%s: Parameter --rate requires -I\n", programName);
+        usage(programName);
         exit(EXIT_FAILURE);
-    } else {
-        log_message(debug_flag, "Libmodbus context open (%d%s%d)",
-                baud_rate,
-                (parity == E_PARITY) ? EVEN_parity :
-                (parity == N_PARITY) ? NONE_parity :
-                ODD_parity,
-                stop_bits);
     }
 
-#if LIBMODBUS_VERSION_MAJOR >= 3 && LIBMODBUS_VERSION_MINOR >= 1 && LIBMODBUS_VERSION_MICRO >= 2
+    // Rate classes also ask for their values
+    for (i=0; i < nrates; i++) {
+        for (j=0; j < NRATEOPTS; j++) {
+            if (!rates[i].opts[j]) continue;
+            if (*rate_opts[j].flag == 0) count_param++;
+            *rate_opts[j].flag = 1;
+            RTU_ReadRegistersRequests[rate_opts[j].reg/2] = 1;
+        }
+    }
 
-    // Considering to get those values from command line
-    if (byte_timeout == -1) {
-        modbus_set_byte_timeout(ctx, -1, 0);
-        log_message(debug_flag, "Byte timeout disabled.");
+    // Read plan
+    plan_timing_init(&bus_timing, baud_rate, parity, stop_bits, resp_timeout);
+    plan_clear(&read_plan);
+    plan_build(&read_plan, &bus_timing, PLAN_FC_INPUT, RTU_ReadRegistersRequests, RTU_MAXREG/2);
+    if (time_disp_flag == 1)
+        plan_add(&read_plan, &bus_timing, PLAN_FC_HOLDING, model == MODEL_120 ? TIME_DISP : TIME_DISP_220, 1);
+
+    // Poll schedule and admission control, every bus
+    for (b=0; poll_interval > 0 && b < nbuses; b++) {
+        if (buildSchedule(buses[b].address, buses[b].naddress) == -1) {
+            fprintf(stderr, "%s: Too many rate classes, max %d.\n", programName, SCHED_MAXJOBS);
+            exit(EXIT_FAILURE);
+        }
+        if (sched_admit(&poll_sched, &bus_timing) == -1 && plan_flag == 0) {
+            sched_print(stderr, &poll_sched);
+            fprintf(stderr, "%s: Rate classes need %.1f%% of %s at %d baud, not schedulable.\n",
+                    programName, (poll_sched.utilization + poll_sched.blocking) * 100, buses[b].device, baud_rate);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (plan_flag == 1) {
+        plan_print(stdout, &read_plan, &bus_timing);
+        for (b=0; poll_interval > 0 && b < nbuses; b++) {
+            buildSchedule(buses[b].address, buses[b].naddress);
+            sched_admit(&poll_sched, &bus_timing);
+            if (nbuses > 1) printf("Bus %s\n", buses[b].device);
+            sched_print(stdout, &poll_sched);
+        }
+        free(PARENTCOMMAND);
+        return 0;
+    }
+
+    // CSV or binary stream header once, before the samples of every bus
+    output_columns = requestFields(RTU_ReadRegistersRequests, time_disp_flag);
+    if (guard_dir != NULL && (output_columns & EGUARD_FIELDS)) output_columns |= OUT_CORRECTED;
+    if (integrate_flag) output_columns |= OUT_INTEGRATED;
+    for (i=0; i < SNAP_VALUES; i++)
+        if (out_fields[i].integer && !(integrate_flag && (INTEG_FIELDS & (1U << i)))) deadband.integer |= 1U << i;
+    if (output_style == OUT_BINARY) {
+        const char *names[MAX_BUSES];
+
+        for (b=0; b < nbuses; b++) names[b] = busName(buses[b].device);
+        out_rec_header(&output, names, nbuses);
+    } else if (nrollups > 0) {
+        out_rollup_header(&output, output_style, output_columns);
     } else {
-        modbus_set_byte_timeout(ctx, 0, byte_timeout);
-        log_message(debug_flag, "New byte timeout: %ds, %dus", 0, byte_timeout);
+        out_header(&output, output_style, output_columns);
     }
-    modbus_set_response_timeout(ctx, 0, resp_timeout);
-    log_message(debug_flag, "New response timeout: %ds, %dus", 0, resp_timeout);
+    if (poll_interval > 0 && (spool_path != NULL || sink != NULL)) openSpool();
+    else if (poll_interval > 0) out_flush(&output, STDOUT_FILENO);
+    sample_bus = busName(szttyDevice);
 
-#else
+    if (metrics_spec != NULL) {
+        int mfd;
 
-    struct timeval timeout;
+        if ((mfd = metrics_listen(metrics_spec)) == -1 || metrics_start(mfd, renderMetrics) == -1) {
+            log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Can't serve metrics on %s: (%d) %s", metrics_spec, errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        log_message(debug_flag | DEBUG_SYSLOG, "Metrics on http://%s/metrics", metrics_spec);
+    }
 
-    if (byte_timeout == -1) {
-        timeout.tv_sec = -1;
-        timeout.tv_usec = 0;
-        modbus_set_byte_timeout(ctx, &timeout);
-        log_message(debug_flag, "Byte timeout disabled.");
-    } else {
-        timeout.tv_sec = 0;
-        timeout.tv_usec = byte_timeout;
-        modbus_set_byte_timeout(ctx, &timeout);
-        log_message(debug_flag, "New byte timeout: %ds, %dus", timeout.tv_sec, timeout.tv_usec);
+    if (nbuses > 1) {
+        pollBuses();
+        closeSpool();
+        for (b=0; b < nbuses; b++) free(buses[b].device);
+        free(PARENTCOMMAND);
+        return 0;
     }
-    
-    timeout.tv_sec = 0;
-    timeout.tv_usec = resp_timeout;
-    modbus_set_response_timeout(ctx, &timeout);
-    log_message(debug_flag, "New response timeout: %ds, %dus", timeout.tv_sec, timeout.tv_usec);
 
-#endif
+    openGuard(szttyDevice);
+
+    // Every meter fresh in the --max-age cache: no lock, no bus
+    if (cache_file != NULL) {
+        int64_t time_us;
+
+        if (rcache_load(cache_file) == 0)
+            log_message(debug_flag, "Cache loaded from %s", cache_file);
+        for (idevices=0; idevices<ndevices && cacheRead(device_address[idevices], &read_plan, &time_us) == 0; idevices++);
+        if (idevices == ndevices) {
+            sample_buf = &output;
+            for (idevices=0; idevices<ndevices; idevices++)
+                pollDevice(NULL, device_address[idevices], &read_plan, RTU_ReadRegistersRequests, time_disp_flag);
+            out_status(&output, output_style, 1);
+            out_flush(&output, STDOUT_FILENO);
+            out_free(&output);
+            closeGuard();
+            free(cache_file);
+            free(broker_socket);
+            free(PARENTCOMMAND);
+            return 0;
+        }
+    }
 
-    //modbus_set_error_recovery(ctx, MODBUS_ERROR_RECOVERY_LINK | MODBUS_ERROR_RECOVERY_PROTOCOL);
-    //modbus_set_error_recovery(ctx, MODBUS_ERROR_RECOVERY_PROTOCOL);
-    modbus_set_error_recovery(ctx, MODBUS_ERROR_RECOVERY_NONE);
-    
-    if (trace_flag == 1) {
-        modbus_set_debug(ctx, 1);
+    // Reads through the broker, the bus below if there is none
+    if (via_broker_flag && !scan_flag && !calibrate_flag &&
+        new_address == 0 && new_baud_rate == 0 && new_parity_stop < 0 &&
+        rotation_time_flag == 0 && measurement_mode_flag == 0) {
+        size_t header_len = output.len;
+
+        sample_buf = &output;
+        for (idevices=0; idevices<ndevices; idevices++) {
+            if (pollDevice(NULL, device_address[idevices], &read_plan, RTU_ReadRegistersRequests, time_disp_flag) == 0) continue;
+            if (broker_absent) break;
+            closeGuard();
+            out_status(&output, output_style, 0);
+            out_flush(&output, STDOUT_FILENO);
+            if (!metern_flag) log_message(debug_flag | DEBUG_SYSLOG, "NOK");
+            free(PARENTCOMMAND);
+            exit(EXIT_FAILURE);
+        }
+        if (!broker_absent) {
+            saveCache();
+            closeGuard();
+            out_status(&output, output_style, 1);
+            out_flush(&output, STDOUT_FILENO);
+            out_free(&output);
+            free(broker_socket);
+            free(PARENTCOMMAND);
+            return 0;
+        }
+        // Meters already printed are read again below
+        output.len = header_len;
+        sample_buf = NULL;
+        log_message(debug_flag, "No broker on %s, reading the bus", broker_socket);
     }
 
-    if (modbus_connect(ctx) == -1) {
-        log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Connection failed: (%d) %s\n", errno, modbus_strerror(errno));
-        modbus_free(ctx);
+    LockSer(szttyDevice, PID, debug_flag);
+    openSnapshot(szttyDevice);
+
+    mstat_init(&bus_timing);
+    if (getStatFile() != NULL) {
+        if (mstat_load(getStatFile()) == 0)
+            log_message(debug_flag, "Meter latency loaded from %s", getStatFile());
+    }
+
+    if (scan_flag) {
+        int found = scanBus(szttyDevice, baud_rate, parity);
+        saveMeterStat();
+        ClrSerLock(PID);
+        free(devLCKfile);
+        return found > 0 ? 0 : EXIT_FAILURE;
+    }
+
+    //--- Modbus Setup start ---
+
+    if ((ctx = busConnect(szttyDevice)) == NULL) {
         ClrSerLock(PID);
         exit(EXIT_FAILURE);
     }
-    
-    for (idevices=0; idevices<ndevices; idevices++) {
 
-        log_message(debug_flag, "Connecting to device id: %d", device_address[idevices]);
-        if (settle_time) {
-          // Wait for line settle
-          log_message(debug_flag, "Sleeping %ldus for line settle...", settle_time);
-          usleep(settle_time);
-        }
-            
-        modbus_set_slave(ctx, device_address[idevices]);
-    
-        //log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx)); // Already flushed by connect 
-    
-        float voltage     = 0;
-        float current     = 0;
-        float power       = 0;
-        float apower      = 0;
-        float rapower     = 0;
-        float pf          = 0;
-        float pangle      = 0;
-        float freq        = 0;
-        float imp_energy  = 0;
-        float exp_energy  = 0;
-        float tot_energy  = 0;
-        float impr_energy = 0;
-        float expr_energy = 0;
-        float totr_energy = 0;
-        int   time_disp   = 0;
+    if (calibrate_flag) {
+        for (idevices=0; idevices<ndevices; idevices++)
+            calibrateGap(ctx, device_address[idevices]);
+        busClose(ctx);
+        modbus_free(ctx);
+        saveMeterStat();
+        ClrSerLock(PID);
+        return 0;
+    }
     
-        if (new_address > 0 && new_baud_rate > 0) {
-            log_message(DEBUG_STDERR, "Parameter -s and -r are mutually exclusive\n\n");
-            usage(programName);
-            exit_error(ctx);
-        } else if ((new_address > 0 || new_baud_rate > 0) && new_parity_stop >= 0) {
-            log_message(DEBUG_STDERR, "Parameter -s, -r and -N are mutually exclusive\n\n");
+    if (new_address > 0 || new_baud_rate > 0 || new_parity_stop >= 0 ||
+        rotation_time_flag > 0 || measurement_mode_flag > 0) {
+
+        log_message(debug_flag, "Connecting to device id: %d", device_address[0]);
+        lineSettle();
+
+        modbus_set_slave(ctx, device_address[0]);
+        current_address = device_address[0];
+    }
+
+    if (new_address > 0 && new_baud_rate > 0) {
+        log_message(DEBUG_STDERR, "Parameter -s and -r are mutually exclusive\n\n");
+        usage(programName);
+        exit_error(ctx);
+    } else if ((new_address > 0 || new_baud_rate > 0) && new_parity_stop >= 0) {
+        log_message(DEBUG_STDERR, "Parameter -s, -r and -N are mutually exclusive\n\n");
+        usage(programName);
+        exit_error(ctx);
+    } else if (new_address > 0) {
+
+        if (count_param > 0) {
             usage(programName);
-            exit_error(ctx);
-        } else if (new_address > 0) {
-    
-            if (count_param > 0) {
-                usage(programName);
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ClrSerLock(PID);
-                exit(EXIT_FAILURE);
-            } else {
-                // change Address
-                changeConfigFloat(ctx, DEVICE_ID, new_address, RESTART_FALSE, 2);
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ClrSerLock(PID);
-                return 0;
-            }
-    
-        } else if (new_baud_rate > 0) {
-    
-            if (count_param > 0) {
-                usage(programName);
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ClrSerLock(PID);
-                exit(EXIT_FAILURE);
-            } else {
-                // change Baud Rate
-                changeConfigFloat(ctx, BAUD_RATE, new_baud_rate, RESTART_FALSE, 2);
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ClrSerLock(PID);
-                return 0;
-            }
-    
-        } else if (new_parity_stop >= 0) {
-    
-            if (count_param > 0) {
-                usage(programName);
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ClrSerLock(PID);
-                exit(EXIT_FAILURE);
-            } else {
-                // change Parity/Stop
-                changeConfigFloat(ctx, NPARSTOP, new_parity_stop, RESTART_TRUE, 2);
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ClrSerLock(PID);
-                return 0;
-            }
-    
-        } else if (rotation_time_flag > 0) {
-    
-            if (count_param > 0) {
-                usage(programName);
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ClrSerLock(PID);
-                exit(EXIT_FAILURE);
-            } else {
-                // change Time Rotation
-                changeConfigBCD(ctx, 
-                                model == MODEL_120 ? TIME_DISP : TIME_DISP_220, 
-                                rotation_time, RESTART_FALSE, 1);
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ClrSerLock(PID);
-                return 0;
-            }
-    
-        } else if (measurement_mode_flag > 0) {
-    
-            if (count_param > 0) {
-                usage(programName);
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ClrSerLock(PID);
-                exit(EXIT_FAILURE);
-            } else {
-                // change Measurement Mode
-                changeConfigHex(ctx, TOT_MODE, measurement_mode, RESTART_FALSE);
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ClrSerLock(PID);
-                return 0;
-            }
-    
-        } else if (power_flag   == 0 &&
-                   apower_flag  == 0 &&
-                   rapower_flag == 0 &&
-                   volt_flag    == 0 &&
-                   current_flag == 0 &&
-                   pf_flag      == 0 &&
-                   pangle_flag  == 0 &&
-                   freq_flag    == 0 &&
-                   export_flag  == 0 &&
-                   import_flag  == 0 &&
-                   total_flag   == 0 &&
-                   rexport_flag == 0 &&
-                   rimport_flag == 0 &&
-                   rtotal_flag  == 0 &&
-                   time_disp_flag == 0
-           ) {
-           // if no parameter, retrieve all values
-            power_flag   = 1;
-            apower_flag  = 1;
-            rapower_flag = 1;
-            volt_flag    = 1;
-            current_flag = 1;
-            pangle_flag  = 1;
-            freq_flag    = 1;
-            pf_flag      = 1;
-            export_flag  = 1;
-            import_flag  = 1;
-            total_flag   = 1;
-            rexport_flag  = 1;
-            rimport_flag  = 1;
-            rtotal_flag   = 1;
-            count_param  = power_flag + apower_flag + rapower_flag + volt_flag + 
-                           current_flag + pangle_flag + freq_flag + pf_flag + 
-                           export_flag + import_flag + total_flag +
-                           rexport_flag + rimport_flag + rtotal_flag;
-            RTU_ReadRegistersRequests[0]=1; RTU_ReadRegistersRequests[0x50/2-1]=1;
-        }
-    
-        log_message(debug_flag, "readRegisters(ctx, 0, 0x50, buffer, requests, %d)", num_retries);
-        readRegisters(ctx, 0, 0x50, RTU_ReadRegistersBuffer, RTU_ReadRegistersRequests, num_retries);
-    
-        if (volt_flag == 1) {
-            voltage = getMeasureFloat(ctx, VOLTAGE, num_retries, 2);
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_V(%3.2f*V)\n", device_address[idevices], voltage);
-            } else if (compact_flag == 1) {
-                printf("%3.2f ", voltage);
-            } else {
-                printf("Voltage: %3.2f V \n",voltage);
-            }
-        }
-    
-        if (current_flag == 1) {
-            current  = getMeasureFloat(ctx, CURRENT, num_retries, 2);
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_C(%3.2f*A)\n", device_address[idevices], current);
-            } else if (compact_flag == 1) {
-                printf("%3.2f ", current);
-            } else {
-                printf("Current: %3.2f A \n",current);
-            }
-        }
-    
-        if (power_flag == 1) {
-            power = getMeasureFloat(ctx, POWER, num_retries, 2);
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_P(%3.2f*W)\n", device_address[idevices], power);
-            } else if (compact_flag == 1) {
-                printf("%3.2f ", power);
-            } else {
-                printf("Power: %3.2f W \n", power);
-            }
-        }
-    
-        if (apower_flag == 1) {
-            apower = getMeasureFloat(ctx, APOWER, num_retries, 2);
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_VA(%3.2f*VA)\n", device_address[idevices], apower);
-            } else if (compact_flag == 1) {
-                printf("%3.2f ", apower);
-            } else {
-                printf("Active Apparent Power: %3.2f VA \n", apower);
-            }
-        }
-    
-        if (rapower_flag == 1) {
-            rapower = getMeasureFloat(ctx, RAPOWER, num_retries, 2);
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_VAR(%3.2f*VAR)\n", device_address[idevices], rapower);
-            } else if (compact_flag == 1) {
-                printf("%3.2f ", rapower);
-            } else {
-                printf("Reactive Apparent Power: %3.2f VAR \n", rapower);
-            }
-        }
-    
-        if (pf_flag == 1) {
-            pf = getMeasureFloat(ctx, PFACTOR, num_retries, 2);
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_PF(%3.2f*F)\n", device_address[idevices], pf);
-            } else if (compact_flag == 1) {
-                printf("%3.2f ", pf);
-            } else {
-                printf("Power Factor: %3.2f \n", pf);
-            }
-        }
-    
-        if (pangle_flag == 1) {
-            pangle = getMeasureFloat(ctx, PANGLE, num_retries, 2);
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_PA(%3.2f*Dg)\n", device_address[idevices], pangle);
-            } else if (compact_flag == 1) {
-                printf("%3.2f ", pangle);
-            } else {
-                printf("Phase Angle: %3.2f Degree \n", pangle);
-            }
-        }
-    
-        if (freq_flag == 1) {
-            freq = getMeasureFloat(ctx, FREQUENCY, num_retries, 2);
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_F(%3.2f*Hz)\n", device_address[idevices], freq);
-            } else if (compact_flag == 1) {
-                printf("%3.2f ", freq);
-            } else {
-                printf("Frequency: %3.2f Hz \n", freq);
-            }
+            busClose(ctx);
+            modbus_free(ctx);
+            ClrSerLock(PID);
+            exit(EXIT_FAILURE);
+        } else {
+            // change Address
+            changeConfigFloat(ctx, DEVICE_ID, new_address, RESTART_FALSE, 2);
+            busClose(ctx);
+            modbus_free(ctx);
+            ClrSerLock(PID);
+            return 0;
         }
-    
-        if (import_flag == 1) {
-            imp_energy = getMeasureFloat(ctx, IAENERGY, num_retries, 2) * 1000;
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_IE(%d*Wh)\n", device_address[idevices], (int)imp_energy);
-            } else if (compact_flag == 1) {
-                printf("%d ", (int)imp_energy);
-            } else {
-                printf("Import Active Energy: %d Wh \n", (int)imp_energy);
-            }
-        }
-    
-        if (export_flag == 1) {
-            exp_energy = getMeasureFloat(ctx, EAENERGY, num_retries, 2) * 1000;
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_EE(%d*Wh)\n", device_address[idevices], (int)exp_energy);
-            } else if (compact_flag == 1) {
-                printf("%d ", (int)exp_energy);
-            } else {
-                printf("Export Active Energy: %d Wh \n", (int)exp_energy);
-            }
-        }
-    
-        if (total_flag == 1) {
-            tot_energy = getMeasureFloat(ctx, TAENERGY, num_retries, 2) * 1000;
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_TE(%d*Wh)\n", device_address[idevices], (int)tot_energy);
-            } else if (compact_flag == 1) {
-                printf("%d ", (int)tot_energy);
-            } else {
-                printf("Total Active Energy: %d Wh \n", (int)tot_energy);
-            }
+
+    } else if (new_baud_rate > 0) {
+
+        if (count_param > 0) {
+            usage(programName);
+            busClose(ctx);
+            modbus_free(ctx);
+            ClrSerLock(PID);
+            exit(EXIT_FAILURE);
+        } else {
+            // change Baud Rate
+            changeConfigFloat(ctx, BAUD_RATE, new_baud_rate, RESTART_FALSE, 2);
+            busClose(ctx);
+            modbus_free(ctx);
+            ClrSerLock(PID);
+            return 0;
         }
-    
-        if (rimport_flag == 1) {
-            impr_energy = getMeasureFloat(ctx, IRAENERGY, num_retries, 2) * 1000;
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_IRE(%d*VARh)\n", device_address[idevices], (int)impr_energy);
-            } else if (compact_flag == 1) {
-                printf("%d ", (int)impr_energy);
-            } else {
-                printf("Import Reactive Energy: %d VARh \n", (int)impr_energy);
-            }
+
+    } else if (new_parity_stop >= 0) {
+
+        if (count_param > 0) {
+            usage(programName);
+            busClose(ctx);
+            modbus_free(ctx);
+            ClrSerLock(PID);
+            exit(EXIT_FAILURE);
+        } else {
+            // change Parity/Stop
+            changeConfigFloat(ctx, NPARSTOP, new_parity_stop, RESTART_TRUE, 2);
+            busClose(ctx);
+            modbus_free(ctx);
+            ClrSerLock(PID);
+            return 0;
         }
-    
-        if (rexport_flag == 1) {
-            expr_energy = getMeasureFloat(ctx, ERAENERGY, num_retries, 2) * 1000;
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_ERE(%d*VARh)\n", device_address[idevices], (int)expr_energy);
-            } else if (compact_flag == 1) {
-                printf("%d ", (int)expr_energy);
-            } else {
-                printf("Export Reactive Energy: %d VARh \n", (int)expr_energy);
-            }
+
+    } else if (rotation_time_flag > 0) {
+
+        if (count_param > 0) {
+            usage(programName);
+            busClose(ctx);
+            modbus_free(ctx);
+            ClrSerLock(PID);
+            exit(EXIT_FAILURE);
+        } else {
+            // change Time Rotation
+            changeConfigBCD(ctx, 
+                            model == MODEL_120 ? TIME_DISP : TIME_DISP_220, 
+                            rotation_time, RESTART_FALSE, 1);
+            busClose(ctx);
+            modbus_free(ctx);
+            ClrSerLock(PID);
+            return 0;
         }
-    
-        if (rtotal_flag == 1) {
-            totr_energy = getMeasureFloat(ctx, TRENERGY, num_retries, 2) * 1000;
-            read_count++;
-            if (metern_flag == 1) {
-                printf("%d_TRE(%d*VARh)\n", device_address[idevices], (int)totr_energy);
-            } else if (compact_flag == 1) {
-                printf("%d ", (int)totr_energy);
-            } else {
-                printf("Total Reactive Energy: %d VARh \n", (int)totr_energy);
-            }
+
+    } else if (measurement_mode_flag > 0) {
+
+        if (count_param > 0) {
+            usage(programName);
+            busClose(ctx);
+            modbus_free(ctx);
+            ClrSerLock(PID);
+            exit(EXIT_FAILURE);
+        } else {
+            // change Measurement Mode
+            changeConfigHex(ctx, TOT_MODE, measurement_mode, RESTART_FALSE);
+            busClose(ctx);
+            modbus_free(ctx);
+            ClrSerLock(PID);
+            return 0;
         }
-    
-        if (time_disp_flag == 1) {
-            time_disp = getConfigBCD(ctx,
-                                     model == MODEL_120 ? TIME_DISP : TIME_DISP_220,
-                                     num_retries, 1);
-            read_count++;
-            if (compact_flag == 1) {
-                printf("%d ", (int) time_disp);
-            } else {
-                printf("Display rotation time: %d\n", (int) time_disp);
+
+    }
+
+    if (broker_flag) {
+        daemonSignals();
+        if (brokerLoop(ctx) == -1) exit_error(ctx);
+    } else if (poll_interval > 0) {
+        daemonSignals();
+        pollLoop(ctx);
+    } else {
+        sample_buf = &output;
+        for (idevices=0; idevices<ndevices; idevices++) {
+            if (pollDevice(ctx, device_address[idevices], &read_plan, RTU_ReadRegistersRequests, time_disp_flag) == -1) {
+                exit_error(ctx);
             }
         }
-
     }
 
     log_message(debug_flag, "Total Modbus Time: %ldus", TotalModbusTime);
 
-    if (read_count / ndevices == count_param) {
-        // log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
-        modbus_close(ctx);
-        modbus_free(ctx);
-        ClrSerLock(PID);
-        free(devLCKfile);
-        free(devLCKfileNew);
-        free(PARENTCOMMAND);
-        if (!metern_flag) printf("OK\n");
-    } else {
-        exit_error(ctx);
+    // log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
+    busClose(ctx);
+    modbus_free(ctx);
+    saveMeterStat();
+    saveCache();
+    closeSnapshot();
+    closeGuard();
+    closeSpool();
+    ClrSerLock(PID);
+    free(devLCKfile);
+    free(broker_socket);
+    free(PARENTCOMMAND);
+    if (poll_interval == 0 && !broker_flag) {
+        out_status(&output, output_style, 1);
+        out_flush(&output, STDOUT_FILENO);
     }
+    out_free(&output);
 
     return 0;
 }
@@ -23,6 +23,8 @@ extern const char *version;
 extern int debug_flag;
 extern int debug_mask;
 extern int yLockWait;
+extern int yLockPrio;
+extern int yLockBudget;
 extern long unsigned int PID;
 extern long unsigned int PPID;
 extern char *PARENTCOMMAND;
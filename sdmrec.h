@@ -0,0 +1,132 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   sdmrec.h                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Binary record stream of sdm120c --format binary                        */
+/*                                                                            */
+/*   The stream is one sdmrec_header followed by fixed size sdmrec records, */
+/*   all little endian. Values are the float32 the meter sent, energies in  */
+/*   kWh/kVARh, not scaled or rounded. Readers include this header only:   */
+/*   read() or mmap straight into the structs, check sdmrec_check() on the  */
+/*   header, and on a big endian host pass records through sdmrec_decode(). */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __SDMREC_H__
+#define __SDMREC_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define SDMREC_MAGIC      "SDMR"
+#define SDMREC_VERSION    1
+#define SDMREC_MAXBUSES   8
+#define SDMREC_VALUES     15
+#define SDMREC_CORRECTED  0x0001   /* Energy counter raised by --energy-guard */
+
+/* Value index in sdmrec.value[] and bit in sdmrec.fields, as shmsnap.h */
+enum {
+    SDMREC_VOLTAGE,                /* V */
+    SDMREC_CURRENT,                /* A */
+    SDMREC_POWER,                  /* W */
+    SDMREC_APOWER,                 /* VA */
+    SDMREC_RAPOWER,                /* VAR */
+    SDMREC_PFACTOR,
+    SDMREC_PANGLE,                 /* Degree */
+    SDMREC_FREQUENCY,              /* Hz */
+    SDMREC_IAENERGY,               /* kWh */
+    SDMREC_EAENERGY,
+    SDMREC_TAENERGY,
+    SDMREC_IRAENERGY,              /* kVARh */
+    SDMREC_ERAENERGY,
+    SDMREC_TRENERGY,
+    SDMREC_TIMEDISP                /* Display rotation time */
+};
+
+struct sdmrec_header {
+    char     magic[4];
+    uint16_t version;
+    uint16_t header_size;          /* sizeof(struct sdmrec_header) */
+    uint16_t record_size;          /* sizeof(struct sdmrec) */
+    uint16_t values;               /* SDMREC_VALUES */
+    uint16_t nbuses;
+    uint16_t reserved;
+    char     bus[SDMREC_MAXBUSES][32]; /* Serial device of sdmrec.bus */
+};
+
+struct sdmrec {
+    uint8_t  address;              /* Meter */
+    uint8_t  bus;                  /* Index in sdmrec_header.bus */
+    uint16_t flags;                /* SDMREC_CORRECTED */
+    uint32_t fields;               /* Values read, 1 << SDMREC_x */
+    int64_t  mono_us;              /* CLOCK_MONOTONIC of the read */
+    int64_t  wall_us;              /* CLOCK_REALTIME of the read */
+    float    value[SDMREC_VALUES];
+    uint32_t pad;
+};
+
+/*--------------------------------------------------------------------------
+    sdmrec_check
+    0 if hdr starts a stream this header decodes, else -1.
+----------------------------------------------------------------------------*/
+static inline int sdmrec_check(const struct sdmrec_header *hdr)
+{
+    return memcmp(hdr->magic, SDMREC_MAGIC, 4) == 0 && le16toh(hdr->version) == SDMREC_VERSION &&
+           le16toh(hdr->header_size) == sizeof(struct sdmrec_header) &&
+           le16toh(hdr->record_size) == sizeof(struct sdmrec) &&
+           le16toh(hdr->values) == SDMREC_VALUES ? 0 : -1;
+}
+
+/*--------------------------------------------------------------------------
+    sdmrec_encode / sdmrec_decode
+    Host order to stream order and back, no-ops on little endian hosts.
+----------------------------------------------------------------------------*/
+static inline void sdmrec_swap(struct sdmrec *rec, int to_le)
+{
+    uint32_t bits;
+    int i;
+
+    if (to_le) {
+        rec->flags   = htole16(rec->flags);
+        rec->fields  = htole32(rec->fields);
+        rec->mono_us = (int64_t)htole64((uint64_t)rec->mono_us);
+        rec->wall_us = (int64_t)htole64((uint64_t)rec->wall_us);
+    } else {
+        rec->flags   = le16toh(rec->flags);
+        rec->fields  = le32toh(rec->fields);
+        rec->mono_us = (int64_t)le64toh((uint64_t)rec->mono_us);
+        rec->wall_us = (int64_t)le64toh((uint64_t)rec->wall_us);
+    }
+    for (i=0; i < SDMREC_VALUES; i++) {
+        memcpy(&bits, &rec->value[i], 4);
+        bits = to_le ? htole32(bits) : le32toh(bits);
+        memcpy(&rec->value[i], &bits, 4);
+    }
+}
+
+static inline void sdmrec_encode(struct sdmrec *rec)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    sdmrec_swap(rec, 1);
+#endif
+}
+
+static inline void sdmrec_decode(struct sdmrec *rec)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    sdmrec_swap(rec, 0);
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __SDMREC_H__ */
@@ -0,0 +1,105 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   shmread.c                                                                */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Print the latest readings of sdm120c --shm, no bus access              */
+/*                                                                            */
+/*   Same value options and output styles as sdm120c, from the snapshot    */
+/*   file of the device. -s rejects values older than seconds, as the      */
+/*   metern poolers' is_valid() checks did on the text files.              */
+/*                                                                            */
+/*   Usage: shmread [-a address] [-vcplngofieatABCT] [-m|-q] [-s seconds]    */
+/*                  device|file                                              */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "shmsnap.h"
+#include "output.h"
+
+/*--------------------------------------------------------------------------
+    main
+----------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    const struct snap_file *snap;
+    struct snap_record rec;
+    struct timespec ts;
+    struct stat st;
+    struct out_buf out;
+    double value[SNAP_VALUES];
+    uint32_t wanted = 0, columns;
+    char *path;
+    long long now;
+    int address = 1, metern = 0, compact = 0, max_age = 0;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "a:vcplngofieatABCTmqs:")) != -1) {
+        switch (c) {
+            case 'a': address = atoi(optarg); break;
+            case 'm': metern = 1; break;
+            case 'q': compact = 1; break;
+            case 's': max_age = atoi(optarg); break;
+            case '?':
+                fprintf(stderr, "Usage: %s [-a address] [-vcplngofieatABCT] [-m|-q] [-s seconds] device|file\n", argv[0]);
+                exit(EXIT_FAILURE);
+            default:
+                for (i=0; i < SNAP_VALUES; i++) if (out_fields[i].opt == c) wanted |= 1U << i;
+        }
+    }
+    if (optind != argc - 1 || address <= 0 || address >= SNAP_METERS || max_age < 0) {
+        fprintf(stderr, "Usage: %s [-a address] [-vcplngofieatABCT] [-m|-q] [-s seconds] device|file\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // A serial device is looked up in SNAP_DIR, anything else is the file itself
+    if (stat(argv[optind], &st) == 0 && S_ISCHR(st.st_mode)) path = snap_path(argv[optind]);
+    else path = strdup(argv[optind]);
+    if ((snap = snap_map(path)) == NULL) {
+        fprintf(stderr, "%s: no snapshot in %s\n", argv[0], path);
+        free(path);
+        exit(EXIT_FAILURE);
+    }
+    free(path);
+
+    if (snap_read(snap, address, &rec) == -1 || rec.fields == 0) {
+        fprintf(stderr, "%s: no reading of meter %d\n", argv[0], address);
+        if (!metern) printf("NOK\n");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    if (max_age > 0 && now - rec.time_us > max_age * 1000000LL) {
+        fprintf(stderr, "%s: meter %d read %.1fs ago\n", argv[0], address, (now - rec.time_us) / 1e6);
+        if (!metern) printf("NOK\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // No value option: every value ever read but the display time
+    if (wanted == 0) wanted = rec.fields & ~(1U << SNAP_TIMEDISP);
+    if ((wanted & rec.fields) != wanted) {
+        fprintf(stderr, "%s: meter %d values not all polled\n", argv[0], address);
+        if (!metern) printf("NOK\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i=0; i < SNAP_VALUES; i++) value[i] = snap_value(&rec, i);
+    // --integrate energies to the mWh
+    columns = wanted;
+    if (rec.fine & wanted) columns |= OUT_INTEGRATED;
+    memset(&out, 0, sizeof(out));
+    out_sample(&out, metern ? OUT_METERN : compact ? OUT_COMPACT : OUT_VERBOSE, snap->hdr.device,
+               address, rec.time_us, value, wanted, columns);
+    out_status(&out, metern ? OUT_METERN : compact ? OUT_COMPACT : OUT_VERBOSE, 1);
+    out_flush(&out, STDOUT_FILENO);
+    out_free(&out);
+
+    snap_unmap(snap);
+    return 0;
+}
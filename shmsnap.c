@@ -0,0 +1,175 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   shmsnap.c                                                                */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Writer side of the readings snapshot file (shmsnap.h)                   */
+/*                                                                            */
+/*   Each record is a seqlock: the counter is made odd, the record written, */
+/*   then the counter made even again. Readers retry until they copied a    */
+/*   record with the same even counter before and after.                    */
+/*                                                                            */
+/* ========================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/file.h>
+
+#include "shmsnap.h"
+
+/*--------------------------------------------------------------------------
+    snap_path
+    SNAP_DIR/sdm120c.<tty>, malloc'ed.
+----------------------------------------------------------------------------*/
+char *snap_path(const char *device)
+{
+    const char *tty = strrchr(device, '/');
+    char *path;
+
+    tty = tty != NULL ? tty + 1 : device;
+    if (asprintf(&path, "%s/sdm120c.%s", SNAP_DIR, tty) == -1) return NULL;
+    return path;
+}
+
+/*--------------------------------------------------------------------------
+    snap_open
+    Map the snapshot file of device for writing, created or reset if it
+    has another layout. Called with the bus locked: a record left odd by
+    a writer that died is made even again.
+----------------------------------------------------------------------------*/
+struct snap_file *snap_open(const char *device)
+{
+    struct snap_file *snap;
+    struct stat st;
+    char *path;
+    int fd, i;
+
+    if ((path = snap_path(device)) == NULL) return NULL;
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    free(path);
+    if (fd == -1) return NULL;
+
+    // Another bus thread or process may be creating it too
+    while (flock(fd, LOCK_EX) == -1 && errno == EINTR);
+    if (fstat(fd, &st) == -1 ||
+        (st.st_size < (off_t)sizeof(*snap) && ftruncate(fd, sizeof(*snap)) == -1)) {
+        close(fd);
+        return NULL;
+    }
+    snap = mmap(NULL, sizeof(*snap), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (snap == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    if (snap->hdr.magic != SNAP_MAGIC || snap->hdr.version != SNAP_VERSION ||
+        snap->hdr.record_size != sizeof(struct snap_record)) {
+        memset(snap, 0, sizeof(*snap));
+        snap->hdr.version = SNAP_VERSION;
+        snap->hdr.meters = SNAP_METERS;
+        snap->hdr.record_size = sizeof(struct snap_record);
+        __atomic_store_n(&snap->hdr.magic, SNAP_MAGIC, __ATOMIC_RELEASE);
+    }
+    snprintf(snap->hdr.device, sizeof(snap->hdr.device), "%s", device);
+    for (i=0; i < SNAP_METERS; i++)
+        if (snap->rec[i].seq & 1) __atomic_store_n(&snap->rec[i].seq, snap->rec[i].seq + 1, __ATOMIC_RELEASE);
+
+    close(fd);
+    return snap;
+}
+
+/*--------------------------------------------------------------------------
+    snap_anon
+    Same records in process memory only, no file, for readers in other
+    threads.
+----------------------------------------------------------------------------*/
+struct snap_file *snap_anon(const char *device)
+{
+    struct snap_file *snap;
+
+    snap = mmap(NULL, sizeof(*snap), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (snap == MAP_FAILED) return NULL;
+    snap->hdr.version = SNAP_VERSION;
+    snap->hdr.meters = SNAP_METERS;
+    snap->hdr.record_size = sizeof(struct snap_record);
+    snap->hdr.magic = SNAP_MAGIC;
+    snprintf(snap->hdr.device, sizeof(snap->hdr.device), "%s", device);
+    return snap;
+}
+
+/*--------------------------------------------------------------------------
+    snap_close
+----------------------------------------------------------------------------*/
+void snap_close(struct snap_file *snap)
+{
+    if (snap != NULL) munmap(snap, sizeof(*snap));
+}
+
+/*--------------------------------------------------------------------------
+    recordBegin / recordEnd
+----------------------------------------------------------------------------*/
+static void recordBegin(struct snap_record *rec)
+{
+    __atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void recordEnd(struct snap_record *rec)
+{
+    __atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*--------------------------------------------------------------------------
+    snap_publish
+    Values of a poll, only those in fields are changed. energy_mwh, if
+    not NULL, has the exact import and export energy.
+----------------------------------------------------------------------------*/
+void snap_publish(struct snap_file *snap, int address, const float value[], uint32_t fields,
+                  const int64_t energy_mwh[2])
+{
+    struct snap_record *rec;
+    struct timespec ts;
+    int i;
+
+    if (snap == NULL || address <= 0 || address >= SNAP_METERS) return;
+    rec = &snap->rec[address];
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    recordBegin(rec);
+    for (i=0; i < SNAP_VALUES; i++)
+        if (fields & (1U << i)) rec->value[i] = value[i];
+    for (i=SNAP_IAENERGY; i <= SNAP_EAENERGY; i++) {
+        if (!(fields & (1U << i))) continue;
+        if (energy_mwh != NULL) {
+            rec->energy_mwh[i - SNAP_IAENERGY] = energy_mwh[i - SNAP_IAENERGY];
+            rec->fine |= 1U << i;
+        } else {
+            rec->fine &= ~(1U << i);
+        }
+    }
+    rec->fields |= fields;
+    rec->updated = fields;
+    rec->polls++;
+    rec->time_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    recordEnd(rec);
+}
+
+/*--------------------------------------------------------------------------
+    snap_fail
+----------------------------------------------------------------------------*/
+void snap_fail(struct snap_file *snap, int address)
+{
+    struct snap_record *rec;
+
+    if (snap == NULL || address <= 0 || address >= SNAP_METERS) return;
+    rec = &snap->rec[address];
+
+    recordBegin(rec);
+    rec->fails++;
+    recordEnd(rec);
+}
@@ -0,0 +1,161 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   shmsnap.h                                                                */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Latest readings of every meter of a bus in a memory mapped file        */
+/*                                                                            */
+/*   /run/shm/sdm120c.<tty> holds a header and one 64 byte aligned record  */
+/*   per meter address, written by sdm120c --shm after every poll. Readers  */
+/*   include this header only: snap_map() the file, then snap_read() gives  */
+/*   a consistent copy of a record without lock, fork or text parsing.     */
+/*   Writers of one bus are serialized by the bus lock.                     */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __SHMSNAP_H__
+#define __SHMSNAP_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define SNAP_DIR          "/run/shm"
+#define SNAP_MAGIC        0x50414E53   /* "SNAP" */
+#define SNAP_VERSION      1
+#define SNAP_METERS       248          /* Records by meter address, 0 unused */
+#define SNAP_MAXSPINS     10000000L    /* snap_read gives up on a record left odd */
+
+/* Values, index in snap_record.value[] and bit in fields/updated */
+enum {
+    SNAP_VOLTAGE,                  /* V */
+    SNAP_CURRENT,                  /* A */
+    SNAP_POWER,                    /* W */
+    SNAP_APOWER,                   /* VA */
+    SNAP_RAPOWER,                  /* VAR */
+    SNAP_PFACTOR,
+    SNAP_PANGLE,                   /* Degree */
+    SNAP_FREQUENCY,                /* Hz */
+    SNAP_IAENERGY,                 /* Wh */
+    SNAP_EAENERGY,
+    SNAP_TAENERGY,
+    SNAP_IRAENERGY,                /* VARh */
+    SNAP_ERAENERGY,
+    SNAP_TRENERGY,
+    SNAP_TIMEDISP,                 /* Display rotation time */
+    SNAP_VALUES
+};
+
+struct snap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t meters;
+    uint32_t record_size;
+    char     device[48];           /* Serial device of the bus */
+} __attribute__((aligned(64)));
+
+struct snap_record {
+    uint32_t seq;                  /* Odd while the record is written */
+    uint32_t fields;               /* Values ever published, 1 << SNAP_x */
+    uint32_t updated;              /* Values read by the last poll */
+    uint32_t polls;
+    uint32_t fails;                /* Polls the meter didn't answer */
+    uint32_t fine;                 /* SNAP_IAENERGY/EAENERGY bits: exact in energy_mwh */
+    int64_t  time_us;              /* Realtime of the last successful poll */
+    float    value[SNAP_VALUES];
+    int64_t  energy_mwh[2];        /* --integrate import and export, mWh */
+} __attribute__((aligned(64)));
+
+struct snap_file {
+    struct snap_header hdr;
+    struct snap_record rec[SNAP_METERS];
+};
+
+/* Writer, sdm120c */
+extern struct snap_file *snap_open(const char *device);
+extern struct snap_file *snap_anon(const char *device);
+extern void snap_close(struct snap_file *snap);
+extern void snap_publish(struct snap_file *snap, int address, const float value[], uint32_t fields,
+                         const int64_t energy_mwh[2]);
+extern void snap_fail(struct snap_file *snap, int address);
+extern char *snap_path(const char *device);
+
+/*--------------------------------------------------------------------------
+    snap_map
+    Map a snapshot file read only, NULL if missing or of another layout.
+----------------------------------------------------------------------------*/
+static inline const struct snap_file *snap_map(const char *path)
+{
+    const struct snap_file *snap;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) return NULL;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct snap_file)) {
+        close(fd);
+        return NULL;
+    }
+    snap = (const struct snap_file *)mmap(NULL, sizeof(struct snap_file), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snap == MAP_FAILED) return NULL;
+    if (snap->hdr.magic != SNAP_MAGIC || snap->hdr.version != SNAP_VERSION ||
+        snap->hdr.record_size != sizeof(struct snap_record)) {
+        munmap((void *)snap, sizeof(struct snap_file));
+        return NULL;
+    }
+    return snap;
+}
+
+static inline void snap_unmap(const struct snap_file *snap)
+{
+    munmap((void *)snap, sizeof(struct snap_file));
+}
+
+/*--------------------------------------------------------------------------
+    snap_read
+    Consistent copy of the record of a meter, retried while a write is
+    under way. 0, or -1 for a meter never published or a writer that died
+    halfway (until the next writer opens the file).
+----------------------------------------------------------------------------*/
+static inline int snap_read(const struct snap_file *snap, int address, struct snap_record *out)
+{
+    const struct snap_record *rec;
+    uint32_t seq;
+    long spins = 0;
+
+    if (address <= 0 || address >= SNAP_METERS) return -1;
+    rec = &snap->rec[address];
+    do {
+        while ((seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE)) & 1)
+            if (++spins > SNAP_MAXSPINS) return -1;
+        memcpy(out, rec, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq);
+    out->seq = seq;
+    return out->fields != 0 || out->fails != 0 ? 0 : -1;
+}
+
+/*--------------------------------------------------------------------------
+    snap_value
+    A value of a record copy, the exact --integrate counters if there.
+----------------------------------------------------------------------------*/
+static inline double snap_value(const struct snap_record *rec, int i)
+{
+    if ((i == SNAP_IAENERGY || i == SNAP_EAENERGY) && (rec->fine & (1U << i)))
+        return rec->energy_mwh[i - SNAP_IAENERGY] / 1000.0;
+    return rec->value[i];
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __SHMSNAP_H__ */
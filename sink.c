@@ -0,0 +1,163 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   sink.c                                                                   */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Destinations of the spooled output: stdout, a TCP stream or MQTT       */
+/*                                                                            */
+/*   A sink opens, sends one record at a time and closes; any failure      */
+/*   makes the spool drain close it and open it again after a backoff.     */
+/*   "-" is stdout, "tcp://host:port" (or host:port) a TCP connection the   */
+/*   output is streamed on as it would be printed, i.e. influx line        */
+/*   protocol to a Telegraf socket_listener. "mqtt://..." publishes json     */
+/*   to a broker, see mqtt.h.                                               */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "sink.h"
+#include "mqtt.h"
+
+/*--------------------------------------------------------------------------
+    sink_write
+----------------------------------------------------------------------------*/
+int sink_write(int fd, const void *data, size_t len, int socket)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (len > 0) {
+        n = socket ? send(fd, p, len, MSG_NOSIGNAL) : write(fd, p, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    stdout sink
+----------------------------------------------------------------------------*/
+static int stdoutOpen(struct sink *s)
+{
+    s->fd = STDOUT_FILENO;
+    return 0;
+}
+
+static int stdoutSend(struct sink *s, const void *data, size_t len)
+{
+    return sink_write(s->fd, data, len, 0);
+}
+
+static void stdoutClose(struct sink *s)
+{
+    s->fd = -1;
+}
+
+/*--------------------------------------------------------------------------
+    tcp sink
+    sink_tcp_open also connects the MQTT sink.
+----------------------------------------------------------------------------*/
+int sink_tcp_open(struct sink *s)
+{
+    struct addrinfo hints, *res, *ai;
+    struct timeval tv = { SINK_TIMEOUT, 0 };
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(s->host, s->port, &hints, &res)) != 0) {
+        errno = rc == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((s->fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) continue;
+        setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(s->fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(s->fd);
+        s->fd = -1;
+    }
+    freeaddrinfo(res);
+    return s->fd == -1 ? -1 : 0;
+}
+
+static int tcpSend(struct sink *s, const void *data, size_t len)
+{
+    return sink_write(s->fd, data, len, 1);
+}
+
+static void tcpClose(struct sink *s)
+{
+    if (s->fd != -1) close(s->fd);
+    s->fd = -1;
+}
+
+/*--------------------------------------------------------------------------
+    sink_new
+    Sink of spec, NULL and errno EINVAL if not one.
+----------------------------------------------------------------------------*/
+struct sink *sink_new(const char *spec)
+{
+    struct sink *s;
+    const char *hp = spec, *colon;
+
+    if ((s = calloc(1, sizeof(*s))) == NULL) return NULL;
+    s->fd = -1;
+    s->spec = strdup(spec);
+
+    if (strcmp(spec, "-") == 0) {
+        s->open  = stdoutOpen;
+        s->send  = stdoutSend;
+        s->close = stdoutClose;
+        return s;
+    }
+
+    if (strncmp(spec, "mqtt://", 7) == 0) {
+        if (mqtt_sink(s, spec + 7) == -1) {
+            sink_free(s);
+            errno = EINVAL;
+            return NULL;
+        }
+        return s;
+    }
+
+    if (strncmp(hp, "tcp://", 6) == 0) hp += 6;
+    if ((colon = strrchr(hp, ':')) == NULL || colon == hp || colon[1] == '\0' || strstr(hp, "://") != NULL) {
+        sink_free(s);
+        errno = EINVAL;
+        return NULL;
+    }
+    // [v6 address]:port
+    if (hp[0] == '[' && colon[-1] == ']') s->host = strndup(hp + 1, colon - hp - 2);
+    else s->host = strndup(hp, colon - hp);
+    s->port  = strdup(colon + 1);
+    s->open  = sink_tcp_open;
+    s->send  = tcpSend;
+    s->close = tcpClose;
+    return s;
+}
+
+/*--------------------------------------------------------------------------
+    sink_free
+----------------------------------------------------------------------------*/
+void sink_free(struct sink *s)
+{
+    if (s == NULL) return;
+    if (s->fd != -1 && s->close != NULL) s->close(s);
+    free(s->spec);
+    free(s->host);
+    free(s->port);
+    free(s->priv);
+    free(s);
+}
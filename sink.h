@@ -0,0 +1,45 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   sink.h                                                                   */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Destinations of the spooled output: stdout, a TCP stream or MQTT       */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __SINK_H__
+#define __SINK_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define SINK_TIMEOUT      10       /* s, TCP connect and send */
+
+struct sink {
+    char *spec;
+    int   fd;                      /* -1 = not connected */
+    char *host;
+    char *port;
+    int  (*open)(struct sink *s);
+    int  (*send)(struct sink *s, const void *data, size_t len);
+    void (*close)(struct sink *s);
+    int  (*tick)(struct sink *s);  /* Optional, every second while open and idle,
+                                      -1 closes the sink */
+    void *priv;                    /* Of the sink type, freed with it */
+    int   json;                    /* Takes --format json records only */
+};
+
+extern struct sink *sink_new(const char *spec);
+extern void         sink_free(struct sink *s);
+extern int          sink_tcp_open(struct sink *s);
+extern int          sink_write(int fd, const void *data, size_t len, int socket);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __SINK_H__ */
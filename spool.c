@@ -0,0 +1,395 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   spool.c                                                                  */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Store and forward ring of output records, drained to a sink           */
+/*                                                                            */
+/*   The pollers append each poll output as a record to a mapped ring and  */
+/*   go on; a drain thread sends the records to the sink one at a time and  */
+/*   moves the tail past a record only once it is sent, so a sink down or   */
+/*   slow costs ring space, never bus time. A full ring drops its oldest   */
+/*   records. In a file the ring survives restarts: it is synced every      */
+/*   SPOOL_SYNCPERIOD, and reopening checks the CRC of every record left,  */
+/*   dropping a torn end. Delivery is at least once, a record sent just     */
+/*   before a crash may be sent again.                                       */
+/*                                                                            */
+/* ========================================================================== */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+
+#define SPOOL_PAGE        4096
+#define RECSIZE(len)      (sizeof(struct spool_rec) + (((len) + 7) & ~(size_t)7))
+
+struct spool {
+    int fd;                        /* -1 = in memory */
+    struct spool_header *hdr;
+    uint8_t *ring;
+    size_t map_size;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int stop;
+    struct timespec deadline;      /* Drain until, once stopped */
+    struct sink *sink;
+    void *preamble;                /* Sent first on every sink open */
+    size_t preamble_len;
+    spool_log_fn log;
+    int debug;
+};
+
+/*--------------------------------------------------------------------------
+    crc32
+----------------------------------------------------------------------------*/
+static uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc)
+{
+    int k;
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (k=0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+/*--------------------------------------------------------------------------
+    ringCopy / ringPut
+    len bytes at ring position pos, wrapping around.
+----------------------------------------------------------------------------*/
+static void ringCopy(const struct spool *sp, uint64_t pos, void *dest, size_t len)
+{
+    size_t off = pos % sp->hdr->size, first = len;
+
+    if (first > sp->hdr->size - off) first = sp->hdr->size - off;
+    memcpy(dest, sp->ring + off, first);
+    memcpy((uint8_t *)dest + first, sp->ring, len - first);
+}
+
+static void ringPut(struct spool *sp, uint64_t pos, const void *src, size_t len)
+{
+    size_t off = pos % sp->hdr->size, first = len;
+
+    if (first > sp->hdr->size - off) first = sp->hdr->size - off;
+    memcpy(sp->ring + off, src, first);
+    memcpy(sp->ring, (const uint8_t *)src + first, len - first);
+}
+
+/*--------------------------------------------------------------------------
+    recover
+    Keep the records from the tail up to the first one not whole.
+----------------------------------------------------------------------------*/
+static void recover(struct spool *sp)
+{
+    struct spool_header *h = sp->hdr;
+    struct spool_rec rec;
+    uint64_t pos;
+    uint8_t *data;
+
+    if ((h->tail & 7) || h->tail > h->head || h->head - h->tail > h->size) h->tail = h->head = 0;
+    for (pos = h->tail; pos < h->head; pos += RECSIZE(rec.len)) {
+        ringCopy(sp, pos, &rec, sizeof(rec));
+        if (rec.len == 0 || RECSIZE(rec.len) > h->head - pos) break;
+        if ((data = malloc(rec.len)) == NULL) break;
+        ringCopy(sp, pos + sizeof(rec), data, rec.len);
+        if (crc32(data, rec.len, 0) != rec.crc) {
+            free(data);
+            break;
+        }
+        free(data);
+    }
+    h->head = pos;
+}
+
+/*--------------------------------------------------------------------------
+    spool_open
+    Ring in path, size bytes if created, else in memory (path NULL).
+    NULL and errno on failure, EWOULDBLOCK if another process has path.
+----------------------------------------------------------------------------*/
+struct spool *spool_open(const char *path, size_t size)
+{
+    struct spool *sp;
+    struct stat st;
+    int fresh = 1, errno_save;
+
+    size &= ~(size_t)7;
+    if ((sp = calloc(1, sizeof(*sp))) == NULL) return NULL;
+    sp->fd = -1;
+    pthread_mutex_init(&sp->mutex, NULL);
+    pthread_cond_init(&sp->cond, NULL);
+
+    if (path == NULL) {
+        sp->map_size = SPOOL_PAGE + size;
+        sp->hdr = mmap(NULL, sp->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    } else {
+        if ((sp->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) goto fail;
+        if (flock(sp->fd, LOCK_EX | LOCK_NB) == -1 || fstat(sp->fd, &st) == -1) goto fail;
+        if (st.st_size >= SPOOL_PAGE) {
+            struct spool_header h;
+
+            // An existing ring keeps its size, and its records
+            if (pread(sp->fd, &h, sizeof(h), 0) == sizeof(h) && memcmp(h.magic, SPOOL_MAGIC, 4) == 0 &&
+                h.version == SPOOL_VERSION && h.size > 0 && (h.size & 7) == 0 &&
+                (off_t)(SPOOL_PAGE + h.size) <= st.st_size) {
+                size = h.size;
+                fresh = 0;
+            }
+        }
+        sp->map_size = SPOOL_PAGE + size;
+        if (fresh && ftruncate(sp->fd, 0) == -1) goto fail;
+        if (ftruncate(sp->fd, sp->map_size) == -1) goto fail;
+        sp->hdr = mmap(NULL, sp->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, sp->fd, 0);
+    }
+    if (sp->hdr == MAP_FAILED) {
+        sp->hdr = NULL;
+        goto fail;
+    }
+    sp->ring = (uint8_t *)sp->hdr + SPOOL_PAGE;
+
+    if (fresh) {
+        memset(sp->hdr, 0, sizeof(*sp->hdr));
+        sp->hdr->version = SPOOL_VERSION;
+        sp->hdr->size = size;
+        memcpy(sp->hdr->magic, SPOOL_MAGIC, 4);
+    } else {
+        recover(sp);
+    }
+    return sp;
+
+fail:
+    errno_save = errno;
+    spool_close(sp, 0);
+    errno = errno_save;
+    return NULL;
+}
+
+/*--------------------------------------------------------------------------
+    spool_append
+    Add a record, dropping the oldest ones if the ring is full. Never
+    waits for the drain. -1 and EMSGSIZE if len can't fit the ring.
+----------------------------------------------------------------------------*/
+int spool_append(struct spool *sp, const void *data, size_t len)
+{
+    struct spool_header *h = sp->hdr;
+    struct spool_rec rec;
+
+    if (len == 0) return 0;
+    if (RECSIZE(len) > h->size || len > UINT32_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    rec.len = len;
+    rec.crc = crc32(data, len, 0);
+
+    pthread_mutex_lock(&sp->mutex);
+    while (h->head + RECSIZE(len) - h->tail > h->size) {
+        struct spool_rec old;
+
+        ringCopy(sp, h->tail, &old, sizeof(old));
+        h->tail += RECSIZE(old.len);
+        h->dropped++;
+    }
+    ringPut(sp, h->head, &rec, sizeof(rec));
+    ringPut(sp, h->head + sizeof(rec), data, len);
+    __atomic_store_n(&h->head, h->head + RECSIZE(len), __ATOMIC_RELEASE);
+    h->records++;
+    pthread_cond_signal(&sp->cond);
+    pthread_mutex_unlock(&sp->mutex);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    pauseLocked
+    Wait s seconds or until stopped. Called with the mutex held.
+----------------------------------------------------------------------------*/
+static void pauseLocked(struct spool *sp, int s)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += s;
+    while (!sp->stop && pthread_cond_timedwait(&sp->cond, &sp->mutex, &ts) != ETIMEDOUT);
+}
+
+/*--------------------------------------------------------------------------
+    syncFile
+----------------------------------------------------------------------------*/
+static void syncFile(struct spool *sp)
+{
+    if (sp->fd != -1) msync(sp->hdr, sp->map_size, MS_SYNC);
+}
+
+/*--------------------------------------------------------------------------
+    syncDue
+    syncFile every SPOOL_SYNCPERIOD, idle, sending or backing off alike.
+    Called with the mutex held.
+----------------------------------------------------------------------------*/
+static void syncDue(struct spool *sp, time_t *synced)
+{
+    if (time(NULL) - *synced < SPOOL_SYNCPERIOD) return;
+    pthread_mutex_unlock(&sp->mutex);
+    syncFile(sp);
+    pthread_mutex_lock(&sp->mutex);
+    *synced = time(NULL);
+}
+
+/*--------------------------------------------------------------------------
+    drainThread
+----------------------------------------------------------------------------*/
+static void *drainThread(void *arg)
+{
+    struct spool *sp = arg;
+    struct spool_header *h = sp->hdr;
+    struct spool_rec rec;
+    struct timespec ts, now;
+    uint8_t *buf = NULL;
+    size_t bufsize = 0;
+    uint64_t pos;
+    time_t synced = time(NULL);
+    int backoff = 1, failing = 0;
+
+    pthread_mutex_lock(&sp->mutex);
+    for (;;) {
+        syncDue(sp, &synced);
+        while (!sp->stop && h->tail == h->head) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&sp->cond, &sp->mutex, &ts);
+            syncDue(sp, &synced);
+            if (sp->sink->tick != NULL && sp->sink->fd != -1 && h->tail == h->head) {
+                // Keep the connection up between polls, i.e. MQTT keepalive
+                pthread_mutex_unlock(&sp->mutex);
+                if (sp->sink->tick(sp->sink) == -1) sp->sink->close(sp->sink);
+                pthread_mutex_lock(&sp->mutex);
+            }
+        }
+        if (sp->stop) {
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (h->tail == h->head || failing || now.tv_sec > sp->deadline.tv_sec ||
+                (now.tv_sec == sp->deadline.tv_sec && now.tv_nsec >= sp->deadline.tv_nsec)) break;
+        }
+
+        // Copy the oldest record out, the pollers may overwrite it meanwhile
+        pos = h->tail;
+        ringCopy(sp, pos, &rec, sizeof(rec));
+        if (rec.len > bufsize) {
+            uint8_t *p = realloc(buf, rec.len);
+
+            if (p == NULL) break;
+            buf = p;
+            bufsize = rec.len;
+        }
+        ringCopy(sp, pos + sizeof(rec), buf, rec.len);
+        pthread_mutex_unlock(&sp->mutex);
+
+        if (sp->sink->fd == -1 && (sp->sink->open(sp->sink) == -1 ||
+            (sp->preamble_len && sp->sink->send(sp->sink, sp->preamble, sp->preamble_len) == -1))) {
+            if (!failing) sp->log(sp->debug | SPOOL_LOG_SYSLOG, "Sink %s unavailable: (%d) %s, spooling", sp->sink->spec, errno, strerror(errno));
+            sp->sink->close(sp->sink);
+            failing = 1;
+        } else if (sp->sink->send(sp->sink, buf, rec.len) == -1) {
+            if (!failing) sp->log(sp->debug | SPOOL_LOG_SYSLOG, "Sink %s failed: (%d) %s, spooling", sp->sink->spec, errno, strerror(errno));
+            sp->sink->close(sp->sink);
+            failing = 1;
+        } else {
+            if (failing) sp->log(sp->debug | SPOOL_LOG_SYSLOG, "Sink %s back", sp->sink->spec);
+            failing = 0;
+            backoff = 1;
+        }
+
+        pthread_mutex_lock(&sp->mutex);
+        if (failing) {
+            pauseLocked(sp, backoff);
+            if (backoff < SPOOL_MAXBACKOFF) backoff *= 2;
+            if (backoff > SPOOL_MAXBACKOFF) backoff = SPOOL_MAXBACKOFF;
+        } else if (h->tail == pos) {
+            // Sent, unless dropped by a full ring meanwhile
+            __atomic_store_n(&h->tail, pos + RECSIZE(rec.len), __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&sp->mutex);
+    free(buf);
+    return NULL;
+}
+
+/*--------------------------------------------------------------------------
+    spool_start
+    Drain to sink from a thread with every signal blocked. preamble (the
+    csv or binary stream header) is sent first on every sink open. log is
+    called as log(bits, format, ...), debug or'ed into the bits.
+----------------------------------------------------------------------------*/
+int spool_start(struct spool *sp, struct sink *sink, const void *preamble, size_t len,
+                spool_log_fn log, int debug)
+{
+    sigset_t all, saved;
+    int rc;
+
+    sp->sink = sink;
+    sp->log = log;
+    sp->debug = debug;
+    if (len > 0) {
+        if ((sp->preamble = malloc(len)) == NULL) return -1;
+        memcpy(sp->preamble, preamble, len);
+        sp->preamble_len = len;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    rc = pthread_create(&sp->thread, NULL, drainThread, sp);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    sp->running = 1;
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    spool_close
+    Give the drain up to wait_s to empty the ring, then stop it. A spool
+    file keeps what is left for the next run.
+----------------------------------------------------------------------------*/
+void spool_close(struct spool *sp, int wait_s)
+{
+    if (sp == NULL) return;
+    if (sp->running) {
+        pthread_mutex_lock(&sp->mutex);
+        clock_gettime(CLOCK_REALTIME, &sp->deadline);
+        sp->deadline.tv_sec += wait_s;
+        sp->stop = 1;
+        pthread_cond_broadcast(&sp->cond);
+        pthread_mutex_unlock(&sp->mutex);
+        // A sink stuck in a send past the wait is abandoned
+        sp->deadline.tv_sec += 1;
+        if (pthread_timedjoin_np(sp->thread, NULL, &sp->deadline) == ETIMEDOUT) {
+            pthread_cancel(sp->thread);
+            pthread_join(sp->thread, NULL);
+        }
+    }
+    if (sp->hdr != NULL) {
+        syncFile(sp);
+        munmap(sp->hdr, sp->map_size);
+    }
+    if (sp->fd != -1) close(sp->fd);
+    pthread_mutex_destroy(&sp->mutex);
+    pthread_cond_destroy(&sp->cond);
+    free(sp->preamble);
+    free(sp);
+}
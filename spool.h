@@ -0,0 +1,62 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   spool.h                                                                  */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Store and forward ring of output records, drained to a sink           */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sink.h"
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define SPOOL_MAGIC       "SDSP"
+#define SPOOL_VERSION     1
+#define SPOOL_SIZE        4096     /* KiB of ring by default */
+#define SPOOL_SYNCPERIOD  5        /* s between syncs of a spool file */
+#define SPOOL_MAXBACKOFF  60       /* s, sink retry delay doubles up to this */
+#define SPOOL_DRAINWAIT   2        /* s left to the drain at exit */
+#define SPOOL_LOG_SYSLOG  2        /* log() bit of sink state changes, as DEBUG_SYSLOG */
+
+/* Page 0 of a spool file, the ring follows */
+struct spool_header {
+    char     magic[4];
+    uint32_t version;
+    uint64_t size;                 /* Ring bytes */
+    uint64_t head;                 /* Bytes ever appended */
+    uint64_t tail;                 /* Bytes ever forwarded or dropped */
+    uint64_t records;              /* Records ever appended */
+    uint64_t dropped;              /* Records dropped unsent, ring full */
+};
+
+/* Record in the ring, 8 byte aligned, data may wrap around */
+struct spool_rec {
+    uint32_t len;
+    uint32_t crc;                  /* CRC-32 of the data */
+};
+
+typedef void (*spool_log_fn)(const int log, const char *format, ...);
+
+struct spool;
+
+extern struct spool *spool_open(const char *path, size_t size);
+extern int  spool_append(struct spool *sp, const void *data, size_t len);
+extern int  spool_start(struct spool *sp, struct sink *sink, const void *preamble, size_t len,
+                        spool_log_fn log, int debug);
+extern void spool_close(struct spool *sp, int wait_s);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __SPOOL_H__ */
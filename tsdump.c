@@ -0,0 +1,94 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   tsdump.c                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Print a time range of sdm120c --store files                            */
+/*                                                                            */
+/*   One "time_ms,bus,meter,value,reading" line per sample, series after   */
+/*   series, values exactly as stored (energies in kWh). -S prints         */
+/*   the size per sample of every file instead.                             */
+/*                                                                            */
+/*   Usage: tsdump [-vcplngofieatABCT] [-s from] [-e to] [-S] file...        */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "shmsnap.h"
+#include "output.h"
+#include "tstore.h"
+
+struct dump {
+    const struct ts_header *hdr;
+    struct out_buf out;
+};
+
+/*--------------------------------------------------------------------------
+    printSample
+----------------------------------------------------------------------------*/
+static int printSample(void *arg, int series, int64_t time_ms, float value)
+{
+    struct dump *d = arg;
+
+    out_printf(&d->out, "%lld,%s,%d,%s,%.9g\n", (long long)time_ms, d->hdr->bus, d->hdr->address,
+               series < SNAP_VALUES ? out_fields[series].name : "?", value);
+    if (d->out.len >= 65536) out_flush(&d->out, STDOUT_FILENO);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-vcplngofieatABCT] [-s from] [-e to] [-S] file...\n", prog);
+    fprintf(stderr, "  from and to in seconds since the epoch, -S size per sample\n");
+    exit(EXIT_FAILURE);
+}
+
+/*--------------------------------------------------------------------------
+    main
+----------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    struct ts_header hdr;
+    struct ts_stats st;
+    struct dump d;
+    uint32_t wanted = 0;
+    int64_t from_ms = INT64_MIN, to_ms = INT64_MAX;
+    int stats = 0, rc = 0;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "vcplngofieatABCTs:e:S")) != -1) {
+        switch (c) {
+            case 's': from_ms = atoll(optarg) * 1000LL; break;
+            case 'e': to_ms = atoll(optarg) * 1000LL + 999; break;
+            case 'S': stats = 1; break;
+            case '?': usage(argv[0]);
+            default:
+                for (i=0; i < SNAP_VALUES; i++) if (out_fields[i].opt == c) wanted |= 1U << i;
+        }
+    }
+    if (optind >= argc) usage(argv[0]);
+    if (wanted == 0) wanted = (1U << TS_SERIES) - 1;
+
+    memset(&d, 0, sizeof(d));
+    d.hdr = &hdr;
+    for (i=optind; i < argc; i++) {
+        if (ts_scan(argv[i], wanted, from_ms, to_ms, stats ? NULL : printSample, &d, &hdr, &st) == -1) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], errno == EINVAL ? "not a store file" : strerror(errno));
+            rc = EXIT_FAILURE;
+            continue;
+        }
+        if (stats)
+            out_printf(&d.out, "%s: %s meter %d day %d, %llu samples in %u blocks, %llu bytes, %.2f bytes/sample\n",
+                       argv[i], hdr.bus, hdr.address, hdr.day, (unsigned long long)st.samples, st.blocks,
+                       (unsigned long long)st.bytes, st.samples ? (double)st.bytes / st.samples : 0.0);
+    }
+    out_flush(&d.out, STDOUT_FILENO);
+    out_free(&d.out);
+    return rc;
+}
@@ -0,0 +1,438 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   tstore.c                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Compressed time series of the values of one meter, one file a day     */
+/*                                                                            */
+/*   Timestamps (ms): the delta of delta to the previous sample as '0',     */
+/*   '10'+7, '110'+9, '1110'+12 or '1111'+32 bits. Values: XOR with the     */
+/*   previous float32 as '0' when equal, '10'+bits in the previous window   */
+/*   of meaningful bits, or '11'+5 bits leading zeros+5 bits length+bits.  */
+/*   A sample is committed by storing the new block bit length last: after  */
+/*   a crash the block is decoded up to it and stale bits past it cleared.  */
+/*   Pages are left to the kernel writeback, only a full block or the       */
+/*   close is msync'ed, so an SD card sees few writes.                      */
+/*                                                                            */
+/* ========================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tstore.h"
+
+#define DATABITS          (sizeof(((struct ts_block *)0)->data) * 8)
+
+struct ts_file {
+    int fd;
+    struct ts_header *hdr;         /* Mapped header page */
+    struct ts_block *cur[TS_SERIES];   /* Block appended to, per series */
+    struct ts_cursor cursor[TS_SERIES];
+};
+
+_Static_assert(sizeof(struct ts_block) == TS_BLOCK, "ts_block is not a block");
+_Static_assert(sizeof(struct ts_header) <= TS_BLOCK, "ts_header over a page");
+
+/*--------------------------------------------------------------------------
+    putBits / getBits
+    MSB first. getBits returns -1 past nbits.
+----------------------------------------------------------------------------*/
+static void putBits(uint8_t *data, uint32_t *pos, uint64_t value, int n)
+{
+    while (n-- > 0) {
+        if ((value >> n) & 1) data[*pos >> 3] |= 0x80 >> (*pos & 7);
+        (*pos)++;
+    }
+}
+
+static int getBits(const uint8_t *data, uint32_t *pos, uint32_t nbits, int n, uint64_t *value)
+{
+    if (*pos + n > nbits) return -1;
+    *value = 0;
+    while (n-- > 0) {
+        *value = (*value << 1) | ((data[*pos >> 3] >> (7 - (*pos & 7))) & 1);
+        (*pos)++;
+    }
+    return 0;
+}
+
+/* n bit two's complement field */
+static int64_t signExtend(uint64_t v, int n)
+{
+    return v & (1ULL << (n - 1)) ? (int64_t)v - (1LL << n) : (int64_t)v;
+}
+
+static uint32_t floatBits(float value)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &value, 4);
+    return bits;
+}
+
+static float bitsFloat(uint32_t bits)
+{
+    float value;
+
+    memcpy(&value, &bits, 4);
+    return value;
+}
+
+/*--------------------------------------------------------------------------
+    cursorStart
+    State after the first sample of a block.
+----------------------------------------------------------------------------*/
+static void cursorStart(struct ts_cursor *c, const struct ts_block *blk)
+{
+    c->pos        = 0;
+    c->last_ms    = blk->first_ms;
+    c->last_delta = 0;
+    c->last_bits  = floatBits(blk->first_value);
+    c->lead       = 32;
+    c->trail      = 0;
+}
+
+/*--------------------------------------------------------------------------
+    encode
+----------------------------------------------------------------------------*/
+static void encode(uint8_t *data, struct ts_cursor *c, int64_t time_ms, uint32_t bits)
+{
+    int64_t delta = time_ms - c->last_ms;
+    int64_t dod = delta - c->last_delta;
+    uint32_t x = bits ^ c->last_bits;
+    int lead, trail, len;
+
+    if (dod == 0) {
+        putBits(data, &c->pos, 0, 1);
+    } else if (dod >= -64 && dod <= 63) {
+        putBits(data, &c->pos, 2, 2);
+        putBits(data, &c->pos, dod & 0x7f, 7);
+    } else if (dod >= -256 && dod <= 255) {
+        putBits(data, &c->pos, 6, 3);
+        putBits(data, &c->pos, dod & 0x1ff, 9);
+    } else if (dod >= -2048 && dod <= 2047) {
+        putBits(data, &c->pos, 14, 4);
+        putBits(data, &c->pos, dod & 0xfff, 12);
+    } else {
+        putBits(data, &c->pos, 15, 4);
+        putBits(data, &c->pos, (uint32_t)dod, 32);
+    }
+    c->last_delta = delta;
+    c->last_ms = time_ms;
+
+    if (x == 0) {
+        putBits(data, &c->pos, 0, 1);
+        return;
+    }
+    lead = __builtin_clz(x);
+    trail = __builtin_ctz(x);
+    if (c->lead < 32 && lead >= c->lead && trail >= c->trail) {
+        putBits(data, &c->pos, 2, 2);
+        putBits(data, &c->pos, x >> c->trail, 32 - c->lead - c->trail);
+    } else {
+        len = 32 - lead - trail;
+        putBits(data, &c->pos, 3, 2);
+        putBits(data, &c->pos, lead, 5);
+        putBits(data, &c->pos, len - 1, 5);
+        putBits(data, &c->pos, x >> trail, len);
+        c->lead = lead;
+        c->trail = trail;
+    }
+    c->last_bits = bits;
+}
+
+/*--------------------------------------------------------------------------
+    decode
+    Next sample of a block, -1 at nbits or on a truncated sample.
+----------------------------------------------------------------------------*/
+static int decode(const uint8_t *data, uint32_t nbits, struct ts_cursor *c, int64_t *time_ms, float *value)
+{
+    static const struct { int width; } dods[4] = { {7}, {9}, {12}, {32} };
+    uint32_t pos = c->pos;
+    uint64_t v, bit;
+    int64_t dod = 0;
+    int i, lead, len;
+
+    for (i=0; i < 4; i++) {
+        if (getBits(data, &pos, nbits, 1, &bit) == -1) return -1;
+        if (!bit) break;
+    }
+    if (i > 0) {
+        if (getBits(data, &pos, nbits, dods[i-1].width, &v) == -1) return -1;
+        dod = signExtend(v, dods[i-1].width);
+    }
+
+    if (getBits(data, &pos, nbits, 1, &bit) == -1) return -1;
+    if (bit) {
+        if (getBits(data, &pos, nbits, 1, &bit) == -1) return -1;
+        if (bit) {
+            if (getBits(data, &pos, nbits, 5, &v) == -1) return -1;
+            lead = v;
+            if (getBits(data, &pos, nbits, 5, &v) == -1) return -1;
+            len = v + 1;
+            if (lead + len > 32) return -1;
+            c->lead = lead;
+            c->trail = 32 - lead - len;
+        } else if (c->lead >= 32) {
+            return -1;
+        }
+        if (getBits(data, &pos, nbits, 32 - c->lead - c->trail, &v) == -1) return -1;
+        c->last_bits ^= (uint32_t)v << c->trail;
+    }
+
+    c->last_delta += dod;
+    c->last_ms += c->last_delta;
+    c->pos = pos;
+    *time_ms = c->last_ms;
+    *value = bitsFloat(c->last_bits);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    mapBlock
+    Block i after the header page.
+----------------------------------------------------------------------------*/
+static struct ts_block *mapBlock(int fd, uint32_t i)
+{
+    struct ts_block *blk;
+
+    blk = mmap(NULL, TS_BLOCK, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)TS_BLOCK * (i + 1));
+    return blk == MAP_FAILED ? NULL : blk;
+}
+
+/*--------------------------------------------------------------------------
+    resume
+    Cursor at the end of the block a writer left, stale bits cleared.
+----------------------------------------------------------------------------*/
+static void resume(struct ts_block *blk, struct ts_cursor *c)
+{
+    uint32_t count = 1;
+    int64_t t;
+    float v;
+
+    cursorStart(c, blk);
+    if (blk->nbits > DATABITS) blk->nbits = 0;
+    while (decode(blk->data, blk->nbits, c, &t, &v) == 0) count++;
+    blk->nbits = c->pos;
+    blk->count = count;
+    if (c->pos & 7) blk->data[c->pos >> 3] &= 0xff00 >> (c->pos & 7);
+    memset(blk->data + (c->pos + 7) / 8, 0, sizeof(blk->data) - (c->pos + 7) / 8);
+}
+
+/*--------------------------------------------------------------------------
+    ts_open
+    Open or create the file of a meter and day, ready to append to the
+    last block of every series. NULL and errno on failure, EWOULDBLOCK if
+    another writer has it.
+----------------------------------------------------------------------------*/
+struct ts_file *ts_open(const char *path, const char *bus, int address, int32_t day)
+{
+    struct ts_file *f;
+    struct stat st;
+    struct ts_block *blocks;
+    int32_t last[TS_SERIES];
+    uint32_t i;
+    int s, errno_save;
+
+    if ((f = calloc(1, sizeof(*f))) == NULL) return NULL;
+    if ((f->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) goto fail;
+    if (flock(f->fd, LOCK_EX | LOCK_NB) == -1 || fstat(f->fd, &st) == -1) goto fail;
+    if (st.st_size < TS_BLOCK && ftruncate(f->fd, TS_BLOCK) == -1) goto fail;
+
+    f->hdr = mmap(NULL, TS_BLOCK, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+    if (f->hdr == MAP_FAILED) {
+        f->hdr = NULL;
+        goto fail;
+    }
+    if (st.st_size < TS_BLOCK) {
+        f->hdr->version    = TS_VERSION;
+        f->hdr->block_size = TS_BLOCK;
+        f->hdr->address    = address;
+        f->hdr->day        = day;
+        snprintf(f->hdr->bus, sizeof(f->hdr->bus), "%s", bus);
+        memcpy(f->hdr->magic, TS_MAGIC, 4);
+    } else if (memcmp(f->hdr->magic, TS_MAGIC, 4) != 0 || f->hdr->version != TS_VERSION ||
+               f->hdr->block_size != TS_BLOCK) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    // Last block of every series, blocks past the file end never written
+    for (s=0; s < TS_SERIES; s++) last[s] = -1;
+    if ((off_t)TS_BLOCK * (f->hdr->nblocks + 1) > st.st_size)
+        f->hdr->nblocks = st.st_size > TS_BLOCK ? st.st_size / TS_BLOCK - 1 : 0;
+    if (f->hdr->nblocks > 0) {
+        blocks = mmap(NULL, (size_t)TS_BLOCK * f->hdr->nblocks, PROT_READ, MAP_SHARED, f->fd, TS_BLOCK);
+        if (blocks == MAP_FAILED) goto fail;
+        for (i=0; i < f->hdr->nblocks; i++)
+            if (blocks[i].count > 0 && blocks[i].series < TS_SERIES) last[blocks[i].series] = i;
+        munmap(blocks, (size_t)TS_BLOCK * f->hdr->nblocks);
+    }
+    for (s=0; s < TS_SERIES; s++) {
+        if (last[s] < 0) continue;
+        if ((f->cur[s] = mapBlock(f->fd, last[s])) == NULL) goto fail;
+        resume(f->cur[s], &f->cursor[s]);
+    }
+    return f;
+
+fail:
+    errno_save = errno;
+    ts_close(f);
+    errno = errno_save;
+    return NULL;
+}
+
+/*--------------------------------------------------------------------------
+    newBlock
+    Next free block for a series, zeroed. The file grows a block at a time.
+----------------------------------------------------------------------------*/
+static struct ts_block *newBlock(struct ts_file *f, int series)
+{
+    struct ts_block *blk;
+    struct stat st;
+    uint32_t i = f->hdr->nblocks;
+
+    if (fstat(f->fd, &st) == -1) return NULL;
+    if (st.st_size < (off_t)TS_BLOCK * (i + 2) && ftruncate(f->fd, (off_t)TS_BLOCK * (i + 2)) == -1) return NULL;
+    if ((blk = mapBlock(f->fd, i)) == NULL) return NULL;
+    memset(blk, 0, TS_BLOCK);
+    blk->series = series;
+    __atomic_store_n(&f->hdr->nblocks, i + 1, __ATOMIC_RELEASE);
+    return blk;
+}
+
+/*--------------------------------------------------------------------------
+    ts_append
+    Add a sample to a series, times not before the last one are moved to
+    it. 0, or -1 and errno if the file can't grow.
+----------------------------------------------------------------------------*/
+int ts_append(struct ts_file *f, int series, int64_t time_ms, float value)
+{
+    struct ts_block *blk;
+    struct ts_cursor *c;
+
+    if (series < 0 || series >= TS_SERIES) {
+        errno = EINVAL;
+        return -1;
+    }
+    blk = f->cur[series];
+    c = &f->cursor[series];
+
+    if (blk == NULL || c->pos + TS_MAXBITS > DATABITS) {
+        if (blk != NULL) {
+            msync(blk, TS_BLOCK, MS_ASYNC);
+            munmap(blk, TS_BLOCK);
+            f->cur[series] = NULL;
+        }
+        if ((blk = newBlock(f, series)) == NULL) return -1;
+        f->cur[series] = blk;
+        blk->first_ms = time_ms;
+        blk->first_value = value;
+        __atomic_store_n(&blk->count, 1, __ATOMIC_RELEASE);
+        cursorStart(c, blk);
+        return 0;
+    }
+
+    if (time_ms < c->last_ms) time_ms = c->last_ms;
+    encode(blk->data, c, time_ms, floatBits(value));
+    __atomic_store_n(&blk->nbits, c->pos, __ATOMIC_RELEASE);
+    __atomic_store_n(&blk->count, blk->count + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    ts_close
+----------------------------------------------------------------------------*/
+void ts_close(struct ts_file *f)
+{
+    int s;
+
+    if (f == NULL) return;
+    for (s=0; s < TS_SERIES; s++) {
+        if (f->cur[s] == NULL) continue;
+        msync(f->cur[s], TS_BLOCK, MS_SYNC);
+        munmap(f->cur[s], TS_BLOCK);
+    }
+    if (f->hdr != NULL) {
+        msync(f->hdr, TS_BLOCK, MS_SYNC);
+        munmap(f->hdr, TS_BLOCK);
+    }
+    if (f->fd != -1) close(f->fd);
+    free(f);
+}
+
+/*--------------------------------------------------------------------------
+    ts_scan
+    Call fn for every sample of the series bits set in series, from_ms to
+    to_ms included, series after series in time order. fn returning non
+    zero stops the scan. hdr and stats (if not NULL) get the file header
+    and its size figures. 0, or -1 and errno.
+----------------------------------------------------------------------------*/
+int ts_scan(const char *path, uint32_t series, int64_t from_ms, int64_t to_ms,
+            ts_sample_fn fn, void *arg, struct ts_header *hdr, struct ts_stats *stats)
+{
+    const struct ts_block *blocks;
+    struct ts_header h;
+    struct ts_cursor c;
+    struct stat st;
+    uint32_t i, nblocks;
+    int64_t t;
+    float v;
+    int fd, s, stop = 0;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) return -1;
+    if (fstat(fd, &st) == -1 || pread(fd, &h, sizeof(h), 0) != sizeof(h)) {
+        close(fd);
+        return -1;
+    }
+    if (memcmp(h.magic, TS_MAGIC, 4) != 0 || h.version != TS_VERSION || h.block_size != TS_BLOCK) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    nblocks = h.nblocks;
+    if ((off_t)TS_BLOCK * (nblocks + 1) > st.st_size) nblocks = st.st_size / TS_BLOCK - 1;
+    if (hdr != NULL) *hdr = h;
+    if (stats != NULL) memset(stats, 0, sizeof(*stats));
+    if (nblocks == 0) {
+        close(fd);
+        return 0;
+    }
+
+    blocks = mmap(NULL, (size_t)TS_BLOCK * nblocks, PROT_READ, MAP_SHARED, fd, TS_BLOCK);
+    close(fd);
+    if (blocks == MAP_FAILED) return -1;
+
+    for (s=0; s < TS_SERIES && !stop; s++) {
+        if (!(series & (1U << s))) continue;
+        for (i=0; i < nblocks && !stop; i++) {
+            const struct ts_block *blk = &blocks[i];
+            uint32_t nbits = __atomic_load_n(&blk->nbits, __ATOMIC_ACQUIRE);
+
+            if (blk->series != s || blk->count == 0) continue;
+            if (nbits > DATABITS) nbits = DATABITS;
+            cursorStart(&c, blk);
+            t = blk->first_ms;
+            v = blk->first_value;
+            do {
+                if (stats != NULL) stats->samples++;
+                if (t >= from_ms && t <= to_ms && fn != NULL && fn(arg, s, t, v) != 0) stop = 1;
+            } while (!stop && decode(blk->data, nbits, &c, &t, &v) == 0);
+            if (stats != NULL) {
+                stats->blocks++;
+                stats->bytes += offsetof(struct ts_block, data) + (nbits + 7) / 8;
+            }
+        }
+    }
+    munmap((void *)blocks, (size_t)TS_BLOCK * nblocks);
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* ========================================================================== */
+/*                                                                            */
+/*   tstore.h                                                                 */
+/*   (c) 2016 TheDrake                                                        */
+/*                                                                            */
+/*   Description                                                              */
+/*   Compressed time series of the values of one meter, one file a day     */
+/*                                                                            */
+/*   A file is a header page and 4 KiB blocks, each holding the samples of  */
+/*   one series (value, SNAP_x) in time order: timestamps delta-of-delta   */
+/*   and float32 values XOR encoded as in Facebook's Gorilla. Blocks are    */
+/*   mapped and appended in place, a sample counts once the block bit      */
+/*   length covers it, so a file is readable whatever the writer died at.  */
+/*                                                                            */
+/* ========================================================================== */
+
+#ifndef __TSTORE_H__
+#define __TSTORE_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {		/* respect c++ callers */
+#endif
+
+#define TS_MAGIC          "SDTS"
+#define TS_VERSION        1
+#define TS_BLOCK          4096
+#define TS_SERIES         16       /* Series ids 0-15, sdm120c uses SNAP_x */
+#define TS_MAXBITS        80       /* Worst case of one sample */
+
+struct ts_header {
+    char     magic[4];
+    uint16_t version;
+    uint16_t block_size;           /* TS_BLOCK */
+    uint32_t nblocks;              /* Blocks after the header page */
+    uint16_t address;              /* Meter */
+    uint16_t reserved;
+    int32_t  day;                  /* YYYYMMDD, local time */
+    char     bus[32];
+};
+
+struct ts_block {
+    uint16_t series;
+    uint16_t reserved;
+    uint32_t count;                /* Samples, 0 = unused block */
+    int64_t  first_ms;             /* First sample, raw */
+    float    first_value;
+    uint32_t nbits;                /* Bits of data[] holding samples 2.. */
+    uint8_t  data[TS_BLOCK - 24];
+};
+
+/* Encoder / decoder state of a block */
+struct ts_cursor {
+    uint32_t pos;                  /* Bit position in data[] */
+    int64_t  last_ms;
+    int64_t  last_delta;
+    uint32_t last_bits;            /* Last value, float32 bits */
+    int      lead;                 /* Last XOR window, lead 32 = none */
+    int      trail;
+};
+
+struct ts_file;
+
+struct ts_stats {
+    uint64_t samples;
+    uint64_t bytes;                /* Block bytes in use, block headers included */
+    uint32_t blocks;
+};
+
+typedef int (*ts_sample_fn)(void *arg, int series, int64_t time_ms, float value);
+
+extern struct ts_file *ts_open(const char *path, const char *bus, int address, int32_t day);
+extern int  ts_append(struct ts_file *f, int series, int64_t time_ms, float value);
+extern void ts_close(struct ts_file *f);
+extern int  ts_scan(const char *path, uint32_t series, int64_t from_ms, int64_t to_ms,
+                    ts_sample_fn fn, void *arg, struct ts_header *hdr, struct ts_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __TSTORE_H__ */